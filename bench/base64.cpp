@@ -0,0 +1,116 @@
+#include <base64.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+/**
+ * Measures base64 throughput of the previous byte at a time implementation
+ * against every kernel the cpu supports, feeding 16KiB chunks like the request body reader.
+ *
+ * Usage: bench_base64 [megabytes]
+ */
+
+namespace legacy {
+    static const char encode_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    static void encode(std::string& out, const uint8_t* bin, size_t len) {
+        size_t fast_size = len - len % 3;
+        for (size_t i = 0; i < fast_size;) {
+            uint32_t octet_a = bin[i++];
+            uint32_t octet_b = bin[i++];
+            uint32_t octet_c = bin[i++];
+            uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
+            out += encode_table[(triple >> 3 * 6) & 0x3F];
+            out += encode_table[(triple >> 2 * 6) & 0x3F];
+            out += encode_table[(triple >> 1 * 6) & 0x3F];
+            out += encode_table[(triple >> 0 * 6) & 0x3F];
+        }
+    }
+
+    static void decode(std::string& out, const char* data, size_t len) {
+        for(size_t i = 0; i < len; i++) {
+            char c = data[i];
+            if(c >='A' && c <= 'Z') continue;
+            if(c >='a' && c <= 'z') continue;
+            if(c >='0' && c <= '9') continue;
+            if(c == '+' || c == '/' || c == '=') continue;
+            return;
+        }
+        uint8_t table[256] = {};
+        for(int i = 0; i < 64; i++) table[static_cast<uint8_t>(encode_table[i])] = i;
+        for(size_t i = 0; i + 4 <= len; i += 4) {
+            uint32_t triple = (table[static_cast<uint8_t>(data[i])] << 18) + (table[static_cast<uint8_t>(data[i + 1])] << 12)
+                + (table[static_cast<uint8_t>(data[i + 2])] << 6) + table[static_cast<uint8_t>(data[i + 3])];
+            out += static_cast<char>((triple >> 2 * 8) & 0xFF);
+            out += static_cast<char>((triple >> 1 * 8) & 0xFF);
+            out += static_cast<char>((triple >> 0 * 8) & 0xFF);
+        }
+    }
+}
+
+static constexpr size_t chunk_size = 16 * 1024;
+
+template<typename Func>
+static double measure(size_t bytes, Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - start;
+    return bytes / dur.count() / 1e9;
+}
+
+int main(int argc, const char** argv) {
+    size_t size = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 256) * 1024 * 1024;
+    size -= size % chunk_size;
+
+    std::string input(size, '\0');
+    std::mt19937 rng(42);
+    for(auto& c : input) c = static_cast<char>(rng());
+    std::string encoded;
+    base64_encode_stream encoder;
+    encoder.feed(encoded, input.data(), input.size());
+    encoder.flush(encoded);
+
+    std::string out;
+    out.reserve(encoded.size());
+    auto enc = measure(size, [&]() {
+        out.clear();
+        for(size_t i = 0; i < size; i += chunk_size)
+            legacy::encode(out, reinterpret_cast<const uint8_t*>(&input[i]), chunk_size);
+    });
+    auto dec = measure(encoded.size(), [&]() {
+        out.clear();
+        for(size_t i = 0; i < encoded.size(); i += chunk_size)
+            legacy::decode(out, &encoded[i], std::min(chunk_size, encoded.size() - i));
+    });
+    printf("%-8s encode %6.2f GB/s decode %6.2f GB/s\n", "legacy", enc, dec);
+
+    for(auto impl : { base64_impl::scalar, base64_impl::ssse3, base64_impl::avx2 }) {
+        if(!base64_set_impl(impl)) {
+            printf("%-8s not supported\n", base64_impl_name(impl));
+            continue;
+        }
+        enc = measure(size, [&]() {
+            out.clear();
+            base64_encode_stream stream;
+            for(size_t i = 0; i < size; i += chunk_size)
+                stream.feed(out, &input[i], chunk_size);
+            stream.flush(out);
+        });
+        dec = measure(encoded.size(), [&]() {
+            out.clear();
+            base64_decode_stream stream;
+            for(size_t i = 0; i < encoded.size(); i += chunk_size)
+                stream.feed(out, &encoded[i], std::min(chunk_size, encoded.size() - i));
+            stream.flush(out);
+        });
+        if(out != input) {
+            printf("%-8s roundtrip mismatch\n", base64_impl_name(impl));
+            return 1;
+        }
+        printf("%-8s encode %6.2f GB/s decode %6.2f GB/s\n", base64_impl_name(impl), enc, dec);
+    }
+    return 0;
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+/**
+ * Helpers shared by the benchmarks: latency percentiles, cpu time and memory of a process, and result output.
+ *
+ * Every result is printed as one line to stdout. If BENCH_JSON names a file the result is also appended
+ * to it as a json object on a line of its own, bench/run.sh collects those into one file per commit.
+ */
+namespace bench {
+    struct latency {
+        size_t count = 0;
+        double mean_us = 0;
+        double p50_us = 0;
+        double p90_us = 0;
+        double p99_us = 0;
+        double p999_us = 0;
+        double max_us = 0;
+    };
+
+    // Sorts samples (microseconds)
+    inline latency summarize(std::vector<double>& samples) {
+        latency res;
+        if(samples.empty()) return res;
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for(auto e : samples) sum += e;
+        auto pct = [&](double p) { return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))]; };
+        res.count = samples.size();
+        res.mean_us = sum / samples.size();
+        res.p50_us = pct(0.5);
+        res.p90_us = pct(0.9);
+        res.p99_us = pct(0.99);
+        res.p999_us = pct(0.999);
+        res.max_us = samples.back();
+        return res;
+    }
+
+    struct process_usage {
+        // user + system time of all threads
+        double cpu_us = 0;
+        size_t rss_kb = 0;
+        size_t peak_rss_kb = 0;
+    };
+
+    // Read from /proc, pid 0 is this process
+    inline bool read_usage(pid_t pid, process_usage& out) {
+        char path[64];
+        if(pid == 0) snprintf(path, sizeof(path), "/proc/self/stat");
+        else snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+        auto f = fopen(path, "r");
+        if(!f) return false;
+        char buf[1024];
+        auto len = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[len] = '\0';
+        // The command name may contain spaces, fields are counted from the closing parenthesis
+        auto p = strrchr(buf, ')');
+        if(!p) return false;
+        unsigned long utime = 0, stime = 0;
+        if(sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return false;
+        out.cpu_us = (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+
+        if(pid == 0) snprintf(path, sizeof(path), "/proc/self/status");
+        else snprintf(path, sizeof(path), "/proc/%d/status", static_cast<int>(pid));
+        f = fopen(path, "r");
+        if(!f) return false;
+        char line[256];
+        while(fgets(line, sizeof(line), f)) {
+            if(strncmp(line, "VmRSS:", 6) == 0) out.rss_kb = strtoul(line + 6, nullptr, 10);
+            else if(strncmp(line, "VmHWM:", 6) == 0) out.peak_rss_kb = strtoul(line + 6, nullptr, 10);
+        }
+        fclose(f);
+        return true;
+    }
+
+    class result {
+        std::string m_name;
+        // Values are already formatted as json
+        std::vector<std::pair<std::string, std::string>> m_fields;
+
+        static std::string quote(const std::string& str) {
+            std::string res = "\"";
+            for(char c : str) {
+                if(c == '"' || c == '\\') res += '\\';
+                if(static_cast<unsigned char>(c) >= 0x20) res += c;
+            }
+            return res + "\"";
+        }
+    public:
+        explicit result(std::string name) : m_name(std::move(name)) {}
+
+        result& add(const char* key, double value) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%.3f", value);
+            m_fields.emplace_back(key, buf);
+            return *this;
+        }
+        result& add(const char* key, uint64_t value) {
+            m_fields.emplace_back(key, std::to_string(value));
+            return *this;
+        }
+        result& add(const char* key, const std::string& value) {
+            m_fields.emplace_back(key, quote(value));
+            return *this;
+        }
+        result& add(const latency& l) {
+            add("requests", static_cast<uint64_t>(l.count));
+            add("mean_us", l.mean_us);
+            add("p50_us", l.p50_us);
+            add("p90_us", l.p90_us);
+            add("p99_us", l.p99_us);
+            add("p99.9_us", l.p999_us);
+            return add("max_us", l.max_us);
+        }
+
+        void write() const {
+            printf("%-32s", m_name.c_str());
+            for(auto& e : m_fields) printf(" %s=%s", e.first.c_str(), e.second.c_str());
+            printf("\n");
+            fflush(stdout);
+
+            auto file = getenv("BENCH_JSON");
+            if(!file || !*file) return;
+            auto f = fopen(file, "a");
+            if(!f) {
+                fprintf(stderr, "Failed to open %s\n", file);
+                return;
+            }
+            fprintf(f, "{\"name\": %s", quote(m_name).c_str());
+            for(auto& e : m_fields) fprintf(f, ", \"%s\": %s", e.first.c_str(), e.second.c_str());
+            fprintf(f, "}\n");
+            fclose(f);
+        }
+    };
+}
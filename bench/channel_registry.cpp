@@ -0,0 +1,96 @@
+#include <channel_registry.h>
+#include <grpc/grpc.h>
+#include <grpc/support/log.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Measures channel lookup throughput with 1, 8 and 64 threads for the channel registry
+ * and the previous single mutex cache that polled the connectivity state on every lookup.
+ *
+ * Usage: bench_channel_registry [--watch] [host...]
+ * Without --watch the connectivity watcher is not started, which measures the lookup alone.
+ */
+
+class mutex_cache {
+    std::mutex m_mtx;
+    std::unordered_map<std::string, std::shared_ptr<grpc_channel>> m_cache;
+public:
+    std::shared_ptr<grpc_channel> get(const std::string& host) {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto it = m_cache.find(host);
+        if(it != m_cache.end()) {
+            auto state = grpc_channel_check_connectivity_state(it->second.get(), true);
+            if(state != GRPC_CHANNEL_SHUTDOWN && state != GRPC_CHANNEL_TRANSIENT_FAILURE) return it->second;
+            m_cache.erase(it);
+        }
+        grpc_channel_args args;
+        args.num_args = 0;
+        std::shared_ptr<grpc_channel> channel(grpc_insecure_channel_create(host.c_str(), &args, NULL),
+                                                [](grpc_channel* ch){ if(ch) grpc_channel_destroy(ch); });
+        if(channel.get() != nullptr) m_cache.insert({host, channel});
+        return channel;
+    }
+    void clear() {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        m_cache.clear();
+    }
+};
+
+template<typename Cache>
+static void run(const char* name, Cache& cache, const std::vector<std::string>& hosts, size_t nthreads) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> total{0};
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            uint64_t n = 0;
+            size_t i = t;
+            while(!stop.load(std::memory_order_relaxed)) {
+                auto ch = cache.get(hosts[i++ % hosts.size()]);
+                if(ch) n++;
+            }
+            total += n;
+        });
+    }
+    auto duration = std::chrono::seconds(1);
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for(auto& e : threads) e.join();
+    printf("%-10s threads=%-3zu %10.2f Mlookups/s\n", name, nthreads, total.load() / 1e6);
+}
+
+int main(int argc, char** argv) {
+    bool watch = false;
+    std::vector<std::string> hosts;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--watch") == 0) watch = true;
+        else hosts.push_back(argv[i]);
+    }
+    if(hosts.empty()) hosts = { "127.0.0.1:9090", "127.0.0.1:9091", "127.0.0.1:9092", "127.0.0.1:9093" };
+
+    grpc_init();
+    gpr_set_log_verbosity(GPR_LOG_SEVERITY_ERROR);
+    {
+        channel_registry registry;
+        mutex_cache legacy;
+        if(watch) registry.start();
+        for(auto& h : hosts) {
+            registry.get(h);
+            legacy.get(h);
+        }
+        for(size_t n : { 1, 8, 64 }) {
+            run("registry", registry, hosts, n);
+            run("mutex", legacy, hosts, n);
+        }
+        registry.stop();
+        registry.clear();
+        legacy.clear();
+    }
+    grpc_shutdown();
+    return 0;
+}
@@ -0,0 +1,305 @@
+#include <base64.h>
+#include <grpc_web.h>
+#include <health_checker.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <grpc/support/log.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Correctness checks for the parts of the module that can be tested without Apache or a backend,
+ * registered with ctest one group per test. Without arguments every group runs.
+ *
+ * Usage: bench_checks [base64] [frames] [timeout] [health]
+ */
+
+static size_t g_failures = 0;
+
+#define CHECK(expr) check((expr), #expr, __FILE__, __LINE__)
+
+static bool check(bool ok, const char* expr, const char* file, int line) {
+    if(!ok) {
+        printf("%s:%d: check failed: %s\n", file, line, expr);
+        g_failures++;
+    }
+    return ok;
+}
+
+static std::string encode(const std::string& in, size_t chunk) {
+    std::string out;
+    base64_encode_stream stream;
+    for(size_t i = 0; i < in.size(); i += chunk)
+        stream.feed(out, &in[i], std::min(chunk, in.size() - i));
+    stream.flush(out);
+    return out;
+}
+
+static bool decode(const std::string& in, size_t chunk, std::string& out) {
+    out.clear();
+    base64_decode_stream stream;
+    for(size_t i = 0; i < in.size(); i += chunk)
+        stream.feed(out, &in[i], std::min(chunk, in.size() - i));
+    stream.flush(out);
+    return !stream.failed();
+}
+
+static void check_base64() {
+    // Long enough for several iterations of every simd loop plus every tail length
+    std::vector<std::string> inputs;
+    std::mt19937 rng(42);
+    for(size_t len : { 0, 1, 2, 3, 4, 11, 12, 13, 23, 24, 25, 31, 32, 33, 47, 48, 49, 95, 96, 97, 1000, 65537 }) {
+        std::string s(len, '\0');
+        for(auto& c : s) c = static_cast<char>(rng());
+        inputs.push_back(std::move(s));
+    }
+    const size_t chunks[] = { 1, 2, 3, 5, 16, 31, 4096, SIZE_MAX };
+
+    // The scalar kernel is the reference every other one has to match byte for byte
+    base64_set_impl(base64_impl::scalar);
+    std::vector<std::string> expected;
+    for(auto& in : inputs) expected.push_back(encode(in, SIZE_MAX));
+    CHECK(expected[1] == encode(inputs[1], 1) && expected[1].size() == 4 && expected[1].substr(2) == "==");
+    CHECK(encode("Man", SIZE_MAX) == "TWFu");
+    CHECK(encode("\xff\xfe\xfd", SIZE_MAX) == "//79");
+
+    // Invalid characters at every offset of the block sizes the kernels handle at once
+    std::vector<std::string> invalid;
+    for(size_t pos = 0; pos < 96; pos++) {
+        for(char bad : { '*', '-', '_', '\0', '\x80', ' ' }) {
+            auto s = expected[21].substr(0, 128);
+            s[pos] = bad;
+            invalid.push_back(std::move(s));
+        }
+    }
+
+    for(auto impl : { base64_impl::scalar, base64_impl::ssse3, base64_impl::avx2 }) {
+        if(!base64_set_impl(impl)) {
+            printf("%-8s not supported, skipped\n", base64_impl_name(impl));
+            continue;
+        }
+        auto failures = g_failures;
+        std::string out;
+        for(size_t i = 0; i < inputs.size(); i++) {
+            for(auto chunk : chunks) {
+                CHECK(encode(inputs[i], chunk) == expected[i]);
+                CHECK(decode(expected[i], chunk, out) && out == inputs[i]);
+            }
+        }
+        // grpc-web-text clients may send every frame as separately padded base64
+        CHECK(decode(expected[1] + expected[2] + expected[21], SIZE_MAX, out) && out == inputs[1] + inputs[2] + inputs[21]);
+        CHECK(decode(expected[2] + expected[1], 3, out) && out == inputs[2] + inputs[1]);
+        for(auto& s : invalid) CHECK(!decode(s, SIZE_MAX, out));
+        CHECK(!decode("TW=u", SIZE_MAX, out));
+        CHECK(!decode("TWFu=", SIZE_MAX, out));
+        printf("%-8s %s\n", base64_impl_name(impl), failures == g_failures ? "ok" : "FAILED");
+    }
+}
+
+static std::string frame(uint8_t flags, const std::string& payload) {
+    std::string res(5, '\0');
+    res[0] = static_cast<char>(flags);
+    for(int i = 0; i < 4; i++) res[1 + i] = static_cast<char>(payload.size() >> (24 - 8 * i));
+    return res + payload;
+}
+
+struct frame_result {
+    uint8_t flags;
+    std::string payload;
+};
+
+// Feeds data in chunks of the given size and collects every completed frame
+static bool feed(grpc_web_frame_reader& reader, const std::string& data, size_t chunk, std::vector<frame_result>& out) {
+    grpc_web_frame_reader::callback cb = [&](uint8_t flags, byte_buffer_ptr msg) {
+        frame_result res{ flags, {} };
+        grpc_byte_buffer_reader r;
+        if(!grpc_byte_buffer_reader_init(&r, msg.get())) return false;
+        grpc_slice s;
+        while(grpc_byte_buffer_reader_next(&r, &s)) {
+            res.payload.append(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(s)), GRPC_SLICE_LENGTH(s));
+            grpc_slice_unref(s);
+        }
+        grpc_byte_buffer_reader_destroy(&r);
+        out.push_back(std::move(res));
+        return true;
+    };
+    for(size_t i = 0; i < data.size(); i += chunk) {
+        if(!reader.feed(&data[i], std::min(chunk, data.size() - i), cb)) return false;
+    }
+    return true;
+}
+
+static void check_frames() {
+    const std::string hello = "\x0a\x05World";
+    const auto stream = frame(0, hello) + frame(0, "") + frame(grpc_web_frame_reader::flag_compressed, "abc")
+        + frame(grpc_web_frame_reader::flag_trailer, "grpc-status:0\r\n");
+
+    // Every split, including ones inside the 5 byte header
+    for(size_t chunk = 1; chunk <= stream.size(); chunk++) {
+        grpc_web_frame_reader reader(1024);
+        std::vector<frame_result> frames;
+        CHECK(feed(reader, stream, chunk, frames));
+        CHECK(!reader.has_partial_frame() && !reader.failed());
+        if(!CHECK(frames.size() == 4)) continue;
+        CHECK(frames[0].flags == 0 && frames[0].payload == hello);
+        CHECK(frames[1].flags == 0 && frames[1].payload.empty());
+        CHECK(frames[2].flags == grpc_web_frame_reader::flag_compressed && frames[2].payload == "abc");
+        CHECK(frames[3].flags == grpc_web_frame_reader::flag_trailer && frames[3].payload == "grpc-status:0\r\n");
+    }
+
+    // Truncated inside the header and inside the payload
+    for(size_t len : { size_t(1), size_t(4), size_t(5), size_t(8) }) {
+        grpc_web_frame_reader reader(1024);
+        std::vector<frame_result> frames;
+        CHECK(feed(reader, frame(0, hello).substr(0, len), SIZE_MAX, frames));
+        CHECK(frames.empty() && reader.has_partial_frame() && !reader.failed());
+    }
+
+    // A frame of exactly the maximum size passes, one byte more is rejected from the header alone
+    {
+        grpc_web_frame_reader reader(16);
+        std::vector<frame_result> frames;
+        CHECK(feed(reader, frame(0, std::string(16, 'x')), 3, frames) && frames.size() == 1);
+        CHECK(!feed(reader, frame(0, std::string(17, 'x')).substr(0, 5), SIZE_MAX, frames));
+        CHECK(reader.failed() && reader.too_large() && frames.size() == 1);
+        // Stays failed
+        CHECK(!feed(reader, frame(0, ""), SIZE_MAX, frames) && frames.size() == 1);
+    }
+    {
+        // Lengths above 2^31 must not wrap around
+        grpc_web_frame_reader reader(1024);
+        std::vector<frame_result> frames;
+        CHECK(!feed(reader, std::string("\x00\xff\xff\xff\xff", 5), SIZE_MAX, frames) && reader.too_large());
+    }
+    {
+        // A callback refusing a frame fails the reader without marking it too large
+        grpc_web_frame_reader reader(1024);
+        auto data = frame(0, hello) + frame(0, hello);
+        size_t calls = 0;
+        CHECK(!reader.feed(data.data(), data.size(), [&](uint8_t, byte_buffer_ptr) { calls++; return false; }));
+        CHECK(calls == 1 && reader.failed() && !reader.too_large());
+    }
+}
+
+static void check_timeout() {
+    struct timeout_case {
+        const char* value;
+        bool ok;
+        uint64_t ms;
+    };
+    const timeout_case cases[] = {
+        { "1H", true, 3600000 },
+        { "2M", true, 120000 },
+        { "3S", true, 3000 },
+        { "15m", true, 15 },
+        { "1500u", true, 2 },
+        { "1000u", true, 1 },
+        { "1n", true, 1 },
+        { "2000001n", true, 3 },
+        // Already expired, the call still gets a deadline instead of none
+        { "0m", true, 1 },
+        { "0S", true, 1 },
+        // The spec allows at most 8 digits
+        { "99999999H", true, 99999999ull * 3600000 },
+        { "00000001S", true, 1000 },
+        { "123456789S", false, 0 },
+        { "", false, 0 },
+        { "S", false, 0 },
+        { "10", false, 0 },
+        { "1x", false, 0 },
+        { "1s", false, 0 },
+        { "-1S", false, 0 },
+        { "1 S", false, 0 },
+        { " 1S", false, 0 },
+        { "1.5S", false, 0 },
+    };
+    for(auto& c : cases) {
+        uint64_t ms = 0;
+        bool ok = parse_grpc_timeout(c.value, strlen(c.value), ms);
+        if(!CHECK(ok == c.ok && (!ok || ms == c.ms)))
+            printf("  parse_grpc_timeout(\"%s\") = %d, %llu ms\n", c.value, ok, static_cast<unsigned long long>(ms));
+    }
+}
+
+static void check_health() {
+    using state = health_checker::state;
+    struct health_case {
+        std::string data;
+        state expected;
+    };
+    const health_case cases[] = {
+        { std::string("\x08\x01", 2), state::serving },
+        { std::string("\x08\x02", 2), state::not_serving },
+        // SERVICE_UNKNOWN
+        { std::string("\x08\x03", 2), state::not_serving },
+        // All fields default, status is UNKNOWN
+        { std::string(), state::not_serving },
+        // Unknown fields of every wire type are skipped
+        { std::string("\x12\x02" "ab" "\x08\x01", 6), state::serving },
+        { std::string("\x19" "12345678" "\x08\x01", 11), state::serving },
+        { std::string("\x25" "1234" "\x08\x01", 7), state::serving },
+        { std::string("\x10\x05\x08\x01", 4), state::serving },
+        // The last occurrence wins
+        { std::string("\x08\x01\x08\x02", 4), state::not_serving },
+        { std::string("\x08\x02\x08\x01", 4), state::serving },
+        // Multi byte varint for the status value
+        { std::string("\x08\x81\x00", 3), state::serving },
+        // Truncated or malformed
+        { std::string("\x08", 1), state::not_serving },
+        { std::string("\x08\x81", 2), state::not_serving },
+        { std::string("\x12\x05" "ab", 4), state::not_serving },
+        { std::string("\x19" "1234", 5), state::not_serving },
+        { std::string("\x25" "12", 3), state::not_serving },
+        { std::string("\x0b\x08\x01", 3), state::not_serving },
+        { std::string(11, '\xff'), state::not_serving },
+    };
+    for(auto& c : cases) {
+        auto res = health_checker::decode_response(c.data.data(), c.data.size());
+        if(!CHECK(res == c.expected))
+            printf("  case of %zu bytes decoded to %u\n", c.data.size(), static_cast<unsigned>(res));
+    }
+    // Round trip of the request encoding, field 1 with a length prefix
+    CHECK(health_checker::encode_request("") == "");
+    CHECK(health_checker::encode_request("helloworld.Greeter") == std::string("\x0a\x12") + "helloworld.Greeter");
+    CHECK(health_checker::encode_request(std::string(200, 'a')).substr(0, 3) == std::string("\x0a\xc8\x01", 3));
+}
+
+int main(int argc, char** argv) {
+    gpr_set_log_verbosity(GPR_LOG_SEVERITY_ERROR);
+    grpc_init();
+    struct group {
+        const char* name;
+        void (*run)();
+    };
+    const group groups[] = {
+        { "base64", check_base64 },
+        { "frames", check_frames },
+        { "timeout", check_timeout },
+        { "health", check_health },
+    };
+    int res = 0;
+    for(auto& g : groups) {
+        bool selected = argc < 2;
+        for(int i = 1; i < argc; i++) selected |= strcmp(argv[i], g.name) == 0;
+        if(!selected) continue;
+        g_failures = 0;
+        g.run();
+        printf("%-8s %s\n", g.name, g_failures == 0 ? "passed" : "FAILED");
+        if(g_failures != 0) res = 1;
+    }
+    for(int i = 1; i < argc; i++) {
+        bool known = false;
+        for(auto& g : groups) known |= strcmp(argv[i], g.name) == 0;
+        if(!known) {
+            fprintf(stderr, "Unknown check %s\n", argv[i]);
+            res = 1;
+        }
+    }
+    grpc_shutdown();
+    return res;
+}
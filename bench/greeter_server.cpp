@@ -0,0 +1,203 @@
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <grpc/support/log.h>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * helloworld.Greeter backend for the benchmarks, so nothing outside of the repo is needed.
+ *
+ * /helloworld.Greeter/SayHello answers with one HelloReply, /helloworld.Greeter/SayHelloStreamReply
+ * with [stream messages] of them. The reply is "Hello <name>" or, with [payload size] set, that many bytes.
+ * Every reply is delayed by [delay ms]. Each of the [threads] workers handles one call at a time.
+ *
+ * Usage: bench_greeter_server [address] [payload size] [delay ms] [stream messages] [threads]
+ * Runs until SIGINT or SIGTERM.
+ */
+
+struct options {
+    size_t payload = 0;
+    uint64_t delay_ms = 0;
+    size_t stream_messages = 10;
+};
+
+enum tag : uintptr_t {
+    tag_new_call = 1,
+    tag_batch,
+    tag_shutdown
+};
+
+static void* to_tag(tag t) { return reinterpret_cast<void*>(static_cast<uintptr_t>(t)); }
+
+static std::string decode_name(grpc_byte_buffer* msg) {
+    // helloworld.HelloRequest { string name = 1; }, other fields are not expected here
+    std::string res;
+    grpc_byte_buffer_reader reader;
+    if(!msg || !grpc_byte_buffer_reader_init(&reader, msg)) return res;
+    auto all = grpc_byte_buffer_reader_readall(&reader);
+    grpc_byte_buffer_reader_destroy(&reader);
+    auto p = GRPC_SLICE_START_PTR(all);
+    auto end = GRPC_SLICE_END_PTR(all);
+    if(p < end && *p++ == 0x0a) {
+        size_t len = 0;
+        for(int shift = 0; p < end && shift < 64; shift += 7) {
+            auto b = *p++;
+            len |= static_cast<size_t>(b & 0x7f) << shift;
+            if(!(b & 0x80)) break;
+        }
+        res.assign(reinterpret_cast<const char*>(p), std::min<size_t>(len, end - p));
+    }
+    grpc_slice_unref(all);
+    return res;
+}
+
+static std::string encode_reply(const std::string& message) {
+    // helloworld.HelloReply { string message = 1; }
+    std::string res = "\x0a";
+    auto len = message.size();
+    while(len >= 0x80) {
+        res += static_cast<char>((len & 0x7f) | 0x80);
+        len >>= 7;
+    }
+    res += static_cast<char>(len);
+    return res + message;
+}
+
+static bool run_batch(grpc_call* call, grpc_completion_queue* cq, grpc_op* ops, size_t nops) {
+    if(grpc_call_start_batch(call, ops, nops, to_tag(tag_batch), nullptr) != GRPC_CALL_OK) return false;
+    return grpc_completion_queue_pluck(cq, to_tag(tag_batch), gpr_inf_future(GPR_CLOCK_REALTIME), nullptr).success != 0;
+}
+
+static bool send_reply(grpc_call* call, grpc_completion_queue* cq, const std::string& reply) {
+    auto slice = grpc_slice_from_copied_buffer(reply.data(), reply.size());
+    auto msg = grpc_raw_byte_buffer_create(&slice, 1);
+    grpc_slice_unref(slice);
+    grpc_op op;
+    memset(&op, 0, sizeof(op));
+    op.op = GRPC_OP_SEND_MESSAGE;
+    op.data.send_message.send_message = msg;
+    auto ok = run_batch(call, cq, &op, 1);
+    grpc_byte_buffer_destroy(msg);
+    return ok;
+}
+
+static void handle_call(grpc_call* call, const std::string& method, grpc_completion_queue* cq, const options& opt) {
+    grpc_byte_buffer* request = nullptr;
+    grpc_op ops[3];
+    memset(ops, 0, sizeof(ops));
+    ops[0].op = GRPC_OP_SEND_INITIAL_METADATA;
+    ops[1].op = GRPC_OP_RECV_MESSAGE;
+    ops[1].data.recv_message.recv_message = &request;
+    auto ok = run_batch(call, cq, ops, 2);
+    auto name = decode_name(request);
+    if(request) grpc_byte_buffer_destroy(request);
+
+    size_t replies = 0;
+    auto code = GRPC_STATUS_OK;
+    if(method == "/helloworld.Greeter/SayHello") replies = 1;
+    else if(method == "/helloworld.Greeter/SayHelloStreamReply") replies = opt.stream_messages;
+    else code = GRPC_STATUS_UNIMPLEMENTED;
+
+    auto reply = encode_reply(opt.payload ? std::string(opt.payload, 'x') : "Hello " + name);
+    for(size_t i = 0; ok && i < replies; i++) {
+        if(opt.delay_ms) std::this_thread::sleep_for(std::chrono::milliseconds(opt.delay_ms));
+        ok = send_reply(call, cq, reply);
+    }
+
+    // The status (and close) is always sent, a cancelled call completes it right away
+    int cancelled = 0;
+    auto details = grpc_slice_from_static_string(code == GRPC_STATUS_OK ? "" : "Unknown method");
+    memset(ops, 0, sizeof(ops));
+    ops[0].op = GRPC_OP_SEND_STATUS_FROM_SERVER;
+    ops[0].data.send_status_from_server.status = code;
+    ops[0].data.send_status_from_server.status_details = &details;
+    ops[1].op = GRPC_OP_RECV_CLOSE_ON_SERVER;
+    ops[1].data.recv_close_on_server.cancelled = &cancelled;
+    run_batch(call, cq, ops, 2);
+}
+
+static void worker(grpc_server* server, grpc_completion_queue* cq, const options& opt) {
+    while(true) {
+        grpc_call* call = nullptr;
+        grpc_call_details details;
+        grpc_metadata_array metadata;
+        grpc_call_details_init(&details);
+        grpc_metadata_array_init(&metadata);
+        auto err = grpc_server_request_call(server, &call, &details, &metadata, cq, cq, to_tag(tag_new_call));
+        // Fails once the server shuts down
+        auto ok = err == GRPC_CALL_OK
+            && grpc_completion_queue_pluck(cq, to_tag(tag_new_call), gpr_inf_future(GPR_CLOCK_REALTIME), nullptr).success;
+        if(ok) {
+            std::string method(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(details.method)), GRPC_SLICE_LENGTH(details.method));
+            handle_call(call, method, cq, opt);
+        }
+        if(call) grpc_call_unref(call);
+        grpc_call_details_destroy(&details);
+        grpc_metadata_array_destroy(&metadata);
+        if(!ok) break;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* address = argc > 1 ? argv[1] : "127.0.0.1:9090";
+    options opt;
+    opt.payload = argc > 2 ? strtoull(argv[2], nullptr, 10) : 0;
+    opt.delay_ms = argc > 3 ? strtoull(argv[3], nullptr, 10) : 0;
+    opt.stream_messages = argc > 4 ? strtoull(argv[4], nullptr, 10) : 10;
+    size_t threads = argc > 5 ? strtoull(argv[5], nullptr, 10) : 64;
+    if(threads == 0) threads = 1;
+
+    // Block the signals before grpc starts any thread, main waits for them below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    grpc_init();
+    gpr_set_log_verbosity(GPR_LOG_SEVERITY_ERROR);
+    auto server = grpc_server_create(nullptr, nullptr);
+    // Workers pluck their own queue, so every call stays on the thread that accepted it
+    std::vector<grpc_completion_queue*> queues;
+    for(size_t i = 0; i < threads; i++) {
+        queues.push_back(grpc_completion_queue_create_for_pluck(nullptr));
+        grpc_server_register_completion_queue(server, queues.back(), nullptr);
+    }
+    auto shutdown_cq = grpc_completion_queue_create_for_pluck(nullptr);
+    grpc_server_register_completion_queue(server, shutdown_cq, nullptr);
+    if(!grpc_server_add_insecure_http2_port(server, address)) {
+        fprintf(stderr, "Failed to listen on %s\n", address);
+        return 1;
+    }
+    grpc_server_start(server);
+    printf("listening on %s payload=%zu delay=%llums stream_messages=%zu threads=%zu\n", address, opt.payload,
+        static_cast<unsigned long long>(opt.delay_ms), opt.stream_messages, threads);
+    fflush(stdout);
+
+    std::vector<std::thread> workers;
+    for(auto cq : queues) workers.emplace_back(worker, server, cq, std::cref(opt));
+
+    int sig;
+    sigwait(&signals, &sig);
+
+    grpc_server_shutdown_and_notify(server, shutdown_cq, to_tag(tag_shutdown));
+    grpc_server_cancel_all_calls(server);
+    grpc_completion_queue_pluck(shutdown_cq, to_tag(tag_shutdown), gpr_inf_future(GPR_CLOCK_REALTIME), nullptr);
+    for(auto& t : workers) t.join();
+    grpc_server_destroy(server);
+    for(auto cq : queues) {
+        grpc_completion_queue_shutdown(cq);
+        grpc_completion_queue_destroy(cq);
+    }
+    grpc_completion_queue_shutdown(shutdown_cq);
+    grpc_completion_queue_destroy(shutdown_cq);
+    grpc_shutdown();
+    return 0;
+}
@@ -0,0 +1,363 @@
+#include "bench_report.h"
+#include <grpc_proxy.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/support/log.h>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+ * Closed loop load generator, every worker starts the next call once the previous one finished.
+ *
+ * grpc mode calls the backend with grpc_proxy in this process, which measures the backend side of the module
+ * without Apache. http mode posts grpc-web requests (HTTP/1.1 with keep-alive, one connection per worker)
+ * to a running Apache, which measures the whole path.
+ *
+ * Reports p50/p90/p99/p99.9 latency, and the cpu time per request and the memory of the process doing
+ * the translation: this process in grpc mode, the pid in [pidfile] in http mode (run Apache with -X).
+ * Methods containing "Stream" count as server streaming.
+ * A call taking longer than call_timeout_ms is abandoned and counted as failed (and as a timeout),
+ * so a hanging call path shows up in the results instead of stalling the run.
+ *
+ * Usage: bench_load_generator <grpc|http> [target] [method] [concurrency] [seconds] [payload size] [pidfile]
+ */
+
+namespace {
+    constexpr uint64_t call_timeout_ms = 10000;
+
+    enum class outcome { ok, failed, timeout };
+
+    struct options {
+        bool http = false;
+        std::string host;
+        uint16_t port = 0;
+        std::string target;
+        std::string method;
+        bool streaming = false;
+        size_t concurrency = 1;
+        double seconds = 5;
+        std::string request;
+    };
+
+    std::string make_request(size_t payload) {
+        // helloworld.HelloRequest { string name = 1; }
+        std::string res;
+        if(payload == 0) return res;
+        res += '\x0a';
+        auto len = payload;
+        while(len >= 0x80) {
+            res += static_cast<char>((len & 0x7f) | 0x80);
+            len >>= 7;
+        }
+        res += static_cast<char>(len);
+        res.append(payload, 'x');
+        return res;
+    }
+
+    outcome call_grpc(const options& opt) {
+        grpc_proxy proxy;
+        proxy.set_call_timeout(call_timeout_ms);
+        if(!proxy.start(opt.target.c_str(), opt.method.c_str())) return outcome::failed;
+        header_list headers, headers_out;
+        grpc_proxy::status status;
+        bool ok;
+        if(!opt.streaming) {
+            ok = proxy.unary_call(headers, opt.request.data(), opt.request.size(), headers_out, nullptr, status);
+        } else {
+            auto slice = grpc_slice_from_copied_buffer(opt.request.data(), opt.request.size());
+            auto msg = grpc_raw_byte_buffer_create(&slice, 1);
+            grpc_slice_unref(slice);
+            ok = proxy.start_stream(headers, headers_out, nullptr) && proxy.write(msg) && proxy.finish(status);
+        }
+        if(!ok) return outcome::failed;
+        if(status.status == GRPC_STATUS_DEADLINE_EXCEEDED) return outcome::timeout;
+        return status.status == GRPC_STATUS_OK ? outcome::ok : outcome::failed;
+    }
+
+    /**
+     * Minimal HTTP/1.1 client for grpc-web (binary) calls, reconnects whenever the server closes the connection.
+     */
+    class http_client {
+        const options& m_opt;
+        std::string m_request;
+        int m_fd = -1;
+        std::string m_buf;
+        size_t m_pos = 0;
+        // The last send or recv ran into the socket timeout
+        bool m_timed_out = false;
+
+        bool connect_server() {
+            close_server();
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* res = nullptr;
+            auto port = std::to_string(m_opt.port);
+            if(getaddrinfo(m_opt.host.c_str(), port.c_str(), &hints, &res) != 0) return false;
+            for(auto ai = res; ai; ai = ai->ai_next) {
+                m_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if(m_fd < 0) continue;
+                if(connect(m_fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+                close(m_fd);
+                m_fd = -1;
+            }
+            freeaddrinfo(res);
+            if(m_fd < 0) return false;
+            int one = 1;
+            setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            timeval timeout = { static_cast<time_t>(call_timeout_ms / 1000), static_cast<suseconds_t>(call_timeout_ms % 1000 * 1000) };
+            setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            return true;
+        }
+        void close_server() {
+            if(m_fd >= 0) close(m_fd);
+            m_fd = -1;
+            m_buf.clear();
+            m_pos = 0;
+        }
+        bool fill() {
+            if(m_pos > 0 && m_pos == m_buf.size()) {
+                m_buf.clear();
+                m_pos = 0;
+            }
+            char tmp[16 * 1024];
+            auto n = recv(m_fd, tmp, sizeof(tmp), 0);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) m_timed_out = true;
+            if(n <= 0) return false;
+            m_buf.append(tmp, n);
+            return true;
+        }
+        bool read_line(std::string& line) {
+            while(true) {
+                auto end = m_buf.find("\r\n", m_pos);
+                if(end != std::string::npos) {
+                    line.assign(m_buf, m_pos, end - m_pos);
+                    m_pos = end + 2;
+                    return true;
+                }
+                if(!fill()) return false;
+            }
+        }
+        bool read_bytes(std::string& out, size_t len) {
+            while(m_buf.size() - m_pos < len) {
+                if(!fill()) return false;
+            }
+            out.append(m_buf, m_pos, len);
+            m_pos += len;
+            return true;
+        }
+        bool read_response(std::string& body, bool& keep_alive) {
+            std::string line;
+            if(!read_line(line) || line.compare(0, 5, "HTTP/") != 0) return false;
+            auto sp = line.find(' ');
+            if(sp == std::string::npos || atoi(line.c_str() + sp + 1) != 200) return false;
+            bool chunked = false;
+            long long length = -1;
+            keep_alive = line.compare(0, 8, "HTTP/1.1") == 0;
+            while(read_line(line) && !line.empty()) {
+                auto colon = line.find(':');
+                if(colon == std::string::npos) continue;
+                auto key = line.substr(0, colon);
+                auto value = line.c_str() + colon + 1;
+                while(*value == ' ') value++;
+                if(strcasecmp(key.c_str(), "content-length") == 0) length = atoll(value);
+                else if(strcasecmp(key.c_str(), "transfer-encoding") == 0) chunked = strcasestr(value, "chunked") != nullptr;
+                else if(strcasecmp(key.c_str(), "connection") == 0) keep_alive = strcasecmp(value, "close") != 0;
+            }
+            if(!line.empty()) return false;
+            if(chunked) {
+                while(true) {
+                    if(!read_line(line)) return false;
+                    auto size = strtoull(line.c_str(), nullptr, 16);
+                    if(size == 0) break;
+                    if(!read_bytes(body, size) || !read_line(line)) return false;
+                }
+                // Trailer section
+                while(read_line(line) && !line.empty());
+                return line.empty();
+            }
+            if(length >= 0) return read_bytes(body, length);
+            // Body ends with the connection
+            keep_alive = false;
+            while(fill());
+            body.append(m_buf, m_pos, std::string::npos);
+            return true;
+        }
+    public:
+        explicit http_client(const options& opt) : m_opt(opt) {
+            std::string frame(5, '\0');
+            auto len = opt.request.size();
+            frame[1] = static_cast<char>((len >> 24) & 0xff);
+            frame[2] = static_cast<char>((len >> 16) & 0xff);
+            frame[3] = static_cast<char>((len >> 8) & 0xff);
+            frame[4] = static_cast<char>(len & 0xff);
+            frame += opt.request;
+            m_request = "POST " + opt.method + " HTTP/1.1\r\n"
+                "Host: " + opt.target + "\r\n"
+                "Content-Type: application/grpc-web+proto\r\n"
+                "Accept: application/grpc-web+proto\r\n"
+                "X-Grpc-Web: 1\r\n"
+                "Content-Length: " + std::to_string(frame.size()) + "\r\n"
+                "\r\n" + frame;
+        }
+        ~http_client() { close_server(); }
+
+        outcome call() {
+            if(m_fd < 0 && !connect_server()) return outcome::failed;
+            m_timed_out = false;
+            size_t sent = 0;
+            while(sent < m_request.size()) {
+                auto n = send(m_fd, m_request.data() + sent, m_request.size() - sent, MSG_NOSIGNAL);
+                if(n <= 0) {
+                    auto timed_out = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                    close_server();
+                    return timed_out ? outcome::timeout : outcome::failed;
+                }
+                sent += n;
+            }
+            std::string body;
+            bool keep_alive = false;
+            auto ok = read_response(body, keep_alive);
+            // The rest of a timed out response would be taken for the next one
+            if(!ok || !keep_alive) close_server();
+            if(!ok) return m_timed_out ? outcome::timeout : outcome::failed;
+            // The status is in the trailer frame
+            size_t pos = 0;
+            while(body.size() - pos >= 5) {
+                auto flags = static_cast<uint8_t>(body[pos]);
+                size_t len = (static_cast<size_t>(static_cast<uint8_t>(body[pos + 1])) << 24)
+                    | (static_cast<size_t>(static_cast<uint8_t>(body[pos + 2])) << 16)
+                    | (static_cast<size_t>(static_cast<uint8_t>(body[pos + 3])) << 8)
+                    | static_cast<size_t>(static_cast<uint8_t>(body[pos + 4]));
+                if(body.size() - pos - 5 < len) return outcome::failed;
+                if(flags & 0x80) return body.compare(pos + 5, 14, "grpc-status:0\r") == 0 ? outcome::ok : outcome::failed;
+                pos += 5 + len;
+            }
+            return outcome::failed;
+        }
+    };
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2 || (strcmp(argv[1], "grpc") != 0 && strcmp(argv[1], "http") != 0)) {
+        fprintf(stderr, "Usage: %s <grpc|http> [target] [method] [concurrency] [seconds] [payload size] [pidfile]\n", argv[0]);
+        return 1;
+    }
+    options opt;
+    opt.http = strcmp(argv[1], "http") == 0;
+    opt.target = argc > 2 ? argv[2] : (opt.http ? "127.0.0.1:8080" : "127.0.0.1:9090");
+    opt.method = argc > 3 ? argv[3] : "/helloworld.Greeter/SayHello";
+    opt.streaming = opt.method.find("Stream") != std::string::npos;
+    opt.concurrency = argc > 4 ? strtoull(argv[4], nullptr, 10) : 1;
+    opt.seconds = argc > 5 ? atof(argv[5]) : 5;
+    size_t payload = argc > 6 ? strtoull(argv[6], nullptr, 10) : 5;
+    const char* pidfile = argc > 7 ? argv[7] : nullptr;
+    if(opt.concurrency == 0) opt.concurrency = 1;
+    opt.request = make_request(payload);
+
+    auto colon = opt.target.rfind(':');
+    if(colon == std::string::npos) {
+        fprintf(stderr, "Target needs to be host:port\n");
+        return 1;
+    }
+    opt.host = opt.target.substr(0, colon);
+    opt.port = static_cast<uint16_t>(atoi(opt.target.c_str() + colon + 1));
+    if(opt.host.size() > 2 && opt.host.front() == '[') opt.host = opt.host.substr(1, opt.host.size() - 2);
+
+    pid_t pid = 0;
+    if(opt.http) {
+        auto f = pidfile ? fopen(pidfile, "r") : nullptr;
+        int value = 0;
+        if(f && fscanf(f, "%d", &value) == 1) pid = value;
+        if(f) fclose(f);
+    }
+    // Without a pid the server side usage is unknown in http mode
+    bool have_usage = !opt.http || pid != 0;
+
+    if(!opt.http) {
+        grpc_proxy::process_init();
+        gpr_set_log_verbosity(GPR_LOG_SEVERITY_ERROR);
+    }
+
+    // Every worker warms up its connection (and the channel cache), then all of them start measuring together
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::chrono::steady_clock::time_point end;
+    std::vector<std::vector<double>> samples(opt.concurrency);
+    std::vector<size_t> failed(opt.concurrency);
+    std::vector<size_t> timeouts(opt.concurrency);
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < opt.concurrency; i++) {
+        workers.emplace_back([&, i]() {
+            http_client client(opt);
+            auto call = [&]() { return opt.http ? client.call() : call_grpc(opt); };
+            // Stop warming up on the first error, a hanging call path would otherwise cost the timeout ten times
+            for(int w = 0; w < 10 && call() == outcome::ok; w++);
+            ready++;
+            while(!go.load()) std::this_thread::yield();
+            auto& s = samples[i];
+            s.reserve(100000);
+            while(true) {
+                auto start = std::chrono::steady_clock::now();
+                if(start >= end) break;
+                auto res = call();
+                if(res != outcome::ok) failed[i]++;
+                if(res == outcome::timeout) timeouts[i]++;
+                s.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            }
+        });
+    }
+    while(ready.load() != opt.concurrency) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    bench::process_usage before, after;
+    have_usage = have_usage && bench::read_usage(pid, before);
+    auto start = std::chrono::steady_clock::now();
+    end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(opt.seconds));
+    go = true;
+    for(auto& t : workers) t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    have_usage = have_usage && bench::read_usage(pid, after);
+
+    std::vector<double> all;
+    size_t total_failed = 0;
+    size_t total_timeouts = 0;
+    for(size_t i = 0; i < opt.concurrency; i++) {
+        all.insert(all.end(), samples[i].begin(), samples[i].end());
+        total_failed += failed[i];
+        total_timeouts += timeouts[i];
+    }
+    auto lat = bench::summarize(all);
+
+    auto short_method = opt.method.substr(opt.method.rfind('/') + 1);
+    bench::result res(std::string(argv[1]) + "_" + short_method + "_c" + std::to_string(opt.concurrency) + "_p" + std::to_string(payload));
+    res.add(lat);
+    res.add("failed", static_cast<uint64_t>(total_failed));
+    res.add("timeouts", static_cast<uint64_t>(total_timeouts));
+    res.add("rps", lat.count / elapsed.count());
+    if(have_usage && lat.count > 0) {
+        res.add("cpu_us_per_req", (after.cpu_us - before.cpu_us) / lat.count);
+        res.add("rss_kb", static_cast<uint64_t>(after.rss_kb));
+        res.add("peak_rss_kb", static_cast<uint64_t>(after.peak_rss_kb));
+    }
+    res.write();
+
+    if(!opt.http) grpc_proxy::process_deinit();
+    return total_failed == 0 && lat.count > 0 ? 0 : 1;
+}
@@ -0,0 +1,373 @@
+#include "bench_report.h"
+#include <grpc_web_call.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <grpc/support/log.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <strings.h>
+
+/**
+ * Replays captured grpc-web requests through grpc_web_call against a backend at the maximum rate,
+ * running the same translation as the module (frames, base64, metadata, the backend call and the trailer)
+ * without Apache. Meant to be run under perf, e.g.
+ *   perf record -g bench_replay bench/requests.http
+ *   perf script | stackcollapse-perf.pl | flamegraph.pl > replay.svg
+ *
+ * The capture holds HTTP/1.1 requests back to back as a client sends them on a connection
+ * (recorded with tcpflow or nc -l for example), bodies with Content-Length or chunked.
+ * HTTP/2 requests are written the same way with HTTP/2 as version in the request line.
+ * Every worker replays all of them in turn for [iterations] requests in total. Besides the latency
+ * the heap allocations (malloc and friends, including grpc's) and response messages per request are reported.
+ * A request fails unless it completes with status OK within 10 s.
+ * [unary methods] is a comma separated list like grpcUnaryMethod, calls to them run as a single batch.
+ *
+ * Usage: bench_replay <capture> [backend] [iterations] [concurrency] [engine threads] [unary methods]
+ */
+
+#ifdef __GLIBC__
+// Count every allocation of the process by interposing the glibc entry points
+static std::atomic<uint64_t> g_allocations{0};
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t n, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+
+    void* malloc(size_t size) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+    void* calloc(size_t n, size_t size) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(n, size);
+    }
+    void* realloc(void* ptr, size_t size) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(ptr, size);
+    }
+    void* memalign(size_t alignment, size_t size) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+    }
+    void* aligned_alloc(size_t alignment, size_t size) {
+        return memalign(alignment, size);
+    }
+    int posix_memalign(void** ptr, size_t alignment, size_t size) {
+        *ptr = memalign(alignment, size);
+        return *ptr ? 0 : ENOMEM;
+    }
+}
+
+static uint64_t allocations() noexcept { return g_allocations.load(std::memory_order_relaxed); }
+#else
+static uint64_t allocations() noexcept { return 0; }
+#endif
+
+namespace {
+    struct captured_request {
+        std::string path;
+        // Lowercase keys like convert_table produces them
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+        // Request line with HTTP/2 as version, needed for plain application/grpc
+        bool http2 = false;
+    };
+
+    bool getline_crlf(std::istream& in, std::string& line) {
+        if(!std::getline(in, line)) return false;
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+
+    bool load_capture(const char* file, std::vector<captured_request>& out) {
+        std::ifstream in(file, std::ios::binary);
+        if(!in) return false;
+        std::string line;
+        while(getline_crlf(in, line)) {
+            if(line.empty()) continue;
+            captured_request req;
+            auto sp1 = line.find(' ');
+            auto sp2 = line.rfind(' ');
+            if(sp1 == std::string::npos || sp2 == sp1) return false;
+            req.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+            req.http2 = line.compare(sp2 + 1, 6, "HTTP/2") == 0;
+            long long length = 0;
+            bool chunked = false;
+            while(getline_crlf(in, line) && !line.empty()) {
+                auto colon = line.find(':');
+                if(colon == std::string::npos) return false;
+                auto key = line.substr(0, colon);
+                auto value_start = line.find_first_not_of(' ', colon + 1);
+                auto value = value_start == std::string::npos ? std::string() : line.substr(value_start);
+                for(auto& c : key) c = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+                if(key == "content-length") length = atoll(value.c_str());
+                else if(key == "transfer-encoding") chunked = strcasestr(value.c_str(), "chunked") != nullptr;
+                req.headers.emplace_back(key, value);
+            }
+            if(chunked) {
+                while(getline_crlf(in, line)) {
+                    auto size = strtoull(line.c_str(), nullptr, 16);
+                    if(size == 0) break;
+                    std::string chunk(size, '\0');
+                    if(!in.read(&chunk[0], size)) return false;
+                    req.body += chunk;
+                    getline_crlf(in, line);
+                }
+                while(getline_crlf(in, line) && !line.empty());
+            } else if(length > 0) {
+                req.body.resize(length);
+                if(!in.read(&req.body[0], length)) return false;
+            }
+            out.push_back(std::move(req));
+        }
+        return true;
+    }
+
+    /**
+     * Bump allocator standing in for the request pool, reset after every request.
+     */
+    class arena {
+        std::vector<std::unique_ptr<char[]>> m_blocks;
+        // Allocations larger than a block, freed on reset
+        std::vector<std::unique_ptr<char[]>> m_large;
+        size_t m_block = 0;
+        size_t m_used = 0;
+        static constexpr size_t block_size = 64 * 1024;
+    public:
+        static void* alloc(void* ctx, size_t size) {
+            auto self = static_cast<arena*>(ctx);
+            size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+            if(size > block_size) {
+                self->m_large.emplace_back(new char[size]);
+                return self->m_large.back().get();
+            }
+            if(self->m_blocks.empty() || self->m_used + size > block_size) {
+                if(!self->m_blocks.empty()) self->m_block++;
+                if(self->m_block == self->m_blocks.size()) self->m_blocks.emplace_back(new char[block_size]);
+                self->m_used = 0;
+            }
+            auto res = self->m_blocks[self->m_block].get() + self->m_used;
+            self->m_used += size;
+            return res;
+        }
+        void reset() noexcept {
+            m_large.clear();
+            m_block = 0;
+            m_used = 0;
+        }
+    };
+
+    /**
+     * Collects the response in memory, framed and encoded like the module sends it.
+     */
+    class memory_sink : public grpc_web_sink {
+        base64_encode_stream m_encoder;
+        bool m_text = false;
+
+        void begin_frame(uint8_t flags, size_t len, bool text) {
+            uint8_t hdr[5] = {
+                flags, static_cast<uint8_t>(len >> 24), static_cast<uint8_t>(len >> 16),
+                static_cast<uint8_t>(len >> 8), static_cast<uint8_t>(len)
+            };
+            m_text = text;
+            m_encoder = base64_encode_stream();
+            write(hdr, sizeof(hdr));
+        }
+        void write(const void* data, size_t len) {
+            if(m_text) m_encoder.feed(body, data, len);
+            else body.append(static_cast<const char*>(data), len);
+        }
+        void end_frame() {
+            if(m_text) m_encoder.flush(body);
+        }
+    public:
+        std::string body;
+        bool started = false;
+        bool trailers = false;
+        // Response messages over all requests
+        size_t messages = 0;
+
+        void reset() {
+            body.clear();
+            started = false;
+            trailers = false;
+        }
+
+        void start_response(const header_list&, message_encoding, const call_timing&) override { started = true; }
+        void append_frame(uint8_t flags, grpc_byte_buffer* msg, bool text) override {
+            messages++;
+            begin_frame(flags, grpc_byte_buffer_length(msg), text);
+            grpc_byte_buffer_reader reader;
+            if(grpc_byte_buffer_reader_init(&reader, msg)) {
+                grpc_slice slice;
+                while(grpc_byte_buffer_reader_next(&reader, &slice)) {
+                    write(GRPC_SLICE_START_PTR(slice), GRPC_SLICE_LENGTH(slice));
+                    grpc_slice_unref(slice);
+                }
+                grpc_byte_buffer_reader_destroy(&reader);
+            }
+            end_frame();
+        }
+        void append_frame(uint8_t flags, const void* data, size_t len, bool text) override {
+            if(!(flags & grpc_web_frame_reader::flag_trailer)) messages++;
+            begin_frame(flags, len, text);
+            write(data, len);
+            end_frame();
+        }
+        bool flush() override { return true; }
+        void set_trailers(const grpc_proxy::status&) override { trailers = true; }
+        bool aborted() override { return false; }
+        bool disconnected() override { return false; }
+    };
+
+    // The module reads the body in chunks of this size (HUGE_STRING_LEN)
+    constexpr size_t read_size = 8192;
+
+    bool replay(const proxy_grpc_config_t& cfg, const char* backend, const captured_request& req, memory_sink& sink, arena& pool) {
+        pool.reset();
+        sink.reset();
+        header_list headers(&arena::alloc, &pool, req.headers.size());
+        for(auto& h : req.headers) headers.add_copy(h.first.data(), h.first.size(), h.second.data(), h.second.size());
+
+        grpc_web_call call(cfg, sink, backend, req.path.c_str(), &arena::alloc, &pool);
+        if(call.begin(headers, req.http2) != 0) return false;
+        for(size_t i = 0; i < req.body.size(); i += read_size) {
+            if(!call.feed(&req.body[i], std::min(read_size, req.body.size() - i))) break;
+        }
+        return call.finish() == 0 && call.completed() && call.status().status == GRPC_STATUS_OK;
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s <capture> [backend] [iterations] [concurrency] [engine threads] [unary methods]\n", argv[0]);
+        return 1;
+    }
+    const char* backend = argc > 2 ? argv[2] : "127.0.0.1:9090";
+    size_t iterations = argc > 3 ? strtoull(argv[3], nullptr, 10) : 100000;
+    size_t concurrency = argc > 4 ? strtoull(argv[4], nullptr, 10) : 1;
+    size_t engine_threads = argc > 5 ? strtoull(argv[5], nullptr, 10) : 0;
+    if(concurrency == 0) concurrency = 1;
+    if(iterations < concurrency) iterations = concurrency;
+
+    std::vector<captured_request> requests;
+    if(!load_capture(argv[1], requests) || requests.empty()) {
+        fprintf(stderr, "Failed to read requests from %s\n", argv[1]);
+        return 1;
+    }
+
+    grpc_proxy::process_init(engine_threads);
+    gpr_set_log_verbosity(GPR_LOG_SEVERITY_ERROR);
+
+    // Same defaults as an empty per directory config of the module
+    proxy_grpc_config_t cfg{};
+    cfg.call_timeout_ms = -1;
+    cfg.max_message_size = -1;
+    cfg.channels_per_backend = -1;
+    cfg.response_compression_min_size = -1;
+    // Unlike the module, so a call that never completes fails the run instead of stalling it
+    cfg.call_timeout_ms = 10000;
+    std::vector<std::string> unary_paths;
+    std::vector<proxy_grpc_unary_method_t> unary_methods;
+    for(const char* p = argc > 6 ? argv[6] : ""; *p;) {
+        auto end = strchr(p, ',');
+        unary_paths.emplace_back(p, end ? end - p : strlen(p));
+        p = end ? end + 1 : p + strlen(p);
+    }
+    unary_methods.resize(unary_paths.size());
+    for(size_t i = 0; i < unary_paths.size(); i++) {
+        unary_methods[i].method = unary_paths[i].c_str();
+        unary_methods[i].next = i + 1 < unary_paths.size() ? &unary_methods[i + 1] : nullptr;
+    }
+    cfg.unary_methods = unary_methods.empty() ? nullptr : unary_methods.data();
+
+    // Warm up the channel so connection setup is not measured
+    {
+        memory_sink sink;
+        arena pool;
+        for(auto& req : requests) {
+            if(!replay(cfg, backend, req, sink, pool)) {
+                fprintf(stderr, "Request to %s failed, is the backend running?\n", req.path.c_str());
+                grpc_proxy::process_deinit();
+                return 1;
+            }
+        }
+    }
+
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::vector<double>> samples(concurrency);
+    std::vector<size_t> failed(concurrency);
+    std::vector<size_t> messages(concurrency);
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < concurrency; i++) {
+        workers.emplace_back([&, i]() {
+            memory_sink sink;
+            arena pool;
+            auto& s = samples[i];
+            auto n = iterations / concurrency;
+            s.reserve(n);
+            ready++;
+            while(!go.load()) std::this_thread::yield();
+            for(size_t x = 0; x < n; x++) {
+                auto start = std::chrono::steady_clock::now();
+                if(!replay(cfg, backend, requests[(x + i) % requests.size()], sink, pool)) failed[i]++;
+                s.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            }
+            messages[i] = sink.messages;
+        });
+    }
+    while(ready.load() != concurrency) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    bench::process_usage before, after;
+    bench::read_usage(0, before);
+    auto allocs_before = allocations();
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for(auto& t : workers) t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    auto allocs = allocations() - allocs_before;
+    bench::read_usage(0, after);
+
+    std::vector<double> all;
+    size_t total_failed = 0;
+    size_t total_messages = 0;
+    for(size_t i = 0; i < concurrency; i++) {
+        all.insert(all.end(), samples[i].begin(), samples[i].end());
+        total_failed += failed[i];
+        total_messages += messages[i];
+    }
+    auto lat = bench::summarize(all);
+
+    std::string name = argv[1];
+    name = name.substr(name.rfind('/') + 1);
+    name = name.substr(0, name.find('.'));
+    bench::result res("replay_" + name + "_c" + std::to_string(concurrency));
+    res.add(lat);
+    res.add("failed", static_cast<uint64_t>(total_failed));
+    res.add("rps", lat.count / elapsed.count());
+    if(lat.count > 0) {
+        res.add("msgs_per_req", static_cast<double>(total_messages) / lat.count);
+        res.add("allocs_per_req", static_cast<double>(allocs) / lat.count);
+        res.add("cpu_us_per_req", (after.cpu_us - before.cpu_us) / lat.count);
+    }
+    res.add("rss_kb", static_cast<uint64_t>(after.rss_kb));
+    res.add("peak_rss_kb", static_cast<uint64_t>(after.peak_rss_kb));
+    res.write();
+
+    grpc_proxy::process_deinit();
+    return total_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#!/bin/bash
+# Runs the benchmark suite against the in-repo greeter backend and writes bench-results/<version>.json.
+# Apache is only started if apache2 is installed, it loads ./build/mod_proxy_grpc.so (see httpd.conf).
+#
+# Usage: bench/run.sh [build dir]
+# BENCH_SECONDS sets the duration of every load run (default 5).
+set -e
+cd "$(dirname "$0")/.."
+BUILD=${1:-build}
+SECONDS_PER_RUN=${BENCH_SECONDS:-5}
+VERSION=$(git describe --tags --always --dirty=-d 2>/dev/null || echo unknown)
+OUT=bench-results/$VERSION.json
+mkdir -p bench-results
+BENCH_JSON=$(mktemp)
+export BENCH_JSON
+
+SERVER_PID=
+APACHE_PID=
+cleanup() {
+    [ -n "$APACHE_PID" ] && kill "$APACHE_PID" 2>/dev/null && wait "$APACHE_PID" 2>/dev/null
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    rm -f "$BENCH_JSON"
+}
+trap cleanup EXIT INT TERM
+
+wait_for_port() {
+    for i in $(seq 50); do
+        (echo > /dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Nothing listens on port $1" >&2
+    return 1
+}
+
+"$BUILD/bench_micro"
+
+"$BUILD/bench_greeter_server" 127.0.0.1:9090 100 0 10 &
+SERVER_PID=$!
+wait_for_port 9090
+
+LOAD="$BUILD/bench_load_generator"
+$LOAD grpc 127.0.0.1:9090 /helloworld.Greeter/SayHello 1 "$SECONDS_PER_RUN" 5
+$LOAD grpc 127.0.0.1:9090 /helloworld.Greeter/SayHello 32 "$SECONDS_PER_RUN" 5
+$LOAD grpc 127.0.0.1:9090 /helloworld.Greeter/SayHello 32 "$SECONDS_PER_RUN" 16384
+$LOAD grpc 127.0.0.1:9090 /helloworld.Greeter/SayHelloStreamReply 8 "$SECONDS_PER_RUN" 5
+# The grpc runs only measure grpc_proxy, the replays run unary and streaming calls through the request handling
+"$BUILD/bench_replay" bench/requests.http 127.0.0.1:9090 20000 1 0 /helloworld.Greeter/SayHello
+"$BUILD/bench_replay" bench/requests.http 127.0.0.1:9090 20000 8 0 /helloworld.Greeter/SayHello
+"$BUILD/bench_replay" bench/native.http 127.0.0.1:9090 20000 1 0 /helloworld.Greeter/SayHello
+
+if command -v apache2 > /dev/null; then
+    rm -f httpd.pid
+    apache2 -d . -f httpd.conf -e warn -DFOREGROUND -X &
+    APACHE_PID=$!
+    wait_for_port 8080
+    $LOAD http 127.0.0.1:8080 /helloworld.Greeter/SayHello 1 "$SECONDS_PER_RUN" 5 httpd.pid
+    $LOAD http 127.0.0.1:8080 /helloworld.Greeter/SayHello 32 "$SECONDS_PER_RUN" 5 httpd.pid
+    $LOAD http 127.0.0.1:8080 /helloworld.Greeter/SayHello 32 "$SECONDS_PER_RUN" 16384 httpd.pid
+    $LOAD http 127.0.0.1:8080 /helloworld.Greeter/SayHelloStreamReply 8 "$SECONDS_PER_RUN" 5 httpd.pid
+else
+    echo "apache2 not found, skipping the http runs"
+fi
+
+# One result per line keeps two files diffable line by line
+{
+    printf '{"version": "%s", "date": "%s", "results": [\n' "$VERSION" "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    sed '$!s/$/,/' "$BENCH_JSON"
+    printf ']}\n'
+} > "$OUT"
+echo "Results written to $OUT"
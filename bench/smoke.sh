@@ -0,0 +1,55 @@
+#!/bin/bash
+# Replays the captures against the greeter backend for a few iterations, failing on any failed call
+# or if the number of response messages per request is off (the streaming replies went missing).
+#
+# Usage: bench/smoke.sh [build dir]
+# SMOKE_PORT sets the port of the backend (default 9391).
+set -e
+cd "$(dirname "$0")/.."
+BUILD=${1:-build}
+PORT=${SMOKE_PORT:-9391}
+
+SERVER_PID=
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+wait_for_port() {
+    for i in $(seq 50); do
+        (echo > /dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Nothing listens on port $1" >&2
+    return 1
+}
+
+# 10 messages per SayHelloStreamReply, the expected averages below depend on it
+"$BUILD/bench_greeter_server" 127.0.0.1:$PORT 100 0 10 4 > /dev/null 2>&1 &
+SERVER_PID=$!
+wait_for_port $PORT
+
+# Usage: replay <capture> <concurrency> <expected msgs_per_req>
+replay() {
+    local out
+    out=$(BENCH_JSON= "$BUILD/bench_replay" "$1" 127.0.0.1:$PORT 200 "$2" 0 /helloworld.Greeter/SayHello 2>/dev/null | grep '^replay_') || {
+        echo "Replay of $1 failed" >&2
+        return 1
+    }
+    echo "$out"
+    case " $out " in
+        *" failed=0 "*) ;;
+        *) echo "Replay of $1 had failed calls" >&2; return 1 ;;
+    esac
+    case " $out " in
+        *" msgs_per_req=$3 "*) ;;
+        *) echo "Replay of $1 expected msgs_per_req=$3" >&2; return 1 ;;
+    esac
+}
+
+# Three unary calls (one chunked) and one server streaming call
+replay bench/requests.http 1 3.250
+replay bench/requests.http 4 3.250
+# One unary and one server streaming call over HTTP/2
+replay bench/native.http 1 5.500
+echo "Smoke test passed"
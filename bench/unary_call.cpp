@@ -0,0 +1,98 @@
+#include <grpc_proxy.h>
+#include <grpc/grpc.h>
+#include <grpc/support/log.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/**
+ * Compares the latency of a unary call done as one batch (grpc_proxy::unary_call)
+ * against the op-by-op sequence used before.
+ *
+ * Usage: bench_unary_call [host] [method] [iterations] [payload size]
+ */
+
+using headers_t = header_list;
+
+static std::string make_request(size_t payload) {
+    // helloworld.HelloRequest { string name = 1; }
+    std::string res;
+    if(payload == 0) return res;
+    res += '\x0a';
+    auto len = payload;
+    while(len >= 0x80) {
+        res += static_cast<char>((len & 0x7f) | 0x80);
+        len >>= 7;
+    }
+    res += static_cast<char>(len);
+    res.append(payload, 'x');
+    return res;
+}
+
+static bool call_sequential(const char* host, const char* method, const headers_t& headers, const std::string& req) {
+    grpc_proxy proxy;
+    if(!proxy.start(host, method)) return false;
+    if(!proxy.send_initial_metadata(headers)) return false;
+    if(!proxy.send_request(req.data(), req.size())) return false;
+    if(!proxy.send_client_close()) return false;
+    headers_t headers_out;
+    if(!proxy.receive_initial_metadata(headers_out)) return false;
+    while(proxy.receive_message(nullptr));
+    grpc_proxy::status status;
+    if(!proxy.receive_status(status)) return false;
+    return status.status == GRPC_STATUS_OK;
+}
+
+static bool call_batched(const char* host, const char* method, const headers_t& headers, const std::string& req) {
+    grpc_proxy proxy;
+    if(!proxy.start(host, method)) return false;
+    headers_t headers_out;
+    grpc_proxy::status status;
+    if(!proxy.unary_call(headers, req.data(), req.size(), headers_out, nullptr, status)) return false;
+    return status.status == GRPC_STATUS_OK;
+}
+
+template<typename Func>
+static void run(const char* name, size_t iterations, Func fn) {
+    std::vector<double> samples;
+    samples.reserve(iterations);
+    size_t failed = 0;
+    for(size_t i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        if(!fn()) failed++;
+        auto end = std::chrono::steady_clock::now();
+        samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for(auto e : samples) sum += e;
+    auto pct = [&](double p) { return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))]; };
+    printf("%-12s n=%zu failed=%zu mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus\n",
+        name, samples.size(), failed, sum / samples.size(), pct(0.5), pct(0.9), pct(0.99));
+}
+
+int main(int argc, char** argv) {
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1:9090";
+    const char* method = argc > 2 ? argv[2] : "/helloworld.Greeter/SayHello";
+    size_t iterations = argc > 3 ? strtoull(argv[3], nullptr, 10) : 10000;
+    size_t payload = argc > 4 ? strtoull(argv[4], nullptr, 10) : 0;
+    if(iterations == 0) iterations = 1;
+
+    grpc_proxy::process_init();
+    gpr_set_log_verbosity(GPR_LOG_SEVERITY_ERROR);
+    grpc_tracer_set_enabled("api", false);
+
+    headers_t headers;
+    auto req = make_request(payload);
+
+    // Warm up the channel so connection setup is not measured
+    run("warmup", std::min<size_t>(iterations, 100), [&]() { return call_batched(host, method, headers, req); });
+    run("sequential", iterations, [&]() { return call_sequential(host, method, headers, req); });
+    run("unary_call", iterations, [&]() { return call_batched(host, method, headers, req); });
+
+    grpc_proxy::process_deinit();
+    return 0;
+}
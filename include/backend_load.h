@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Calls in flight and response latency per backend, kept in memory shared by all children.
+ *
+ * A grpc_proxy call counts as in flight on its backend from start() until it is destroyed, so a long
+ * running stream weighs as long as it occupies the backend and calls multiplexed on one channel are
+ * all visible. The latency is a moving average of the time until the backend answered (the response
+ * of a unary call, the initial metadata of a stream). Read by the grpc_leastcalls balancer method.
+ *
+ * The entries are a shm_table, only updated with atomic operations. They are claimed on first use
+ * and never freed.
+ */
+class backend_load {
+public:
+    static constexpr size_t max_backends = 256;
+    // Weight of a new sample in the latency average is 1 / latency_decay
+    static constexpr uint64_t latency_decay = 8;
+
+    struct backend {
+        std::atomic<uint32_t> state;
+        uint32_t hash;
+        char host[128];
+        std::atomic<int64_t> in_flight;
+        // Average time to the first response in microseconds, 0 until the first sample
+        std::atomic<uint64_t> latency_us;
+        // Retry tokens missing from the budget in thousandths, a zero filled entry starts with a full budget
+        std::atomic<int64_t> retry_debt;
+    };
+
+    struct table {
+        uint32_t magic;
+        backend backends[max_backends];
+    };
+
+    static size_t shm_size() noexcept { return sizeof(table); }
+    // Use mem (zero filled, shm_size() bytes) as the load table, nullptr disables tracking
+    static void attach(void* mem) noexcept;
+    static bool enabled() noexcept { return s_table != nullptr; }
+
+    // Find or claim the entry of host (host:port), nullptr if tracking is disabled or the table is full
+    static backend* lookup(const char* host) noexcept;
+    // Entry of host if a call was made to it before, never claims one
+    static const backend* find(const char* host) noexcept;
+    static void observe_latency(backend* b, uint64_t us) noexcept;
+    /**
+     * True if more than half of max_tokens retry tokens are left. Without an entry (no shared table or
+     * it is full) there is no budget to check, attempts are then only limited by the retry policy.
+     */
+    static bool retry_allowed(const backend* b, uint32_t max_tokens) noexcept;
+    // A failed attempt costs a token, a successful one returns ratio tokens
+    static void record_attempt(backend* b, bool failed, uint32_t max_tokens, double ratio) noexcept;
+
+    /**
+     * Counts a single call as in flight until destroyed or end() is called.
+     */
+    class tracker {
+        backend* m_backend = nullptr;
+        uint64_t m_start_us = 0;
+        bool m_responded = false;
+    public:
+        tracker() noexcept = default;
+        ~tracker() { end(); }
+        tracker(const tracker&) = delete;
+        tracker& operator=(const tracker&) = delete;
+
+        void begin(const char* host) noexcept;
+        // The backend answered, only the first call records a latency sample
+        void responded() noexcept;
+        void end() noexcept;
+    };
+
+private:
+    static table* s_table;
+};
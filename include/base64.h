@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <cstddef>
+#include <cstdint>
 
 class base64_encode_stream {
 public:
@@ -8,17 +10,48 @@ public:
     std::string flush();
     void feed(std::string& out, const void* data, size_t len);
     void flush(std::string& out);
+    // Raw variants, out needs room for max_encoded_size(buffered + len) bytes. Return the number of bytes written.
+    size_t feed(char* out, const void* data, size_t len);
+    size_t flush(char* out);
 
     static constexpr size_t guess_encoded_size(size_t inlen) noexcept { return ((inlen + 2)/3) + 4; }
+    // Upper bound for the output of feeding and flushing inlen bytes in total
+    static constexpr size_t max_encoded_size(size_t inlen) noexcept { return ((inlen + 2)/3) * 4; }
 };
 
+/**
+ * Validates while decoding. Padding is accepted at the end of every quad, so
+ * concatenated base64 chunks (as sent by grpc-web-text clients) decode correctly.
+ * Once invalid input was seen the stream stays failed and produces no more output.
+ */
 class base64_decode_stream {
 public:
     std::string m_buffer;
+    bool m_failed = false;
     std::string feed(const void* data, size_t len);
     std::string flush();
     void feed(std::string& out, const void* data, size_t len);
     void flush(std::string& out);
+    // Raw variants, out needs room for max_decoded_size(buffered + len) bytes. Return the number of bytes written.
+    size_t feed(char* out, const void* data, size_t len);
+    size_t flush(char* out);
+
+    bool failed() const noexcept { return m_failed; }
 
     static constexpr size_t guess_encoded_size(size_t inlen) noexcept { return ((inlen + 2)/3) + 4; }
-};
\ No newline at end of file
+    // Upper bound for the output of feeding and flushing inlen bytes in total
+    static constexpr size_t max_decoded_size(size_t inlen) noexcept { return ((inlen + 3)/4) * 3; }
+};
+
+/**
+ * Kernel used by both streams, picked at startup from the cpu features.
+ * Can be overridden for benchmarking, set_impl fails if the cpu does not support it.
+ */
+enum class base64_impl {
+    scalar,
+    ssse3,
+    avx2
+};
+base64_impl base64_get_impl() noexcept;
+bool base64_set_impl(base64_impl impl) noexcept;
+const char* base64_impl_name(base64_impl impl) noexcept;
@@ -0,0 +1,66 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Phase timestamps of a single proxied call, measured on the monotonic clock relative to construction.
+ * Fixed size and allocation free, marking a phase is a single clock read.
+ */
+class call_timing {
+public:
+    enum phase {
+        // Channel lookup and call creation done
+        channel_lookup,
+        // Request body completely read (and decoded)
+        body_read,
+        // First batch started on the call
+        call_start,
+        // First response message forwarded to the client
+        first_response,
+        // Last message and the status received
+        last_message,
+        // Trailer written to the client
+        trailer_write,
+        num_phases
+    };
+
+    call_timing() noexcept : m_start(now()) {
+        for(auto& e : m_marks) e = 0;
+    }
+
+    // Record the first occurrence of p, later calls are ignored
+    void mark(phase p) noexcept {
+        if(m_marks[p] == 0) m_marks[p] = now() - m_start;
+    }
+    // Mark channel_lookup for a lookup that started at begin, it only happens before reading the body if the call is not cacheable
+    void mark_lookup(uint64_t begin) noexcept {
+        mark(channel_lookup);
+        m_lookup = now() - begin;
+    }
+    // Add the duration since begin to the time spent base64 decoding
+    void add_decode(uint64_t begin) noexcept { m_decode += now() - begin; }
+    static uint64_t now() noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    // Nanoseconds since construction, 0 if the phase was not reached
+    uint64_t get(phase p) const noexcept { return m_marks[p]; }
+    uint64_t decode() const noexcept { return m_decode; }
+
+    /**
+     * Format as "name=us ..." of every reached phase (offsets from the start in microseconds) for the log note.
+     * Returns the number of characters written (excluding the terminating zero).
+     */
+    size_t format_note(char* buf, size_t len) const noexcept;
+    /**
+     * Format as Server-Timing header value, durations in milliseconds.
+     * With complete == false only the phases up to the first response are included, phases that were not reached are left out.
+     */
+    size_t format_server_timing(char* buf, size_t len, bool complete) const noexcept;
+
+private:
+    uint64_t m_start;
+    uint64_t m_marks[num_phases];
+    uint64_t m_decode = 0;
+    uint64_t m_lookup = 0;
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <grpc/grpc.h>
+
+/**
+ * Extra arguments for the channels to a backend.
+ *
+ * Arguments are kept sorted by key, id() is a canonical rendering of all of them and hash() its hash, both
+ * updated by set(). The channel registry keys its pools by them, so backends reached with different
+ * arguments never share a channel. Values that parse as a (32 bit) integer are passed as integer arguments,
+ * everything else as string.
+ */
+class channel_args {
+public:
+    channel_args() = default;
+    ~channel_args();
+    channel_args(const channel_args&) = delete;
+    channel_args& operator=(const channel_args&) = delete;
+
+    // Add or replace an argument
+    void set(const std::string& key, const std::string& value);
+    void set(const std::string& key, int value);
+    // Add all arguments of other, replacing those with the same key
+    void merge(const channel_args& other);
+    /**
+     * The arguments of base with these on top. Built on the first call for a base and kept until this
+     * object is destroyed, so merging per-dir configs on every request neither allocates nor rebuilds the id.
+     * Safe to call concurrently, nullptr if the merge fails to allocate.
+     */
+    channel_args* merged_over(const channel_args& base) noexcept;
+
+    const std::string& id() const noexcept { return m_id; }
+    size_t hash() const noexcept { return m_hash; }
+    bool empty() const noexcept { return m_args.empty(); }
+    size_t size() const noexcept { return m_args.size(); }
+    // Append grpc_args pointing into this object, they stay valid until it is modified
+    void append_to(std::vector<grpc_arg>& out) const;
+
+private:
+    struct arg {
+        std::string key;
+        std::string value;
+        int integer;
+        bool is_integer;
+    };
+    struct merge_result {
+        const channel_args* base;
+        std::unique_ptr<channel_args> result;
+        merge_result* next;
+    };
+    std::vector<arg> m_args;
+    std::string m_id;
+    size_t m_hash = 0;
+    // Results of merged_over, only ever prepended to
+    std::atomic<merge_result*> m_merges{nullptr};
+
+    void set(arg a);
+};
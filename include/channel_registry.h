@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class channel_args;
+struct grpc_channel;
+struct grpc_completion_queue;
+
+/**
+ * Read mostly cache of grpc channels keyed by backend host.
+ *
+ * Lookups read an immutable snapshot of the map which every thread keeps a private copy of,
+ * only refreshing it after a writer published a new version. Channel health is tracked by a
+ * background thread using grpc_channel_watch_connectivity_state, so the lookup never polls
+ * the channel and never takes a lock unless it has to (re)create a channel.
+ *
+ * Every backend has a pool of channels which do not share subchannels (and therefore connections).
+ * Calls are spread over the pool, picking the channel with the fewest outstanding calls.
+ * Channels created with extra arguments are cached separately from those to the same host without.
+ */
+class channel_registry {
+public:
+    struct entry {
+        std::string host;
+        std::shared_ptr<grpc_channel> channel;
+        // Last observed grpc_connectivity_state
+        std::atomic<int> state;
+        // Set once the entry was replaced or removed, stops the watch
+        std::atomic<bool> retired;
+        // Number of leases currently held on this channel
+        std::atomic<int> outstanding;
+    };
+
+    /**
+     * A channel picked for a single call. Keeps the channel alive and
+     * counts as an outstanding call on it until destroyed.
+     */
+    class lease {
+        std::shared_ptr<entry> m_entry;
+    public:
+        lease() = default;
+        explicit lease(std::shared_ptr<entry> e) noexcept;
+        lease(lease&& other) noexcept = default;
+        lease& operator=(lease&& other) noexcept;
+        lease(const lease&) = delete;
+        lease& operator=(const lease&) = delete;
+        ~lease();
+
+        grpc_channel* get() const noexcept { return m_entry ? m_entry->channel.get() : nullptr; }
+        explicit operator bool() const noexcept { return get() != nullptr; }
+        void reset() noexcept;
+    };
+
+    channel_registry();
+    ~channel_registry();
+
+    // Get a channel to host out of a pool of pool_size channels, cached is set to false if the lookup had to take the locked slow path
+    lease get(const std::string& host, size_t pool_size = 1, bool* cached = nullptr, const channel_args* args = nullptr);
+    // Start/Stop the connectivity watcher thread
+    void start();
+    void stop();
+    // Drop all channels
+    void clear();
+    // Default compression (a grpc_compression_algorithm) for messages sent on channels created from now on
+    void set_compression(int algorithm) noexcept { m_compression = algorithm; }
+private:
+    struct pool {
+        std::string host;
+        // channel_args::id() of the extra arguments, empty without
+        std::string args_id;
+        std::vector<std::shared_ptr<entry>> channels;
+        std::atomic<size_t> next;
+    };
+    // Keyed by a hash of host and arguments, so lookups do not build a key string. Colliding pools are told apart by host and args_id
+    using map_t = std::unordered_multimap<size_t, std::shared_ptr<pool>>;
+
+    lease get_slow(size_t key, const std::string& host, size_t pool_size, const channel_args* args);
+    std::shared_ptr<entry> create_entry(const std::string& host, bool local_subchannels, const channel_args* args);
+    void publish(std::shared_ptr<const map_t> map);
+    void watch(const std::shared_ptr<entry>& e, int last_state);
+    void watcher_main();
+
+    // Writers serialize on this mutex, readers never touch it
+    std::mutex m_write_mtx;
+    std::shared_ptr<const map_t> m_map;
+    // Version of m_map, drawn from a process wide counter so thread local
+    // snapshots can never mistake a new registry for an old one
+    std::atomic<uint64_t> m_version;
+
+    int m_compression = 0;
+
+    std::atomic<bool> m_running;
+    grpc_completion_queue* m_watch_cq;
+    std::thread m_watcher;
+};
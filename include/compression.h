@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <grpc_web.h>
+
+struct grpc_byte_buffer;
+
+// Message encodings (grpc-encoding values) the proxy can handle itself
+enum class message_encoding {
+    identity,
+    gzip,
+    deflate
+};
+
+// Parse a grpc-encoding name, returns false if the encoding is not supported
+bool parse_message_encoding(const char* value, size_t len, message_encoding& out) noexcept;
+const char* message_encoding_name(message_encoding enc) noexcept;
+// True if the comma separated list (as sent in grpc-accept-encoding) contains enc
+bool accepts_message_encoding(const char* list, size_t len, message_encoding enc) noexcept;
+
+/**
+ * Inflate a message received with the compressed flag set.
+ * Returns nullptr if the data is corrupt or inflates to more than max_size bytes.
+ */
+byte_buffer_ptr decompress_message(message_encoding enc, grpc_byte_buffer* msg, size_t max_size);
+/**
+ * Compress msg into out, replacing its content. The buffer is sized for the worst case up front,
+ * so reusing out across messages avoids any further allocation. Returns false on failure.
+ */
+bool compress_message(message_encoding enc, grpc_byte_buffer* msg, std::string& out);
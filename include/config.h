@@ -1,6 +1,9 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
+class channel_args;
+
 typedef struct proxy_grpc_config_bool {
 	bool value;
 	bool initialized = false;
@@ -14,9 +17,53 @@ typedef struct proxy_grpc_config_bool {
 	}
 } proxy_grpc_config_bool_t;
 
+// A method listed in grpcCacheMethod
+typedef struct proxy_grpc_cache_method {
+    // Full method path, a trailing * matches every method of the service
+    const char* method;
+    int64_t ttl_ms;
+    // Request metadata that is part of the cache key (lowercase)
+    const char** metadata_keys;
+    size_t num_keys;
+    const struct proxy_grpc_cache_method* next;
+} proxy_grpc_cache_method_t;
+
+// A method listed in grpcIdempotentMethod
+typedef struct proxy_grpc_retry_method {
+    // Full method path, a trailing * matches every method of the service
+    const char* method;
+    // Attempts in total, including the first one
+    int64_t max_attempts;
+    // Fixed delay before hedging, 0 if the call is not hedged or hedge_percentile is set
+    int64_t hedge_delay_ms;
+    // Hedge after the observed backend latency at this percentile, 0 if unused
+    double hedge_percentile;
+    const struct proxy_grpc_retry_method* next;
+} proxy_grpc_retry_method_t;
+
+// A method listed in grpcUnaryMethod
+typedef struct proxy_grpc_unary_method {
+    // Full method path, a trailing * matches every method of the service
+    const char* method;
+    const struct proxy_grpc_unary_method* next;
+} proxy_grpc_unary_method_t;
+
 typedef struct proxy_grpc_config {
 	int64_t call_timeout_ms;
     int64_t max_message_size;
+    int64_t channels_per_backend;
+    proxy_grpc_config_bool_t server_timing;
+    // message_encoding + 1 of responses to the client, 0 if not set
+    int64_t response_compression;
+    int64_t response_compression_min_size;
+    // Extra backend channel arguments, nullptr if none are configured
+    channel_args* backend_args;
+    // Cacheable methods, nullptr if none
+    const proxy_grpc_cache_method_t* cache_methods;
+    // Idempotent methods that may be retried and hedged, nullptr if none
+    const proxy_grpc_retry_method_t* retry_methods;
+    // Methods known to be unary, nullptr if none
+    const proxy_grpc_unary_method_t* unary_methods;
 } proxy_grpc_config_t;
 
 
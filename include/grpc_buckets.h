@@ -0,0 +1,29 @@
+#pragma once
+extern "C" {
+#include <apr_buckets.h>
+}
+#include <cstddef>
+#include <cstdint>
+#include <grpc/slice.h>
+
+struct grpc_byte_buffer;
+class base64_encode_stream;
+
+/**
+ * Bucket referencing a grpc slice, the slice is unref'd once the last bucket sharing it is destroyed.
+ * Takes over the reference passed in.
+ */
+apr_bucket* grpc_slice_bucket_create(grpc_slice slice, apr_bucket_alloc_t* list);
+
+/**
+ * Append a grpc-web frame (header and message) to the brigade without copying the message.
+ */
+void append_frame(apr_bucket_brigade* bb, uint8_t flags, grpc_byte_buffer* msg);
+void append_frame(apr_bucket_brigade* bb, uint8_t flags, const void* data, size_t len);
+
+/**
+ * Append a base64 encoded grpc-web frame to the brigade. The message is encoded straight
+ * from the grpc slices into a single bucket allocated buffer.
+ */
+void append_frame_base64(apr_bucket_brigade* bb, uint8_t flags, grpc_byte_buffer* msg);
+void append_frame_base64(apr_bucket_brigade* bb, uint8_t flags, const void* data, size_t len);
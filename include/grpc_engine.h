@@ -0,0 +1,77 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct grpc_completion_queue;
+struct grpc_event;
+struct gpr_timespec;
+
+/**
+ * Completion queue shared by all calls of a process and drained by a small set of engine threads.
+ *
+ * Instead of every call polling its own completion queue, batches are started with a tag pointing into
+ * the mailbox of the call. Engine threads deliver completed events into that mailbox and wake the thread
+ * owning the call, which only waits on a condition variable. This keeps the number of grpc pollers per
+ * child at the engine thread count, no matter how many calls are in flight.
+ *
+ * It does not make the module event driven: the Apache worker of a request stays blocked in
+ * mailbox::next until its call is done, so concurrent calls are still bounded by the worker count.
+ */
+class grpc_engine {
+public:
+    class mailbox {
+        friend class grpc_engine;
+    public:
+        // Distinct tags a call may use, grpc_proxy checks its own against this
+        static constexpr size_t max_tags = 12;
+    private:
+        struct slot {
+            mailbox* box;
+            uintptr_t tag;
+        };
+        struct event {
+            uintptr_t tag;
+            bool success;
+        };
+
+        std::mutex m_mtx;
+        std::condition_variable m_cv;
+        std::deque<event> m_events;
+        // One slot per distinct tag used by the call, their address is what grpc sees as tag
+        slot m_slots[max_tags];
+        size_t m_num_slots = 0;
+
+        void push(uintptr_t tag, bool success);
+    public:
+        mailbox() = default;
+        mailbox(const mailbox&) = delete;
+        mailbox& operator=(const mailbox&) = delete;
+
+        // Tag to pass to grpc_call_start_batch for a batch identified by tag, nullptr beyond max_tags distinct tags
+        void* tag(uintptr_t tag) noexcept;
+        /**
+         * Wait for the next event of this call until deadline (a grpc deadline in any clock).
+         * The returned event has the original tag value, or type GRPC_QUEUE_TIMEOUT.
+         */
+        grpc_event next(const gpr_timespec& deadline);
+    };
+
+    grpc_engine() = default;
+    ~grpc_engine();
+
+    void start(size_t num_threads);
+    void stop();
+    bool running() const noexcept { return m_cq != nullptr; }
+    grpc_completion_queue* cq() const noexcept { return m_cq; }
+
+private:
+    grpc_completion_queue* m_cq = nullptr;
+    std::vector<std::thread> m_threads;
+
+    void thread_main();
+};
@@ -1,15 +1,22 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
 #include <functional>
-#include <unordered_map>
 #include <string>
 #include <memory>
+#include <channel_registry.h>
+#include <grpc_engine.h>
+#include <header_list.h>
+#include <compression.h>
+#include <backend_load.h>
+#include <grpc/support/time.h>
 
 struct grpc_completion_queue;
 struct grpc_channel;
 struct grpc_call;
 struct grpc_op;
 struct grpc_event;
+struct grpc_byte_buffer;
 
 class grpc_proxy {
     grpc_proxy& operator=(const grpc_proxy&) = delete;
@@ -18,35 +25,164 @@ class grpc_proxy {
     grpc_proxy(grpc_proxy&&) = delete;
 
     grpc_completion_queue* m_cq = nullptr;
-    std::shared_ptr<grpc_channel> m_channel = nullptr;
+    // Set if the call runs on the engine queue instead of a queue of its own
+    std::unique_ptr<grpc_engine::mailbox> m_mailbox;
+    channel_registry::lease m_channel;
     grpc_call* m_call = nullptr;
+    // Number of batches started but not yet seen on the completion queue
+    size_t m_pending_ops = 0;
+    // Time spent waiting for completions in microseconds
+    uint64_t m_wait_time = 0;
+    bool m_channel_cached = true;
+    // Counts the call as in flight on its backend (for the grpc_leastcalls balancer method)
+    backend_load::tracker m_load;
+    // Target of the call, needed to start further attempts
+    std::string m_host;
+    std::string m_method;
 
     uint64_t m_call_timeout;
+    // Set by start() from the call timeout, on the monotonic clock
+    gpr_timespec m_deadline;
+    // Called while waiting for the backend, the call is cancelled once it returns true
+    std::function<bool()> m_abort_check;
+    bool m_cancelled = false;
+    size_t m_channels_per_backend;
+    const channel_args* m_channel_args = nullptr;
 
-    grpc_event run_ops(grpc_call* call, grpc_completion_queue* cq, grpc_op* ops, int mops);
+    // State of a streaming call, only set between start_stream() and destruction
+    struct stream_state;
+    std::unique_ptr<stream_state> m_stream;
+
+    // Attempts of a hedged or retried unary call, only set while one runs and until destruction
+    struct attempt;
+    struct hedge_state;
+    std::unique_ptr<hedge_state> m_hedge;
+    bool start_attempt(attempt& a, grpc_byte_buffer* request, uintptr_t tag);
+    void cancel_attempts() noexcept;
+
+    // nullptr if the engine mailbox of the call has no slot left, the batch must not be started then
+    void* batch_tag(uintptr_t tag);
+    grpc_event wait_event(const gpr_timespec& deadline);
+    grpc_event run_ops(grpc_call* call, grpc_op* ops, int mops);
+    bool start_batch(grpc_op* ops, size_t nops, uintptr_t tag);
+    bool start_read();
+    enum class event_result { failed, timeout, handled };
+    /**
+     * Wait for (or with block false just check for) the next event of a streaming call and dispatch it.
+     * A blocking wait fails shortly after the call deadline, it is only unbounded with a call timeout of 0.
+     */
+    event_result next_event(bool block);
 public:
     struct status {
         int status;
         std::string details;
         std::string error;
-        std::unordered_multimap<std::string, std::string> metadata;
+        header_list metadata;
+    };
+    // Called with each response message, the buffer is only borrowed for the duration of the call
+    using message_callback = std::function<void(grpc_byte_buffer* msg)>;
+    /**
+     * Extra attempts of a unary call to an idempotent method. Attempts failing with UNAVAILABLE are retried,
+     * and with hedge_delay_ms set another attempt is started on a different channel whenever no attempt
+     * answered within that time. The first answer wins and the others are cancelled.
+     * Extra attempts draw from a budget per backend shared by all children: every failed attempt costs a
+     * token, every successful one returns budget_ratio tokens, and no extra attempts are made while less
+     * than half of budget_tokens are left (like grpc's retry throttling).
+     */
+    struct retry_policy {
+        // Attempts in total, including the first one, at most attempts_limit
+        size_t max_attempts = 1;
+        static constexpr size_t attempts_limit = 5;
+        // 0 only retries failed attempts
+        uint64_t hedge_delay_ms = 0;
+        // A failed attempt is retried after a random delay between half and all of this, doubled per failure
+        uint64_t backoff_ms = 25;
+        uint64_t max_backoff_ms = 1000;
+        uint32_t budget_tokens = 10;
+        double budget_ratio = 0.1;
+    };
+    struct cq_cache_stats {
+        uint64_t hits;
+        uint64_t misses;
     };
 
     grpc_proxy();
     ~grpc_proxy();
 
+    // Time the call may take in total, counted from start(). 0 waits forever, only a cancel() ends such a call early
     void set_call_timeout(uint64_t ms) noexcept { m_call_timeout = ms; }
+    /**
+     * Check for a client that went away. It is evaluated every abort_check_interval_ms while
+     * blocked on the backend, once it returns true the call (every attempt of it) is cancelled.
+     */
+    void set_abort_check(std::function<bool()> check) { m_abort_check = std::move(check); }
+    static constexpr uint64_t abort_check_interval_ms = 100;
+    // Cancel the call, pending operations complete with CANCELLED
+    void cancel() noexcept;
+    bool cancelled() const noexcept { return m_cancelled; }
+    void set_channels_per_backend(size_t n) noexcept { m_channels_per_backend = n; }
+    // Extra arguments for the backend channel, need to stay valid until the call is over
+    void set_channel_args(const channel_args* args) noexcept { m_channel_args = args; }
 
     bool start(const char* host, const char* method);
-    // TODO: We might want to batch those 3 together to optimize performance
-    bool send_initial_metadata(const std::unordered_multimap<std::string, std::string>& headers);
+    // Microseconds spent blocked on the completion queue so far
+    uint64_t wait_time_us() const noexcept { return m_wait_time; }
+    // False if start() could not use a cached channel
+    bool channel_cached() const noexcept { return m_channel_cached; }
+    /**
+     * Run a complete unary call (send metadata, request and close, receive metadata, response and status)
+     * as a single batch, waiting on the completion queue only once.
+     * Only for methods known to be unary: the status completes once every response message was read,
+     * so a server sending more than one never finishes the batch.
+     * The callback is invoked with the response message if the server sent one.
+     * The request buffer is not consumed.
+     */
+    bool unary_call(const header_list& headers, grpc_byte_buffer* request,
+                    header_list& headers_out,
+                    message_callback cb, status& s);
+    bool unary_call(const header_list& headers, const void* data, size_t len,
+                    header_list& headers_out,
+                    message_callback cb, status& s);
+    // Unary call with extra attempts as allowed by policy, the method needs to be idempotent
+    bool unary_call(const header_list& headers, grpc_byte_buffer* request,
+                    header_list& headers_out,
+                    message_callback cb, status& s, const retry_policy& policy);
+
+    /**
+     * Streaming calls. start_stream() sends the metadata and keeps a receive outstanding for the whole call,
+     * every response message is passed to cb as soon as it arrives while waiting inside write(), poll() or finish().
+     * headers and headers_out need to stay valid until finish() returned.
+     */
+    bool start_stream(const header_list& headers,
+                      header_list& headers_out, message_callback cb);
+    /**
+     * Send a message, taking ownership of msg. Only one write is in flight at any time, so this waits for the
+     * previous one (forwarding responses meanwhile). Returns false once the call is over.
+     */
+    bool write(grpc_byte_buffer* msg);
+    // Half close the call, no more writes are possible afterwards
+    bool writes_done();
+    // Handle every event that is already available without blocking
+    bool poll();
+    // Half close if not done yet and wait for all responses and the final status
+    bool finish(status& s);
+
+    bool send_initial_metadata(const header_list& headers);
     bool send_request(const void* data, size_t len);
+    // The request buffer is not consumed
+    bool send_request(grpc_byte_buffer* request);
     bool send_client_close();
-    bool receive_initial_metadata(std::unordered_multimap<std::string, std::string>& headers);
-    bool receive_message(std::function<void(const void* data, size_t len)> cb);
+    bool receive_initial_metadata(header_list& headers);
+    bool receive_message(message_callback cb);
     bool receive_status(status& s);
 
-    static void process_init() noexcept;
+    /**
+     * Initialize grpc for this process. With engine_threads > 0 calls share one completion queue
+     * driven by that many threads, otherwise every call polls a (cached) queue of its own.
+     * Messages to the backends are compressed with backend_compression.
+     */
+    static void process_init(size_t engine_threads = 0, message_encoding backend_compression = message_encoding::identity) noexcept;
     static void process_deinit() noexcept;
     static bool is_backend_alive(const std::string& host) noexcept;
+    static cq_cache_stats get_cq_cache_stats() noexcept;
 };
\ No newline at end of file
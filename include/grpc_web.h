@@ -0,0 +1,100 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <grpc/slice.h>
+#include <header_list.h>
+
+struct grpc_byte_buffer;
+
+struct byte_buffer_deleter {
+    void operator()(grpc_byte_buffer* buf) const noexcept;
+};
+using byte_buffer_ptr = std::unique_ptr<grpc_byte_buffer, byte_buffer_deleter>;
+
+/**
+ * Incremental parser for grpc-web length prefixed frames.
+ * Data can be fed in arbitrary chunks, every frame is copied exactly once
+ * into a grpc slice sized from the frame header.
+ */
+class grpc_web_frame_reader {
+    grpc_web_frame_reader& operator=(const grpc_web_frame_reader&) = delete;
+    grpc_web_frame_reader(const grpc_web_frame_reader&) = delete;
+
+    size_t m_max_message_size;
+    uint8_t m_header[5];
+    size_t m_header_len = 0;
+    grpc_slice m_slice;
+    size_t m_message_len = 0;
+    size_t m_offset = 0;
+    bool m_failed = false;
+    bool m_too_large = false;
+public:
+    static constexpr uint8_t flag_compressed = 0x01;
+    static constexpr uint8_t flag_trailer = 0x80;
+    using callback = std::function<bool(uint8_t flags, byte_buffer_ptr message)>;
+
+    explicit grpc_web_frame_reader(size_t max_message_size) noexcept;
+    ~grpc_web_frame_reader();
+
+    /**
+     * Feed raw (decoded) body bytes, calling cb for every completed frame.
+     * Returns false if a frame exceeds the maximum message size or the callback returned false.
+     */
+    bool feed(const void* data, size_t len, const callback& cb);
+    // True if a frame was started but not completed
+    bool has_partial_frame() const noexcept { return m_header_len != 0; }
+    bool failed() const noexcept { return m_failed; }
+    // The feed failed because a frame header announced more than the maximum message size
+    bool too_large() const noexcept { return m_too_large; }
+};
+
+/**
+ * grpc-web body encodings. The -text variants base64 encode the framed stream,
+ * the binary ones send the frames as is. native is plain application/grpc (HTTP/2 only),
+ * framed like binary but with the status in real trailers instead of a trailer frame.
+ */
+enum class grpc_web_format {
+    binary,
+    text,
+    native
+};
+
+struct grpc_web_content_type {
+    grpc_web_format format = grpc_web_format::binary;
+    // The +proto suffix was given explicitly
+    bool proto = false;
+};
+
+/**
+ * Parse a Content-Type value (parameters are ignored).
+ * Returns false if it is neither a grpc-web type nor application/grpc or uses a message format other than proto.
+ */
+bool parse_grpc_web_content_type(const char* value, size_t len, grpc_web_content_type& out) noexcept;
+/**
+ * Pick the first grpc-web type (application/grpc is skipped) from a comma separated Accept value.
+ * Returns false if none is listed (including wildcards), leaving out untouched.
+ */
+bool parse_grpc_web_accept(const char* value, grpc_web_content_type& out) noexcept;
+
+/**
+ * Parse a grpc-timeout value (up to 8 digits followed by one of the units H, M, S, m, u or n)
+ * into milliseconds, rounded up so a short timeout does not turn into none at all.
+ */
+bool parse_grpc_timeout(const char* value, size_t len, uint64_t& ms) noexcept;
+const char* grpc_web_content_type_name(const grpc_web_content_type& ct) noexcept;
+
+/**
+ * Body of a grpc-web trailer frame: grpc-status, grpc-message, grpc-error (if set) and the trailing
+ * metadata as "key:value\r\n" lines, -bin values base64 encoded. The result is sized up front and
+ * filled in a single pass.
+ */
+std::string grpc_web_trailer(int status, const std::string& details, const std::string& error, const header_list& metadata);
+
+/**
+ * Percent encode a grpc-message value as required for a real HTTP/2 trailer:
+ * '%' and every byte outside of printable ASCII.
+ */
+std::string grpc_percent_encode(const std::string& message);
@@ -0,0 +1,145 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <base64.h>
+#include <config.h>
+#include <grpc_proxy.h>
+#include <grpc_web.h>
+#include <compression.h>
+#include <call_timing.h>
+#include <metrics.h>
+
+/**
+ * Where a grpc_web_call writes its response. Implemented on top of the output filters by the module
+ * and in memory by bench_replay.
+ */
+class grpc_web_sink {
+public:
+    virtual ~grpc_web_sink() = default;
+
+    /**
+     * The response is about to start (first message or the status). metadata is the initial metadata of
+     * the backend, encoding the message encoding of the response. Called once, before any frame.
+     */
+    virtual void start_response(const header_list& metadata, message_encoding encoding, const call_timing& timing) = 0;
+    // Append a frame to the response, text responses base64 encode it
+    virtual void append_frame(uint8_t flags, grpc_byte_buffer* msg, bool text) = 0;
+    virtual void append_frame(uint8_t flags, const void* data, size_t len, bool text) = 0;
+    // Send everything appended so far, false if the client can not be written to anymore
+    virtual bool flush() = 0;
+    // Status and trailing metadata of a plain grpc call, sent as real trailers
+    virtual void set_trailers(const grpc_proxy::status& status) = 0;
+    // The client connection was marked aborted, cheap enough to check after every write
+    virtual bool aborted() = 0;
+    // Probe the client connection, checked periodically while waiting for the backend
+    virtual bool disconnected() = 0;
+};
+
+/**
+ * A single proxied call, from the request headers to the trailer, without anything Apache specific:
+ * content type negotiation, decoding (base64, frames, compression) of the request body, the backend call
+ * (unary, streaming, cached or hedged as configured) and encoding of the response.
+ *
+ * begin() checks the request, the body is then passed to feed() as it arrives and finish() completes the call.
+ * Functions returning an int return an HTTP status for errors the client should see and 0 otherwise.
+ */
+class grpc_web_call {
+    grpc_web_call(const grpc_web_call&) = delete;
+    grpc_web_call& operator=(const grpc_web_call&) = delete;
+
+    const proxy_grpc_config_t& m_cfg;
+    grpc_web_sink& m_sink;
+    const char* m_backend;
+    const char* m_method;
+    header_list::alloc_func m_alloc;
+    void* m_alloc_ctx;
+    const header_list* m_headers_in = nullptr;
+
+    call_timing m_timing;
+    // Declared before the proxy so it is only recorded once the call is torn down
+    call_metrics m_metrics;
+    grpc_proxy m_proxy;
+    header_list m_headers_out;
+    grpc_proxy::status m_status;
+
+    grpc_web_content_type m_request_type;
+    grpc_web_content_type m_response_type;
+    bool m_text_response = false;
+    size_t m_max_size = 0;
+    message_encoding m_request_encoding = message_encoding::identity;
+    bool m_request_encoding_known = true;
+    message_encoding m_response_encoding = message_encoding::identity;
+    size_t m_compress_min_size = 0;
+    const proxy_grpc_cache_method_t* m_cache_method = nullptr;
+    const proxy_grpc_retry_method_t* m_retry_method = nullptr;
+    // Known to answer with a single message, so a single request message may run as one batch
+    bool m_unary = false;
+
+    bool m_started = false;
+    bool m_response_started = false;
+    bool m_completed = false;
+    // Reused for every compressed response message
+    std::string m_compressed;
+
+    // The first message is held back: a body with a single message to a unary method is sent as one batch,
+    // a second one switches to streaming where every message is written as soon as it is complete.
+    grpc_web_frame_reader m_reader;
+    byte_buffer_ptr m_first;
+    bool m_streaming = false;
+    bool m_stream_ok = true;
+    // A compressed frame could not be inflated
+    bool m_bad_message = false;
+    bool m_body_ok = true;
+    base64_decode_stream m_decoder;
+    std::string m_decoded;
+    size_t m_body_size = 0;
+
+    bool start_call();
+    bool start_streaming();
+    void start_response();
+    void count_out(size_t len);
+    void forward(grpc_byte_buffer* msg);
+    bool on_data(const char* data, size_t len);
+    // Write m_status as the trailer (grpc-web) or the trailers (native)
+    void write_status();
+    bool cached_unary_call(grpc_byte_buffer* request, const grpc_proxy::retry_policy& policy);
+public:
+    // Retry budget of every backend (grpcRetryBudget), process wide
+    static uint32_t retry_tokens;
+    static double retry_ratio;
+
+    /**
+     * backend (host:port) and method need to outlive the call. Metadata of the response is allocated
+     * with alloc (see header_list), which is also where the sink finds it.
+     */
+    grpc_web_call(const proxy_grpc_config_t& cfg, grpc_web_sink& sink, const char* backend, const char* method,
+                  header_list::alloc_func alloc = nullptr, void* alloc_ctx = nullptr);
+
+    /**
+     * Check the request metadata (lowercase keys, values zero terminated) and start the backend call
+     * unless it may be served from the cache. headers needs to stay valid until the call is destroyed.
+     * Plain grpc is only accepted with http2 set.
+     */
+    int begin(const header_list& headers, bool http2);
+    // Content type of the response, valid once begin() succeeded
+    const grpc_web_content_type& response_type() const noexcept { return m_response_type; }
+    /**
+     * Pass the next chunk of the request body as received (base64 for the -text types).
+     * Returns false if the rest of the body is not needed anymore.
+     */
+    bool feed(const char* data, size_t len);
+    // The body is complete, run or finish the backend call and write the status
+    int finish();
+    /**
+     * Reading the body failed, http_status (400, 408) is returned unless the response already started.
+     * The backend call is cancelled and a started response ends with CANCELLED.
+     */
+    int abort_body(int http_status);
+
+    // True once the status was written to the sink
+    bool completed() const noexcept { return m_completed; }
+    bool response_started() const noexcept { return m_response_started; }
+    const call_timing& timing() const noexcept { return m_timing; }
+    const grpc_proxy::status& status() const noexcept { return m_status; }
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+
+/**
+ * A single header, key and value are not necessarily zero terminated.
+ */
+struct header_entry {
+    const char* key;
+    size_t key_len;
+    const char* value;
+    size_t value_len;
+
+    bool key_equals(const char* k, size_t len) const noexcept { return key_len == len && memcmp(key, k, len) == 0; }
+};
+
+/**
+ * Flat list of headers referencing memory owned by an arena.
+ *
+ * Entries and copied strings are carved out of an allocator given at construction (usually an apr pool,
+ * see make_header_list in utils.h) and never freed individually. Without one the list uses an internal
+ * block allocator that is released with the list. Keys are expected to be lowercase.
+ */
+class header_list {
+public:
+    using alloc_func = void* (*)(void* ctx, size_t size);
+
+    header_list() noexcept;
+    // Reserves capacity entries up front, which like every allocation of the list may throw std::bad_alloc
+    header_list(alloc_func alloc, void* ctx, size_t capacity = 0);
+    ~header_list();
+    header_list(header_list&& other) noexcept;
+    header_list& operator=(header_list&& other) noexcept;
+    header_list(const header_list&) = delete;
+    header_list& operator=(const header_list&) = delete;
+
+    // Add a header referencing key and value, both need to outlive the list
+    void add_ref(const char* key, size_t key_len, const char* value, size_t value_len);
+    // Add a header copying key (lowercased) and value into the arena
+    void add_copy(const char* key, size_t key_len, const char* value, size_t value_len);
+    // First entry with key or nullptr
+    const header_entry* find(const char* key, size_t key_len) const noexcept;
+    const header_entry* find(const char* key) const noexcept { return find(key, strlen(key)); }
+
+    const header_entry* begin() const noexcept { return m_entries; }
+    const header_entry* end() const noexcept { return m_entries + m_size; }
+    size_t size() const noexcept { return m_size; }
+    bool empty() const noexcept { return m_size == 0; }
+
+    // Allocate from the arena backing this list
+    void* allocate(size_t size);
+
+private:
+    struct block;
+
+    alloc_func m_alloc;
+    void* m_ctx;
+    header_entry* m_entries = nullptr;
+    size_t m_size = 0;
+    size_t m_capacity = 0;
+    // Blocks of the internal allocator
+    block* m_blocks = nullptr;
+
+    void grow();
+    void release() noexcept;
+};
+
+/**
+ * Headers handled by grpc itself (or hop-by-hop) which must not be forwarded as metadata.
+ * key has to be lowercase.
+ */
+bool is_reserved_header(const char* key, size_t len) noexcept;
+
+// Binary metadata (key ending in -bin), its value has to be base64 encoded on the wire
+inline bool is_binary_header(const char* key, size_t len) noexcept {
+    return len > 4 && memcmp(key + len - 4, "-bin", 4) == 0;
+}
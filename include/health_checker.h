@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Background grpc.health.v1 prober.
+ *
+ * Every child runs a checker thread over the same list of backends. Results are kept in a shm_table
+ * shared by all children, and a probe is claimed with a CAS on its due time, so each backend is probed once per interval no matter how many children
+ * there are. Every child applies the shared state through the callback given to add(), which is how
+ * it reaches mod_proxy's worker status.
+ */
+class health_checker {
+public:
+    enum class state : uint32_t {
+        unknown = 0,
+        serving = 1,
+        not_serving = 2
+    };
+
+    static constexpr size_t max_backends = 128;
+
+    struct backend {
+        std::atomic<uint32_t> state;
+        uint32_t hash;
+        char host[128];
+        std::atomic<uint32_t> health;
+        // steady clock milliseconds of the next probe
+        std::atomic<uint64_t> next_check;
+        std::atomic<uint32_t> consecutive_failures;
+    };
+
+    struct table {
+        uint32_t magic;
+        backend backends[max_backends];
+    };
+
+    struct settings {
+        uint64_t interval_ms = 0;
+        uint64_t timeout_ms = 1000;
+        // Service name sent in the HealthCheckRequest, empty checks the whole server
+        std::string service;
+        // Failed probes in a row before a backend is considered down
+        uint32_t fails = 1;
+    };
+
+    // Called from the checker thread whenever the state of a backend changes (as seen by this child)
+    using callback = std::function<void(const std::string& host, state s)>;
+
+    static size_t shm_size() noexcept { return sizeof(table); }
+    // Use mem (zero filled, shm_size() bytes) as the shared result table, nullptr keeps results per process
+    static void attach(void* mem) noexcept;
+    // Last known state of host, unknown if it is not checked
+    static state get(const char* host) noexcept;
+
+    health_checker() = default;
+    ~health_checker();
+    health_checker(const health_checker&) = delete;
+    health_checker& operator=(const health_checker&) = delete;
+
+    // Register a backend (host:port), needs to be called before start()
+    void add(const std::string& host, callback cb);
+    bool empty() const noexcept { return m_targets.empty(); }
+    void start(const settings& s);
+    void stop();
+
+    // Encode a grpc.health.v1.HealthCheckRequest
+    static std::string encode_request(const std::string& service);
+    // Decode the status of a grpc.health.v1.HealthCheckResponse
+    static state decode_response(const char* data, size_t len) noexcept;
+
+private:
+    struct target {
+        std::string host;
+        backend* entry;
+        callback cb;
+        state applied;
+    };
+
+    std::vector<target> m_targets;
+    settings m_settings;
+    std::thread m_thread;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    bool m_running = false;
+
+    static backend* lookup(const char* host) noexcept;
+    void run();
+    state probe(const std::string& host, const std::string& request);
+};
@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Per backend and method call statistics kept in memory shared by all children.
+ *
+ * The entries are a shm_table, updated with atomic operations only, so readers (server-status,
+ * the scrape endpoint) can aggregate every child without any locking. Entries are claimed by the first call
+ * the backend answered (see call_metrics) and never freed, once the table is full new
+ * backend/method pairs are counted in a shared overflow entry.
+ */
+class proxy_metrics {
+public:
+    static constexpr size_t max_endpoints = 256;
+    static constexpr size_t num_latency_buckets = 15;
+    // Upper bounds of the latency buckets in microseconds, the last bucket is unbounded
+    static const uint64_t latency_bounds[num_latency_buckets - 1];
+    // grpc status codes 0-16, the last slot counts calls without a status (transport failures)
+    static constexpr size_t num_status = 18;
+
+    struct histogram {
+        std::atomic<uint64_t> buckets[num_latency_buckets];
+        std::atomic<uint64_t> sum_us;
+
+        void observe(uint64_t us) noexcept;
+        // Latency at percentile p (0-100) interpolated within its bucket, 0 with less than min_samples observations
+        uint64_t percentile_us(double p, uint64_t min_samples) const noexcept;
+    };
+
+    struct endpoint {
+        std::atomic<uint32_t> state;
+        uint32_t hash;
+        char backend[64];
+        char method[128];
+
+        std::atomic<uint64_t> calls;
+        std::atomic<int64_t> in_flight;
+        std::atomic<uint64_t> status[num_status];
+        // Request and response bytes as sent by the client (possibly base64) and as exchanged with the backend
+        std::atomic<uint64_t> bytes_in_wire;
+        std::atomic<uint64_t> bytes_in;
+        std::atomic<uint64_t> bytes_out;
+        std::atomic<uint64_t> bytes_out_wire;
+        histogram latency;
+        // Time blocked on the completion queue, waiting for the backend
+        histogram backend_wait;
+    };
+
+    struct table {
+        uint32_t magic;
+        std::atomic<uint64_t> channel_hits;
+        std::atomic<uint64_t> channel_misses;
+        std::atomic<uint64_t> cache_hits;
+        std::atomic<uint64_t> cache_misses;
+        endpoint endpoints[max_endpoints];
+        endpoint overflow;
+    };
+
+    static size_t shm_size() noexcept { return sizeof(table); }
+    // Use mem (zero filled, shm_size() bytes) as the metrics table, nullptr disables metrics
+    static void attach(void* mem) noexcept;
+    static bool enabled() noexcept { return s_table != nullptr; }
+
+    // Find or claim the entry of backend/method, nullptr if metrics are disabled
+    static endpoint* lookup(const char* backend, const char* method) noexcept;
+    // Entry of backend/method if it was claimed before, never claims one
+    static endpoint* find(const char* backend, const char* method) noexcept;
+    // Shared entry of everything without an entry of its own, nullptr if metrics are disabled
+    static endpoint* overflow() noexcept { return s_table ? &s_table->overflow : nullptr; }
+    static void record_channel_lookup(bool cached) noexcept;
+    static void record_cache_lookup(bool hit) noexcept;
+
+    static void write_prometheus(std::string& out);
+    // Plain text (short == true, as used by server-status?auto) or html table for server-status
+    static void write_status(std::string& out, bool short_format);
+
+private:
+    static table* s_table;
+};
+
+/**
+ * Tracks a single call, counting it as in flight until destroyed.
+ *
+ * Only a call the backend answered with a status other than UNIMPLEMENTED claims an entry for its
+ * backend/method, so requests to made up paths can not fill the table. Until then the call is counted
+ * in the entry claimed by an earlier call, or in the overflow entry.
+ */
+class call_metrics {
+    const char* m_backend;
+    const char* m_method;
+    proxy_metrics::endpoint* m_endpoint;
+    uint64_t m_start_us;
+public:
+    int status = -1;
+    uint64_t bytes_in_wire = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t bytes_out_wire = 0;
+    uint64_t backend_wait_us = 0;
+
+    // backend and method need to outlive the call_metrics
+    call_metrics(const char* backend, const char* method) noexcept;
+    ~call_metrics();
+    call_metrics(const call_metrics&) = delete;
+    call_metrics& operator=(const call_metrics&) = delete;
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <header_list.h>
+
+struct grpc_byte_buffer;
+
+/**
+ * Cache of unary call responses in memory shared by all children.
+ *
+ * The memory is created by the parent before forking (see proxy_grpc_post_config) and split into
+ * fixed size slots, grouped into sets of ways slots a key hashes to. Every slot is guarded by a sequence
+ * counter which is odd while the slot is written: writers claim a slot with a single CAS and give up if
+ * somebody else holds it, readers copy the slot out and discard the copy if the counter changed meanwhile.
+ * Neither side ever blocks, a contended slot is simply a miss.
+ */
+class response_cache {
+public:
+    static constexpr size_t ways = 4;
+
+    struct slot {
+        std::atomic<uint32_t> seq;
+        uint32_t key_len;
+        uint32_t data_len;
+        uint32_t reserved;
+        uint64_t hash;
+        // steady clock milliseconds, 0 if the slot is empty
+        uint64_t expires;
+        // key_len bytes key followed by data_len bytes serialized response
+    };
+
+    // A cached response, headers and trailers are copied into the lists given by the caller
+    struct entry {
+        header_list& headers;
+        header_list& trailers;
+        std::string message;
+        bool has_message = false;
+
+        entry(header_list& h, header_list& t) noexcept : headers(h), trailers(t) {}
+    };
+
+    static size_t shm_size(size_t slots, size_t slot_size) noexcept;
+    // Use mem (shm_size() bytes) for the cache, nullptr disables it. slots is rounded down to a multiple of ways.
+    static void attach(void* mem, size_t slots, size_t slot_size) noexcept;
+    static bool enabled() noexcept { return s_base != nullptr; }
+
+    /**
+     * Build the cache key of a call: backend, method, the values of the given metadata keys and the
+     * (uncompressed) request message itself. Keys are compared in full, so only equal requests share an entry;
+     * requests too large for a slot together with their response are simply not cached.
+     */
+    static std::string make_key(const char* backend, const char* method, const header_list& headers,
+                                const char* const* metadata_keys, size_t num_keys, grpc_byte_buffer* request);
+    /**
+     * TTL of a response allowed by its grpc-cache-control metadata (initial or trailing), capped at ttl_ms.
+     * Returns 0 if the response must not be cached (no-store, no-cache or private).
+     */
+    static uint64_t allowed_ttl(const header_list& headers, const header_list& trailers, uint64_t ttl_ms) noexcept;
+
+    // Returns true and fills out if a live entry for key exists
+    static bool lookup(const std::string& key, entry& out);
+    // Store an OK response, silently dropped if it does not fit into a slot or the slot is busy
+    static void store(const std::string& key, uint64_t ttl_ms, const header_list& headers, const header_list& trailers,
+                      const void* message, size_t message_len, bool has_message);
+
+private:
+    static unsigned char* s_base;
+    static size_t s_slots;
+    static size_t s_slot_size;
+
+    static slot* get_slot(size_t idx) noexcept;
+};
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+/**
+ * Open addressing hash tables of fixed size slots in memory shared by all children. The memory is created
+ * by the parent before forking (see proxy_grpc_post_config) and zero filled, every table type keeps an
+ * array of slots in it and uses these functions to find and claim them.
+ *
+ * A slot starts with a std::atomic<uint32_t> state and a uint32_t hash, followed by the key and the data.
+ * A free slot is claimed with a single CAS, filled with the key and then marked ready, after that only its
+ * data changes (with atomic operations). Slots are never freed. Somebody finding a slot that is still being
+ * claimed waits for a bounded time and then marks it abandoned, the claiming process most likely died
+ * halfway through. Abandoned slots are skipped, so their key may end up in a second slot.
+ */
+class shm_table {
+public:
+    enum : uint32_t {
+        slot_free = 0,
+        slot_claiming = 1,
+        slot_ready = 2,
+        slot_abandoned = 3
+    };
+    // Yields before a slot being claimed is considered abandoned, claiming only copies the key
+    static constexpr size_t max_claim_wait = 10000;
+
+    // FNV-1a of str, continuing from h to hash keys made of several strings
+    static uint32_t hash(const char* str, uint32_t h = 2166136261u) noexcept {
+        for(; *str; str++) h = (h ^ static_cast<uint8_t>(*str)) * 16777619u;
+        return h;
+    }
+
+    // Ready slot of the key with hash for which matches(slot) is true, nullptr if there is none
+    template<typename Slot, typename Match>
+    static Slot* find(Slot* slots, size_t count, uint32_t hash, Match matches) noexcept {
+        for(size_t i = 0; i < count; i++) {
+            auto& s = slots[(hash + i) % count];
+            auto state = s.state.load(std::memory_order_acquire);
+            // Keys are only ever added, so the key would be in this slot or before it
+            if(state == slot_free) return nullptr;
+            if(state == slot_ready && s.hash == hash && matches(s)) return &s;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Find the slot of the key like find(), or claim a free one and fill in the key with init(slot).
+     * nullptr if the table is full.
+     */
+    template<typename Slot, typename Match, typename Init>
+    static Slot* lookup(Slot* slots, size_t count, uint32_t hash, Match matches, Init init) noexcept {
+        for(size_t i = 0; i < count; i++) {
+            auto& s = slots[(hash + i) % count];
+            auto state = s.state.load(std::memory_order_acquire);
+            if(state == slot_free) {
+                uint32_t expected = slot_free;
+                if(s.state.compare_exchange_strong(expected, slot_claiming, std::memory_order_acq_rel)) {
+                    s.hash = hash;
+                    init(s);
+                    s.state.store(slot_ready, std::memory_order_release);
+                    return &s;
+                }
+                state = expected;
+            }
+            if(state == slot_claiming) state = wait_claimed(s.state);
+            if(state == slot_ready && s.hash == hash && matches(s)) return &s;
+        }
+        return nullptr;
+    }
+
+private:
+    static uint32_t wait_claimed(std::atomic<uint32_t>& state) noexcept {
+        auto res = state.load(std::memory_order_acquire);
+        for(size_t i = 0; res == slot_claiming && i < max_claim_wait; i++) {
+            std::this_thread::yield();
+            res = state.load(std::memory_order_acquire);
+        }
+        if(res != slot_claiming) return res;
+        // Fails if the slot became ready meanwhile, a late owner storing ready also revives it
+        if(state.compare_exchange_strong(res, slot_abandoned, std::memory_order_acq_rel)) return slot_abandoned;
+        return res;
+    }
+};
@@ -2,24 +2,31 @@
 extern "C" {
 #include <httpd.h>
 #include <apr_pools.h>
+#include <apr_tables.h>
 }
 #include <string>
 #include <unordered_map>
 #include <algorithm>
-#include <base64.h>
+#include <header_list.h>
 
+/**
+ * Pass the request body to func chunk by chunk until the body ends or func returns false.
+ * Returns the error of the input filters if the body ended early, body_size receives the bytes read.
+ */
 template<typename Func>
-size_t read_body(Func func, request_rec* r) {
+apr_status_t read_body(Func func, request_rec* r, size_t* body_size = nullptr) {
 
 	size_t total_size = 0;
 	bool seen_eos = false;
+	apr_status_t res = APR_SUCCESS;
 	auto *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     do {
         apr_bucket *bucket = NULL, *last = NULL;
 
         int rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, HUGE_STRING_LEN);
         if (rv != APR_SUCCESS) {
-            apr_brigade_destroy(bb);
+            // A truncated body must not look like a complete one
+            res = rv;
             break;
         }
 
@@ -42,73 +49,54 @@ size_t read_body(Func func, request_rec* r) {
 
             rv = apr_bucket_read(bucket, &data, &len, APR_BLOCK_READ);
             if (rv != APR_SUCCESS) {
-				apr_brigade_destroy(bb);
-				seen_eos = true;
+				res = rv;
 				break;
 			}
 
-			if(!func(data, len))
+			if(!func(data, len)) {
+				// The consumer is not interested in the rest of the body
+				seen_eos = true;
 				break;
+			}
 			total_size += len;
         }
 
         apr_brigade_cleanup(bb);
-	} while (!seen_eos);
+	} while (!seen_eos && res == APR_SUCCESS);
 
-	return total_size;
+	apr_brigade_destroy(bb);
+	if(body_size) *body_size = total_size;
+	return res;
 }
 
-inline std::unordered_multimap<std::string, std::string> convert_table(apr_table_t* table, bool lower_keys = false) {
-    std::unordered_multimap<std::string, std::string> res;
-    if(lower_keys) {
-        apr_table_do([](void *rec, const char *key, const char *value){
-            auto r = static_cast<std::unordered_multimap<std::string, std::string>*>(rec);
-            std::string k(key);
-            std::transform(k.begin(), k.end(), k.begin(), ::tolower);
-            r->emplace(std::move(k), std::string(value));
-            return 1;
-        }, &res, table, NULL);
-    } else {
-        apr_table_do([](void *rec, const char *key, const char *value){
-            auto r = static_cast<std::unordered_multimap<std::string, std::string>*>(rec);
-            r->emplace(std::string(key), std::string(value));
-            return 1;
-        }, &res, table, NULL);
-    }
-    return res;
+inline void* pool_alloc(void* pool, size_t size) {
+    return apr_palloc(static_cast<apr_pool_t*>(pool), size);
 }
 
-inline int64_t detect_content_length(request_rec *r) {
-    int64_t result = -1;
-    apr_table_do([](void *rec, const char *key, const char *value){
-        if(strcasecmp("Content-Length", key) == 0) {
-            *static_cast<int64_t*>(rec) = strtoll(value, nullptr, 10);
-            return 0;
-        }
-        return 1;
-    }, &result, r->headers_in, NULL);
-    return result;
+inline header_list make_header_list(apr_pool_t* pool, size_t capacity = 0) {
+    return header_list(pool_alloc, pool, capacity);
 }
 
-std::string read_body_base64(request_rec* r) {
-    bool failed = false;
-    std::string res;
-    base64_decode_stream stream;
-    read_body([&](const char* data, size_t len) -> bool {
-        for(size_t i = 0; i < len; i++) {
-            if(data[i] >='A' && data[i] <= 'Z') continue;
-            if(data[i] >='a' && data[i] <= 'z') continue;
-            if(data[i] >='0' && data[i] <= '9') continue;
-            if(data[i] == '+' || data[i] == '/' || data[i] == '=') continue;
-            // Invalid character
-            failed = true;
-            return false;
+/**
+ * Flat view of an apr table with lowercase keys. Values (and keys already lowercase)
+ * reference the table, so the list must not outlive the pool owning the table.
+ */
+inline header_list convert_table(apr_table_t* table, apr_pool_t* pool) {
+    auto elts = apr_table_elts(table);
+    auto res = make_header_list(pool, elts->nelts);
+    auto entries = reinterpret_cast<const apr_table_entry_t*>(elts->elts);
+    for(int i = 0; i < elts->nelts; i++) {
+        auto key = entries[i].key;
+        if(!key) continue;
+        auto key_len = strlen(key);
+        const char* upper = std::find_if(key, key + key_len, [](char c) { return c >= 'A' && c <= 'Z'; });
+        if(upper != key + key_len) {
+            auto lower = static_cast<char*>(res.allocate(key_len + 1));
+            for(size_t x = 0; x <= key_len; x++) lower[x] = (key[x] >= 'A' && key[x] <= 'Z') ? key[x] + ('a' - 'A') : key[x];
+            key = lower;
         }
-        stream.feed(res, data, len);
-        return true;
-    }, r);
-    if(failed) return "";
-    stream.flush(res);
+        res.add_ref(key, key_len, entries[i].val, strlen(entries[i].val));
+    }
     return res;
 }
 
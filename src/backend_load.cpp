@@ -0,0 +1,82 @@
+#include <backend_load.h>
+#include <shm_table.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static constexpr uint32_t table_magic = 0x67726c31;
+
+backend_load::table* backend_load::s_table = nullptr;
+
+static uint64_t now_us() noexcept {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void backend_load::attach(void* mem) noexcept {
+    s_table = static_cast<table*>(mem);
+    if(s_table && s_table->magic != table_magic) {
+        memset(static_cast<void*>(s_table), 0, sizeof(table));
+        s_table->magic = table_magic;
+    }
+}
+
+backend_load::backend* backend_load::lookup(const char* host) noexcept {
+    if(!s_table || !host || strlen(host) >= sizeof(backend::host)) return nullptr;
+    return shm_table::lookup(s_table->backends, max_backends, shm_table::hash(host),
+        [host](const backend& e) { return strcmp(e.host, host) == 0; },
+        [host](backend& e) { strcpy(e.host, host); });
+}
+
+const backend_load::backend* backend_load::find(const char* host) noexcept {
+    if(!s_table || !host) return nullptr;
+    return shm_table::find(s_table->backends, max_backends, shm_table::hash(host),
+        [host](const backend& e) { return strcmp(e.host, host) == 0; });
+}
+
+void backend_load::observe_latency(backend* b, uint64_t us) noexcept {
+    if(us == 0) us = 1;
+    auto old = b->latency_us.load(std::memory_order_relaxed);
+    uint64_t avg;
+    do {
+        avg = old == 0 ? us : old - old / latency_decay + us / latency_decay;
+        if(avg == 0) avg = 1;
+    } while(!b->latency_us.compare_exchange_weak(old, avg, std::memory_order_relaxed));
+}
+
+bool backend_load::retry_allowed(const backend* b, uint32_t max_tokens) noexcept {
+    if(!b) return true;
+    return b->retry_debt.load(std::memory_order_relaxed) < static_cast<int64_t>(max_tokens) * 500;
+}
+
+void backend_load::record_attempt(backend* b, bool failed, uint32_t max_tokens, double ratio) noexcept {
+    if(!b) return;
+    auto limit = static_cast<int64_t>(max_tokens) * 1000;
+    auto refund = static_cast<int64_t>(ratio * 1000);
+    auto old = b->retry_debt.load(std::memory_order_relaxed);
+    int64_t debt;
+    do {
+        debt = failed ? std::min(old + 1000, limit) : std::max<int64_t>(old - refund, 0);
+        if(debt == old) return;
+    } while(!b->retry_debt.compare_exchange_weak(old, debt, std::memory_order_relaxed));
+}
+
+void backend_load::tracker::begin(const char* host) noexcept {
+    end();
+    m_backend = lookup(host);
+    if(!m_backend) return;
+    m_backend->in_flight.fetch_add(1, std::memory_order_relaxed);
+    m_start_us = now_us();
+    m_responded = false;
+}
+
+void backend_load::tracker::responded() noexcept {
+    if(!m_backend || m_responded) return;
+    m_responded = true;
+    observe_latency(m_backend, now_us() - m_start_us);
+}
+
+void backend_load::tracker::end() noexcept {
+    if(!m_backend) return;
+    m_backend->in_flight.fetch_sub(1, std::memory_order_relaxed);
+    m_backend = nullptr;
+}
@@ -2,6 +2,11 @@
 #include <array>
 #include <cassert>
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
 static constexpr std::array<char, 64> encode_table {
 		{'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
 		'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
@@ -9,25 +14,247 @@ static constexpr std::array<char, 64> encode_table {
 		'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'}
 };
 
+// Invalid characters (including the padding '=') map to 0xff
+static constexpr uint8_t invalid = 0xff;
 static constexpr std::array<uint8_t, 256> decode_table = {
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 62,  0,  0,  0, 63, 
-	52, 53, 54, 55, 56, 57, 58, 59, 60, 61,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 
-	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,  0,  0,  0,  0,  0, 
-	 0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 
-	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
-	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,   62, 0xff, 0xff, 0xff,   63,
+	  52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+	  15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+	  41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/** ========= Kernels ========== **/
+// Encode kernels consume whole triplets and return the number of input bytes consumed.
+// Decode kernels consume whole quads up to the first non alphabet character (invalid or padding)
+// and return the number of input bytes consumed, they never write more than (consumed / 4) * 3
+// bytes past the region needed by the remaining input.
+
+static inline void encode_3(char* out, const uint8_t* data) {
+    uint32_t triple = (static_cast<uint32_t>(data[0]) << 0x10) + (static_cast<uint32_t>(data[1]) << 0x08) + data[2];
+    out[0] = encode_table[(triple >> 3 * 6) & 0x3F];
+    out[1] = encode_table[(triple >> 2 * 6) & 0x3F];
+    out[2] = encode_table[(triple >> 1 * 6) & 0x3F];
+    out[3] = encode_table[(triple >> 0 * 6) & 0x3F];
+}
+
+static size_t encode_scalar(char* out, const uint8_t* in, size_t len) {
+	size_t fast_size = len - len % 3;
+	for (size_t i = 0; i < fast_size; i += 3) {
+		encode_3(out, &in[i]);
+		out += 4;
+	}
+	return fast_size;
+}
+
+static size_t decode_scalar(char* out, const uint8_t* in, size_t len) {
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t a = decode_table[in[i]];
+        uint32_t b = decode_table[in[i + 1]];
+        uint32_t c = decode_table[in[i + 2]];
+        uint32_t d = decode_table[in[i + 3]];
+        if((a | b | c | d) & 0x80) break;
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = static_cast<char>((triple >> 16) & 0xFF);
+        out[1] = static_cast<char>((triple >> 8) & 0xFF);
+        out[2] = static_cast<char>((triple >> 0) & 0xFF);
+        out += 3;
+    }
+    return i;
+}
+
+#ifdef BASE64_X86
+// Vector algorithms by Wojciech Mula and Daniel Lemire, "Faster Base64 Encoding and Decoding using AVX2 Instructions"
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_reshuffle_ssse3(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i in) {
+    const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    const __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+    indices = _mm_sub_epi8(indices, mask);
+    return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(char* out, const uint8_t* in, size_t len) {
+    size_t i = 0;
+    // Every round loads 16 bytes but only consumes 12
+    for (; i + 16 <= len; i += 12) {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        str = enc_translate_ssse3(enc_reshuffle_ssse3(str));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), str);
+        out += 16;
+    }
+    return i + encode_scalar(out, in + i, len - i);
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(char* out, const uint8_t* in, size_t len) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2F);
+    size_t i = 0;
+    // Every round stores 16 bytes but only produces 12, keep enough input left to cover the overshoot
+    for (; i + 24 <= len; i += 16) {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        // Leave anything outside the alphabet to the scalar code
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) break;
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+        const __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        str = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), str);
+        out += 12;
+    }
+    return i + decode_scalar(out, in + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(char* out, const uint8_t* in, size_t len) {
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                             1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                         65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    size_t i = 0;
+    // Every round loads 12 bytes into each lane (reading 16 bytes per lane) and consumes 24
+    for (; i + 28 <= len; i += 24) {
+        const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+        __m256i str = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        str = _mm256_shuffle_epi8(str, shuffle);
+        const __m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0FC0FC00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003F03F0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        str = _mm256_or_si256(t1, t3);
+        __m256i indices = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+        const __m256i mask = _mm256_cmpgt_epi8(str, _mm256_set1_epi8(25));
+        indices = _mm256_sub_epi8(indices, mask);
+        str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut, indices));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+        out += 32;
+    }
+    return i + encode_ssse3(out, in + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(char* out, const uint8_t* in, size_t len) {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+    size_t i = 0;
+    // Every round stores 32 bytes but only produces 24, keep enough input left to cover the overshoot
+    for (; i + 48 <= len; i += 32) {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        // Leave anything outside the alphabet to the scalar code
+        if (!_mm256_testz_si256(lo, hi)) break;
+        const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+        const __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        str = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+        out += 24;
+    }
+    return i + decode_ssse3(out, in + i, len - i);
+}
+#endif
+
+struct base64_kernels {
+    base64_impl impl;
+    size_t (*encode)(char* out, const uint8_t* in, size_t len);
+    size_t (*decode)(char* out, const uint8_t* in, size_t len);
 };
 
+static bool impl_supported(base64_impl impl) noexcept {
+    switch(impl) {
+    case base64_impl::scalar: return true;
+#ifdef BASE64_X86
+    case base64_impl::ssse3: __builtin_cpu_init(); return __builtin_cpu_supports("ssse3");
+    case base64_impl::avx2: __builtin_cpu_init(); return __builtin_cpu_supports("avx2");
+#endif
+    default: return false;
+    }
+}
+
+static base64_kernels make_kernels(base64_impl impl) noexcept {
+    switch(impl) {
+#ifdef BASE64_X86
+    case base64_impl::ssse3: return { impl, encode_ssse3, decode_ssse3 };
+    case base64_impl::avx2: return { impl, encode_avx2, decode_avx2 };
+#endif
+    default: return { base64_impl::scalar, encode_scalar, decode_scalar };
+    }
+}
+
+static base64_kernels detect_kernels() noexcept {
+    if(impl_supported(base64_impl::avx2)) return make_kernels(base64_impl::avx2);
+    if(impl_supported(base64_impl::ssse3)) return make_kernels(base64_impl::ssse3);
+    return make_kernels(base64_impl::scalar);
+}
+
+static base64_kernels g_kernels = detect_kernels();
+
+base64_impl base64_get_impl() noexcept {
+    return g_kernels.impl;
+}
+
+bool base64_set_impl(base64_impl impl) noexcept {
+    if(!impl_supported(impl)) return false;
+    g_kernels = make_kernels(impl);
+    return true;
+}
+
+const char* base64_impl_name(base64_impl impl) noexcept {
+    switch(impl) {
+    case base64_impl::ssse3: return "ssse3";
+    case base64_impl::avx2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+/** ========= Encoder ========== **/
+
 std::string base64_encode_stream::feed(const void* data, size_t len) {
 	std::string out;
 	feed(out, data, len);
@@ -41,55 +268,46 @@ std::string base64_encode_stream::flush() {
 }
 
 void base64_encode_stream::feed(std::string& out, const void* data, size_t len) {
-    auto full_len = guess_encoded_size(m_buffer.size() + len);
-    out.reserve(out.size() + full_len);
+    auto size = out.size();
+    out.resize(size + max_encoded_size(m_buffer.size() + len));
+    out.resize(size + feed(&out[size], data, len));
+}
 
-    auto bin = reinterpret_cast<const char*>(data);
+size_t base64_encode_stream::feed(char* out, const void* data, size_t len) {
+    auto bin = reinterpret_cast<const uint8_t*>(data);
+    auto pos = out;
 	while(len > 0 && m_buffer.size() != 3 && !m_buffer.empty()) {
-		m_buffer += *bin;
+		m_buffer += static_cast<char>(*bin);
 		bin++;
 		len--;
 	}
     if(!m_buffer.empty()) {
 		// We stored all our data in the buffer but where unable to fill it
-		if(m_buffer.size() != 3) return;
-        uint32_t octet_a = static_cast<unsigned char>(m_buffer[0]);
-		uint32_t octet_b = static_cast<unsigned char>(m_buffer[1]);
-		uint32_t octet_c = static_cast<unsigned char>(m_buffer[2]);
-
-		uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-		out += encode_table[(triple >> 3 * 6) & 0x3F];
-		out += encode_table[(triple >> 2 * 6) & 0x3F];
-		out += encode_table[(triple >> 1 * 6) & 0x3F];
-		out += encode_table[(triple >> 0 * 6) & 0x3F];
-		
+		if(m_buffer.size() != 3) return 0;
+		encode_3(pos, reinterpret_cast<const uint8_t*>(m_buffer.data()));
+		pos += 4;
         m_buffer.clear();
     }
 
 	assert(m_buffer.empty());
 
-    // clear incomplete bytes
-	size_t fast_size = len - len % 3;
-	for (size_t i = 0; i < fast_size;) {
-		uint32_t octet_a = static_cast<unsigned char>(bin[i++]);
-		uint32_t octet_b = static_cast<unsigned char>(bin[i++]);
-		uint32_t octet_c = static_cast<unsigned char>(bin[i++]);
-
-		uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-
-		out += encode_table[(triple >> 3 * 6) & 0x3F];
-		out += encode_table[(triple >> 2 * 6) & 0x3F];
-		out += encode_table[(triple >> 1 * 6) & 0x3F];
-		out += encode_table[(triple >> 0 * 6) & 0x3F];
-	}
+	auto consumed = g_kernels.encode(pos, bin, len);
+	pos += (consumed / 3) * 4;
 
-	for(size_t i = fast_size; i < len; i++) m_buffer += bin[i];
+    // keep incomplete bytes for the next call
+	m_buffer.append(reinterpret_cast<const char*>(&bin[consumed]), len - consumed);
+	return pos - out;
 }
 
 void base64_encode_stream::flush(std::string& out) {
 	if(m_buffer.empty()) return;
+	auto size = out.size();
+	out.resize(size + 4);
+	out.resize(size + flush(&out[size]));
+}
 
-	out.reserve(out.size() + 4);
+size_t base64_encode_stream::flush(char* out) {
+	if(m_buffer.empty()) return 0;
 
 	auto len = m_buffer.size();
 	uint32_t octet_a = static_cast<unsigned char>(m_buffer[0]);
@@ -99,22 +317,24 @@ void base64_encode_stream::flush(std::string& out) {
 
 	switch (len % 3) {
 	case 1:
-		out += encode_table[(triple >> 3 * 6) & 0x3F];
-		out += encode_table[(triple >> 2 * 6) & 0x3F];
-		out += '=';
-		out += '=';
-		break;
+		out[0] = encode_table[(triple >> 3 * 6) & 0x3F];
+		out[1] = encode_table[(triple >> 2 * 6) & 0x3F];
+		out[2] = '=';
+		out[3] = '=';
+		return 4;
 	case 2:
-		out += encode_table[(triple >> 3 * 6) & 0x3F];
-		out += encode_table[(triple >> 2 * 6) & 0x3F];
-		out += encode_table[(triple >> 1 * 6) & 0x3F];
-		out += '=';
-		break;
+		out[0] = encode_table[(triple >> 3 * 6) & 0x3F];
+		out[1] = encode_table[(triple >> 2 * 6) & 0x3F];
+		out[2] = encode_table[(triple >> 1 * 6) & 0x3F];
+		out[3] = '=';
+		return 4;
 	default:
-		break;
+		return 0;
 	}
 }
 
+/** ========= Decoder ========== **/
+
 std::string base64_decode_stream::feed(const void* data, size_t len) {
 	std::string out;
 	feed(out, data, len);
@@ -127,55 +347,102 @@ std::string base64_decode_stream::flush() {
 	return out;
 }
 
-static inline void decode_4(std::string& out, const void* pdata) {
-    auto data = reinterpret_cast<const uint8_t*>(pdata);
-    uint32_t triple = static_cast<uint32_t>(decode_table[data[0]]) << 18;
-    triple |= static_cast<uint32_t>(decode_table[data[1]]) << 12;
-    triple |= static_cast<uint32_t>(decode_table[data[2]]) << 6;
-    triple |= static_cast<uint32_t>(decode_table[data[3]]);
-    
-    out += static_cast<char>((triple >> 16) & 0xFF);
-    out += static_cast<char>((triple >> 8) & 0xFF);
-    out += static_cast<char>((triple >> 0) & 0xFF);
+/**
+ * Decode a single quad which may contain padding.
+ * Returns the number of bytes written or -1 if the quad is invalid.
+ */
+static inline int decode_quad(char* out, const uint8_t* data) {
+    uint32_t a = decode_table[data[0]];
+    uint32_t b = decode_table[data[1]];
+    uint32_t c = decode_table[data[2]];
+    uint32_t d = decode_table[data[3]];
+    if((a | b) & 0x80) return -1;
+    uint32_t triple = (a << 18) | (b << 12);
+    if(c == invalid) {
+        if(data[2] != '=' || data[3] != '=') return -1;
+        out[0] = static_cast<char>((triple >> 16) & 0xFF);
+        return 1;
+    }
+    triple |= c << 6;
+    if(d == invalid) {
+        if(data[3] != '=') return -1;
+        out[0] = static_cast<char>((triple >> 16) & 0xFF);
+        out[1] = static_cast<char>((triple >> 8) & 0xFF);
+        return 2;
+    }
+    triple |= d;
+    out[0] = static_cast<char>((triple >> 16) & 0xFF);
+    out[1] = static_cast<char>((triple >> 8) & 0xFF);
+    out[2] = static_cast<char>((triple >> 0) & 0xFF);
+    return 3;
 }
 
-static inline void decode_4_padding(std::string& out, const void* pdata) {
-    auto data = reinterpret_cast<const uint8_t*>(pdata);
-    uint32_t triple = static_cast<uint32_t>(decode_table[data[0]]) << 18;
-    triple |= static_cast<uint32_t>(decode_table[data[1]]) << 12;
-    triple |= static_cast<uint32_t>(decode_table[data[2]]) << 6;
-    triple |= static_cast<uint32_t>(decode_table[data[3]]);
-    
-    out += static_cast<char>((triple >> 16) & 0xFF);
-    if(data[2] != '=') out += static_cast<char>((triple >> 8) & 0xFF);
-    if(data[3] != '=') out += static_cast<char>((triple >> 0) & 0xFF);
-}
-
-void base64_decode_stream::feed(std::string& out, const void* pdata, size_t len) {
-    out.reserve(out.size() + ((len+4)*3)/4);
+void base64_decode_stream::feed(std::string& out, const void* data, size_t len) {
+    auto size = out.size();
+    out.resize(size + max_decoded_size(m_buffer.size() + len));
+    out.resize(size + feed(&out[size], data, len));
+}
+
+size_t base64_decode_stream::feed(char* out, const void* pdata, size_t len) {
+    if(m_failed) return 0;
     auto data = reinterpret_cast<const uint8_t*>(pdata);
-    while(len > 0 && data[len-1] == '=') len--;
+    auto pos = out;
     if(!m_buffer.empty()) {
         while(m_buffer.size() < 4 && len > 0) {
-            m_buffer += *data;
+            m_buffer += static_cast<char>(*data);
             data++;
             len--;
         }
-        if(m_buffer.size() == 4) {
-            decode_4(out, m_buffer.data());
-            m_buffer.clear();
+        if(m_buffer.size() < 4) return 0;
+        auto n = decode_quad(pos, reinterpret_cast<const uint8_t*>(m_buffer.data()));
+        m_buffer.clear();
+        if(n < 0) {
+            m_failed = true;
+            return 0;
         }
+        pos += n;
     }
-    for (size_t i = 0; i < (len & ~3); i+=4) {
-        decode_4(out, &data[i]);
+    while(len >= 4) {
+        // The kernel stops at padding or invalid characters, those are handled one quad at a time
+        auto consumed = g_kernels.decode(pos, data, len);
+        pos += (consumed / 4) * 3;
+        data += consumed;
+        len -= consumed;
+        if(len < 4) break;
+        auto n = decode_quad(pos, data);
+        if(n < 0) {
+            m_failed = true;
+            return pos - out;
+        }
+        pos += n;
+        data += 4;
+        len -= 4;
     }
-    if(len%4 !=0) m_buffer.append(reinterpret_cast<const char*>(&data[len&~3]), len%4);
+    m_buffer.append(reinterpret_cast<const char*>(data), len);
+    return pos - out;
 }
 
 void base64_decode_stream::flush(std::string& out) {
     if(m_buffer.empty()) return;
-    out.reserve(out.size() + 3);
+    auto size = out.size();
+    out.resize(size + 3);
+    out.resize(size + flush(&out[size]));
+}
+
+size_t base64_decode_stream::flush(char* out) {
+    if(m_buffer.empty() || m_failed) return 0;
+    // Unpadded input, a single character can not encode anything
+    if(m_buffer.size() == 1) {
+        m_buffer.clear();
+        m_failed = true;
+        return 0;
+    }
     m_buffer.resize(4, '=');
-    decode_4_padding(out, m_buffer.data());
+    auto n = decode_quad(out, reinterpret_cast<const uint8_t*>(m_buffer.data()));
     m_buffer.clear();
-}
\ No newline at end of file
+    if(n < 0) {
+        m_failed = true;
+        return 0;
+    }
+    return n;
+}
@@ -0,0 +1,57 @@
+#include <call_timing.h>
+#include <algorithm>
+#include <cstdio>
+
+static const char* phase_names[call_timing::num_phases] = {
+    "lookup", "body", "start", "first", "last", "trailer"
+};
+
+namespace {
+    struct writer {
+        char* buf;
+        size_t len;
+        size_t pos = 0;
+
+        void append_ms(const char* name, uint64_t ns) noexcept {
+            append("%s%s;dur=%.3f", pos ? ", " : "", name, ns / 1e6);
+        }
+        template<typename... Args>
+        void append(const char* fmt, Args... args) noexcept {
+            if(pos >= len) return;
+            auto n = snprintf(buf + pos, len - pos, fmt, args...);
+            if(n > 0) pos = std::min(pos + static_cast<size_t>(n), len - 1);
+        }
+    };
+}
+
+size_t call_timing::format_note(char* buf, size_t len) const noexcept {
+    if(len == 0) return 0;
+    buf[0] = '\0';
+    writer w{buf, len};
+    for(size_t i = 0; i < num_phases; i++) {
+        if(m_marks[i] == 0) continue;
+        w.append("%s%s=%llu", w.pos ? " " : "", phase_names[i], static_cast<unsigned long long>(m_marks[i] / 1000));
+    }
+    w.append("%sdecode=%llu", w.pos ? " " : "", static_cast<unsigned long long>(m_decode / 1000));
+    return w.pos;
+}
+
+size_t call_timing::format_server_timing(char* buf, size_t len, bool complete) const noexcept {
+    if(len == 0) return 0;
+    buf[0] = '\0';
+    writer w{buf, len};
+    auto lookup = m_marks[channel_lookup];
+    auto body = m_marks[body_read];
+    if(lookup) w.append_ms("lookup", m_lookup);
+    // Cache misses look up the channel after the body was read, it is only part of the body phase otherwise
+    if(body) w.append_ms("body", lookup && lookup <= body ? body - std::min(m_lookup, body) : body);
+    w.append_ms("decode", m_decode);
+    auto start = m_marks[call_start];
+    if(start && m_marks[first_response] >= start) w.append_ms("ttfb", m_marks[first_response] - start);
+    if(complete) {
+        if(start && m_marks[last_message] >= start) w.append_ms("backend", m_marks[last_message] - start);
+        auto end = m_marks[trailer_write] ? m_marks[trailer_write] : m_marks[last_message];
+        if(end) w.append_ms("total", end);
+    }
+    return w.pos;
+}
@@ -0,0 +1,95 @@
+#include <channel_args.h>
+#include <grpc/grpc.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <new>
+
+static bool parse_int(const std::string& value, int& out) noexcept {
+    if(value.empty()) return false;
+    char* end = nullptr;
+    errno = 0;
+    auto res = strtol(value.c_str(), &end, 10);
+    if(errno != 0 || *end != '\0' || res < INT_MIN || res > INT_MAX) return false;
+    out = static_cast<int>(res);
+    return true;
+}
+
+void channel_args::set(const std::string& key, const std::string& value) {
+    arg a{ key, value, 0, false };
+    a.is_integer = parse_int(value, a.integer);
+    set(std::move(a));
+}
+
+void channel_args::set(const std::string& key, int value) {
+    set(arg{ key, std::to_string(value), value, true });
+}
+
+channel_args::~channel_args() {
+    auto m = m_merges.load();
+    while(m) {
+        auto next = m->next;
+        delete m;
+        m = next;
+    }
+}
+
+void channel_args::merge(const channel_args& other) {
+    for(auto& a : other.m_args) set(a);
+}
+
+channel_args* channel_args::merged_over(const channel_args& base) noexcept {
+    auto head = m_merges.load(std::memory_order_acquire);
+    for(auto m = head; m; m = m->next) {
+        if(m->base == &base) return m->result.get();
+    }
+    std::unique_ptr<merge_result> m(new (std::nothrow) merge_result{ &base, nullptr, nullptr });
+    if(!m) return nullptr;
+    try {
+        m->result.reset(new channel_args());
+        m->result->merge(base);
+        m->result->merge(*this);
+    } catch(const std::exception&) {
+        return nullptr;
+    }
+    // Another thread may have merged the same base meanwhile, the first one published wins
+    m->next = head;
+    while(!m_merges.compare_exchange_weak(m->next, m.get(), std::memory_order_acq_rel)) {
+        for(auto other = m->next; other != head; other = other->next) {
+            if(other->base == &base) return other->result.get();
+        }
+        head = m->next;
+    }
+    return m.release()->result.get();
+}
+
+void channel_args::set(arg a) {
+    auto it = std::lower_bound(m_args.begin(), m_args.end(), a.key, [](const arg& e, const std::string& key) { return e.key < key; });
+    if(it != m_args.end() && it->key == a.key) *it = std::move(a);
+    else m_args.insert(it, std::move(a));
+
+    m_id.clear();
+    for(auto& e : m_args) {
+        m_id += e.key;
+        m_id += '=';
+        m_id += e.value;
+        m_id += ';';
+    }
+    m_hash = std::hash<std::string>()(m_id);
+}
+
+void channel_args::append_to(std::vector<grpc_arg>& out) const {
+    for(auto& e : m_args) {
+        grpc_arg a = {};
+        a.key = const_cast<char*>(e.key.c_str());
+        if(e.is_integer) {
+            a.type = GRPC_ARG_INTEGER;
+            a.value.integer = e.integer;
+        } else {
+            a.type = GRPC_ARG_STRING;
+            a.value.string = const_cast<char*>(e.value.c_str());
+        }
+        out.push_back(a);
+    }
+}
@@ -0,0 +1,269 @@
+#include <channel_registry.h>
+#include <channel_args.h>
+#include <grpc/grpc.h>
+#include <grpc/compression.h>
+#include <grpc/support/log.h>
+#include <algorithm>
+
+static std::atomic<uint64_t> g_registry_version{0};
+
+struct registry_snapshot {
+    const channel_registry* owner = nullptr;
+    uint64_t version = 0;
+    std::shared_ptr<const void> map;
+};
+static thread_local registry_snapshot t_snapshot;
+
+static size_t pool_key(const std::string& host, const channel_args* args) noexcept {
+    auto h = std::hash<std::string>()(host);
+    return args ? h ^ (args->hash() + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)) : h;
+}
+
+// The pool of host and args in map, map.end() if there is none
+template<typename Map>
+static auto find_pool(Map& map, size_t key, const std::string& host, const channel_args* args) noexcept -> decltype(map.begin()) {
+    auto range = map.equal_range(key);
+    for(auto it = range.first; it != range.second; ++it) {
+        auto& p = *it->second;
+        if(p.host == host && (args ? p.args_id == args->id() : p.args_id.empty())) return it;
+    }
+    return map.end();
+}
+
+static bool is_usable(int state) {
+    return state != GRPC_CHANNEL_SHUTDOWN && state != GRPC_CHANNEL_TRANSIENT_FAILURE;
+}
+
+static gpr_timespec watch_deadline() {
+    // Bounded so a stopping watcher does not wait forever on idle channels
+    return gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_millis(1000, GPR_TIMESPAN));
+}
+
+channel_registry::lease::lease(std::shared_ptr<entry> e) noexcept
+    : m_entry(std::move(e))
+{
+    if(m_entry) m_entry->outstanding++;
+}
+
+channel_registry::lease& channel_registry::lease::operator=(lease&& other) noexcept {
+    if(this != &other) {
+        reset();
+        m_entry = std::move(other.m_entry);
+    }
+    return *this;
+}
+
+channel_registry::lease::~lease() {
+    reset();
+}
+
+void channel_registry::lease::reset() noexcept {
+    if(m_entry) m_entry->outstanding--;
+    m_entry.reset();
+}
+
+/**
+ * Pick the channel with the fewest outstanding calls out of the first size channels,
+ * starting at a round robin position so ties are spread evenly. Channels in transient failure
+ * are skipped while there are others, grpc reconnects them with its own backoff and the watcher
+ * notices once they are back. If all of them failed the least busy one is used anyway.
+ * Returns null if the pool is too small, outdated or contains a shut down channel.
+ */
+template<typename Pool>
+static std::shared_ptr<channel_registry::entry> pick(Pool& p, size_t size) {
+    if(p.channels.size() < size) return nullptr;
+    auto start = size == 1 ? 0 : p.next.fetch_add(1, std::memory_order_relaxed);
+    const std::shared_ptr<channel_registry::entry>* best = nullptr;
+    bool best_usable = false;
+    int best_outstanding = 0;
+    for(size_t i = 0; i < size; i++) {
+        auto& e = p.channels[(start + i) % size];
+        auto state = e->state.load(std::memory_order_relaxed);
+        if(e->retired.load(std::memory_order_relaxed) || state == GRPC_CHANNEL_SHUTDOWN)
+            return nullptr;
+        auto usable = is_usable(state);
+        auto outstanding = e->outstanding.load(std::memory_order_relaxed);
+        if(!best || (usable && !best_usable) || (usable == best_usable && outstanding < best_outstanding)) {
+            best = &e;
+            best_usable = usable;
+            best_outstanding = outstanding;
+        }
+    }
+    return *best;
+}
+
+channel_registry::channel_registry()
+    : m_map(std::make_shared<const map_t>()), m_version(++g_registry_version), m_running(false), m_watch_cq(nullptr)
+{}
+
+channel_registry::~channel_registry() {
+    stop();
+    clear();
+}
+
+channel_registry::lease channel_registry::get(const std::string& host, size_t pool_size, bool* cached, const channel_args* args) {
+    if(pool_size == 0) pool_size = 1;
+    if(args && args->empty()) args = nullptr;
+    if(cached) *cached = true;
+    auto version = m_version.load(std::memory_order_acquire);
+    auto& snap = t_snapshot;
+    if(snap.owner != this || snap.version != version) {
+        snap.map = std::atomic_load(&m_map);
+        snap.owner = this;
+        snap.version = version;
+    }
+    auto map = static_cast<const map_t*>(snap.map.get());
+    auto key = pool_key(host, args);
+    auto it = find_pool(*map, key, host, args);
+    if(it != map->end()) {
+        auto e = pick(*it->second, pool_size);
+        if(e) return lease(std::move(e));
+    }
+    if(cached) *cached = false;
+    return get_slow(key, host, pool_size, args);
+}
+
+std::shared_ptr<channel_registry::entry> channel_registry::create_entry(const std::string& host, bool local_subchannels, const channel_args* extra) {
+    std::vector<grpc_arg> arg;
+    // A local subchannel pool gives the channel its own connection instead of sharing one with the other channels
+    if(local_subchannels) {
+        grpc_arg a = {};
+        a.type = GRPC_ARG_INTEGER;
+        a.key = const_cast<char*>(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL);
+        a.value.integer = 1;
+        arg.push_back(a);
+    }
+    // Responses are decompressed by grpc, the backend picks its own algorithm from our grpc-accept-encoding
+    if(m_compression != 0) {
+        grpc_arg a = {};
+        a.type = GRPC_ARG_INTEGER;
+        a.key = const_cast<char*>(GRPC_COMPRESSION_CHANNEL_DEFAULT_ALGORITHM);
+        a.value.integer = m_compression;
+        arg.push_back(a);
+    }
+    // Configured arguments come last, grpc uses the last value given for a key
+    if(extra) extra->append_to(arg);
+    grpc_channel_args args;
+    args.num_args = arg.size();
+    args.args = arg.data();
+    std::shared_ptr<grpc_channel> channel(grpc_insecure_channel_create(host.c_str(), &args, NULL),
+                                            [](grpc_channel* ch){ if(ch) grpc_channel_destroy(ch); });
+    if(channel.get() == nullptr) return nullptr;
+
+    auto e = std::make_shared<entry>();
+    e->host = host;
+    e->channel = channel;
+    e->retired = false;
+    e->outstanding = 0;
+    // Kick off the connect, the watcher keeps the state updated from here on
+    e->state = grpc_channel_check_connectivity_state(channel.get(), true);
+    return e;
+}
+
+channel_registry::lease channel_registry::get_slow(size_t key, const std::string& host, size_t pool_size, const channel_args* args) {
+    std::unique_lock<std::mutex> lck(m_write_mtx);
+    // Somebody else might have repaired the pool while we waited for the lock
+    auto it = find_pool(*m_map, key, host, args);
+    std::shared_ptr<pool> old;
+    if(it != m_map->end()) {
+        old = it->second;
+        // Without a watcher we have to fall back to polling
+        if(!m_running) {
+            for(auto& e : old->channels)
+                e->state = grpc_channel_check_connectivity_state(e->channel.get(), true);
+        }
+        auto e = pick(*old, pool_size);
+        if(e) return lease(std::move(e));
+    }
+
+    auto p = std::make_shared<pool>();
+    p->host = host;
+    if(args) p->args_id = args->id();
+    p->next = 0;
+    std::vector<std::shared_ptr<entry>> added;
+    auto size = std::max(pool_size, old ? old->channels.size() : 0);
+    for(size_t i = 0; i < size; i++) {
+        // Only shut down channels are replaced, failed ones recover on their own
+        if(old && i < old->channels.size() && old->channels[i]->state != GRPC_CHANNEL_SHUTDOWN) {
+            p->channels.push_back(old->channels[i]);
+            continue;
+        }
+        auto e = create_entry(host, i != 0, args);
+        if(!e) return lease();
+        if(old && i < old->channels.size()) old->channels[i]->retired = true;
+        p->channels.push_back(e);
+        added.push_back(e);
+    }
+
+    auto map = std::make_shared<map_t>(*m_map);
+    auto existing = find_pool(*map, key, host, args);
+    if(existing != map->end()) existing->second = p;
+    else map->emplace(key, p);
+    publish(std::move(map));
+    if(m_running) {
+        for(auto& e : added) watch(e, e->state);
+    }
+    return lease(pick(*p, pool_size));
+}
+
+void channel_registry::publish(std::shared_ptr<const map_t> map) {
+    std::atomic_store(&m_map, std::move(map));
+    m_version.store(++g_registry_version, std::memory_order_release);
+}
+
+void channel_registry::watch(const std::shared_ptr<entry>& e, int last_state) {
+    auto tag = new std::shared_ptr<entry>(e);
+    grpc_channel_watch_connectivity_state(e->channel.get(), static_cast<grpc_connectivity_state>(last_state),
+        watch_deadline(), m_watch_cq, tag);
+}
+
+void channel_registry::watcher_main() {
+    while(true) {
+        auto ev = grpc_completion_queue_next(m_watch_cq, gpr_inf_future(GPR_CLOCK_REALTIME), nullptr);
+        if(ev.type == GRPC_QUEUE_SHUTDOWN) break;
+        if(ev.type != GRPC_OP_COMPLETE) continue;
+        auto tag = static_cast<std::shared_ptr<entry>*>(ev.tag);
+        auto& e = *tag;
+        if(!e->retired) {
+            // Success means the state changed, otherwise the watch just timed out
+            if(ev.success) e->state = grpc_channel_check_connectivity_state(e->channel.get(), false);
+            std::unique_lock<std::mutex> lck(m_write_mtx);
+            if(m_running) watch(e, e->state);
+        }
+        delete tag;
+    }
+}
+
+void channel_registry::start() {
+    std::unique_lock<std::mutex> lck(m_write_mtx);
+    if(m_running) return;
+    m_watch_cq = grpc_completion_queue_create_for_next(nullptr);
+    m_running = true;
+    for(auto& p : *m_map) {
+        for(auto& e : p.second->channels) watch(e, e->state);
+    }
+    m_watcher = std::thread([this](){ watcher_main(); });
+}
+
+void channel_registry::stop() {
+    std::unique_lock<std::mutex> lck(m_write_mtx);
+    if(!m_running) return;
+    m_running = false;
+    // Pending watches expire on their own, the shutdown event is delivered after them
+    grpc_completion_queue_shutdown(m_watch_cq);
+    lck.unlock();
+    m_watcher.join();
+    grpc_completion_queue_destroy(m_watch_cq);
+    m_watch_cq = nullptr;
+}
+
+void channel_registry::clear() {
+    std::unique_lock<std::mutex> lck(m_write_mtx);
+    for(auto& p : *m_map) {
+        for(auto& e : p.second->channels) e->retired = true;
+    }
+    publish(std::make_shared<const map_t>());
+    lck.unlock();
+    // Do not keep channels alive through this threads snapshot
+    if(t_snapshot.owner == this) t_snapshot = {};
+}
@@ -0,0 +1,143 @@
+#include <compression.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <grpc/support/log.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <strings.h>
+
+namespace {
+    // zlib window bits, gzip adds 16 to select the gzip wrapper. grpc's deflate is the zlib format.
+    int window_bits(message_encoding enc) noexcept {
+        return enc == message_encoding::gzip ? 15 + 16 : 15;
+    }
+
+    // Output is collected in slices of this size
+    constexpr size_t inflate_chunk = 16 * 1024;
+}
+
+bool parse_message_encoding(const char* value, size_t len, message_encoding& out) noexcept {
+    // Optional whitespace around the name
+    while(len && (*value == ' ' || *value == '\t')) { value++; len--; }
+    while(len && (value[len - 1] == ' ' || value[len - 1] == '\t')) len--;
+    if(len == 8 && strncasecmp(value, "identity", 8) == 0) out = message_encoding::identity;
+    else if(len == 4 && strncasecmp(value, "gzip", 4) == 0) out = message_encoding::gzip;
+    else if(len == 7 && strncasecmp(value, "deflate", 7) == 0) out = message_encoding::deflate;
+    else return false;
+    return true;
+}
+
+const char* message_encoding_name(message_encoding enc) noexcept {
+    switch(enc) {
+    case message_encoding::gzip: return "gzip";
+    case message_encoding::deflate: return "deflate";
+    default: return "identity";
+    }
+}
+
+bool accepts_message_encoding(const char* list, size_t len, message_encoding enc) noexcept {
+    auto end = list + len;
+    while(list < end) {
+        auto comma = std::find(list, end, ',');
+        message_encoding e;
+        if(parse_message_encoding(list, comma - list, e) && e == enc) return true;
+        list = comma == end ? end : comma + 1;
+    }
+    return false;
+}
+
+byte_buffer_ptr decompress_message(message_encoding enc, grpc_byte_buffer* msg, size_t max_size) {
+    if(enc == message_encoding::identity) return nullptr;
+
+    z_stream zs = {};
+    if(inflateInit2(&zs, window_bits(enc)) != Z_OK) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "inflateInit2 failed");
+        return nullptr;
+    }
+    grpc_byte_buffer_reader reader;
+    if(!grpc_byte_buffer_reader_init(&reader, msg)) {
+        inflateEnd(&zs);
+        return nullptr;
+    }
+
+    std::vector<grpc_slice> out;
+    size_t total = 0;
+    bool ok = true;
+    bool done = false;
+    auto next_out = [&]() {
+        // Every chunk has one byte more than allowed, filling it means the limit was exceeded
+        auto size = std::min(inflate_chunk, max_size + 1 - total);
+        out.push_back(grpc_slice_malloc(size));
+        zs.next_out = GRPC_SLICE_START_PTR(out.back());
+        zs.avail_out = static_cast<uInt>(size);
+    };
+    auto finish_out = [&]() {
+        auto& s = out.back();
+        auto used = GRPC_SLICE_LENGTH(s) - zs.avail_out;
+        total += used;
+        s = grpc_slice_sub_no_ref(s, 0, used);
+    };
+    next_out();
+    grpc_slice in;
+    while(ok && !done && grpc_byte_buffer_reader_next(&reader, &in)) {
+        zs.next_in = GRPC_SLICE_START_PTR(in);
+        zs.avail_in = static_cast<uInt>(GRPC_SLICE_LENGTH(in));
+        while(zs.avail_in != 0 || zs.avail_out == 0) {
+            if(zs.avail_out == 0) {
+                finish_out();
+                if(total > max_size) { ok = false; break; }
+                next_out();
+            }
+            auto res = inflate(&zs, Z_NO_FLUSH);
+            if(res == Z_STREAM_END) { done = true; break; }
+            // No progress possible without more input
+            if(res == Z_BUF_ERROR && zs.avail_in == 0) break;
+            if(res != Z_OK) { ok = false; break; }
+        }
+        grpc_slice_unref(in);
+    }
+    finish_out();
+    grpc_byte_buffer_reader_destroy(&reader);
+    inflateEnd(&zs);
+
+    byte_buffer_ptr res;
+    if(ok && done && total <= max_size) res.reset(grpc_raw_byte_buffer_create(out.data(), out.size()));
+    for(auto& s : out) grpc_slice_unref(s);
+    return res;
+}
+
+bool compress_message(message_encoding enc, grpc_byte_buffer* msg, std::string& out) {
+    if(enc == message_encoding::identity) return false;
+
+    z_stream zs = {};
+    if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits(enc), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "deflateInit2 failed");
+        return false;
+    }
+    grpc_byte_buffer_reader reader;
+    if(!grpc_byte_buffer_reader_init(&reader, msg)) {
+        deflateEnd(&zs);
+        return false;
+    }
+    out.resize(deflateBound(&zs, grpc_byte_buffer_length(msg)));
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+
+    bool ok = true;
+    grpc_slice in;
+    while(ok && grpc_byte_buffer_reader_next(&reader, &in)) {
+        zs.next_in = GRPC_SLICE_START_PTR(in);
+        zs.avail_in = static_cast<uInt>(GRPC_SLICE_LENGTH(in));
+        ok = deflate(&zs, Z_NO_FLUSH) == Z_OK && zs.avail_in == 0;
+        grpc_slice_unref(in);
+    }
+    // deflateBound guarantees the output fits, so a single finish call completes the stream
+    ok = ok && deflate(&zs, Z_FINISH) == Z_STREAM_END;
+    out.resize(ok ? zs.total_out : 0);
+    grpc_byte_buffer_reader_destroy(&reader);
+    deflateEnd(&zs);
+    return ok;
+}
@@ -0,0 +1,122 @@
+#include <grpc_buckets.h>
+#include <base64.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <cstring>
+
+namespace {
+    struct slice_bucket_data {
+        apr_bucket_refcount refcount;
+        grpc_slice slice;
+    };
+
+    apr_status_t slice_bucket_read(apr_bucket* b, const char** str, apr_size_t* len, apr_read_type_e block) {
+        auto d = static_cast<slice_bucket_data*>(b->data);
+        *str = reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(d->slice)) + b->start;
+        *len = b->length;
+        return APR_SUCCESS;
+    }
+
+    void slice_bucket_destroy(void* data) {
+        auto d = static_cast<slice_bucket_data*>(data);
+        if(apr_bucket_shared_destroy(d)) {
+            grpc_slice_unref(d->slice);
+            apr_bucket_free(d);
+        }
+    }
+
+    const apr_bucket_type_t slice_bucket_type = {
+        "GRPC_SLICE", 5, apr_bucket_type_t::APR_BUCKET_DATA,
+        slice_bucket_destroy,
+        slice_bucket_read,
+        // Slices are refcounted heap memory, they do not depend on any pool
+        apr_bucket_setaside_noop,
+        apr_bucket_shared_split,
+        apr_bucket_shared_copy
+    };
+
+    void make_header(uint8_t (&hdr)[5], uint8_t flags, size_t len) {
+        hdr[0] = flags;
+        hdr[1] = (len >> 24) & 0xff;
+        hdr[2] = (len >> 16) & 0xff;
+        hdr[3] = (len >> 8) & 0xff;
+        hdr[4] = (len >> 0) & 0xff;
+    }
+}
+
+apr_bucket* grpc_slice_bucket_create(grpc_slice slice, apr_bucket_alloc_t* list) {
+    auto d = static_cast<slice_bucket_data*>(apr_bucket_alloc(sizeof(slice_bucket_data), list));
+    d->slice = slice;
+    auto b = static_cast<apr_bucket*>(apr_bucket_alloc(sizeof(apr_bucket), list));
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+    b = apr_bucket_shared_make(b, d, 0, GRPC_SLICE_LENGTH(slice));
+    b->type = &slice_bucket_type;
+    return b;
+}
+
+void append_frame(apr_bucket_brigade* bb, uint8_t flags, grpc_byte_buffer* msg) {
+    uint8_t hdr[5];
+    make_header(hdr, flags, grpc_byte_buffer_length(msg));
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(reinterpret_cast<const char*>(hdr), sizeof(hdr), nullptr, bb->bucket_alloc));
+
+    grpc_byte_buffer_reader reader;
+    if(!grpc_byte_buffer_reader_init(&reader, msg)) return;
+    grpc_slice slice;
+    while(grpc_byte_buffer_reader_next(&reader, &slice)) {
+        if(GRPC_SLICE_IS_EMPTY(slice)) {
+            grpc_slice_unref(slice);
+            continue;
+        }
+        APR_BRIGADE_INSERT_TAIL(bb, grpc_slice_bucket_create(slice, bb->bucket_alloc));
+    }
+    grpc_byte_buffer_reader_destroy(&reader);
+}
+
+void append_frame(apr_bucket_brigade* bb, uint8_t flags, const void* data, size_t len) {
+    // Header and message share a single bucket allocated buffer
+    uint8_t hdr[5];
+    make_header(hdr, flags, len);
+    auto buf = static_cast<char*>(apr_bucket_alloc(sizeof(hdr) + len, bb->bucket_alloc));
+    memcpy(buf, hdr, sizeof(hdr));
+    if(len > 0) memcpy(buf + sizeof(hdr), data, len);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(buf, sizeof(hdr) + len, apr_bucket_free, bb->bucket_alloc));
+}
+
+void append_frame_base64(apr_bucket_brigade* bb, uint8_t flags, grpc_byte_buffer* msg) {
+    auto len = grpc_byte_buffer_length(msg);
+    uint8_t hdr[5];
+    make_header(hdr, flags, len);
+
+    auto size = base64_encode_stream::max_encoded_size(sizeof(hdr) + len);
+    auto buf = static_cast<char*>(apr_bucket_alloc(size, bb->bucket_alloc));
+    base64_encode_stream stream;
+    auto pos = stream.feed(buf, hdr, sizeof(hdr));
+
+    grpc_byte_buffer_reader reader;
+    if(grpc_byte_buffer_reader_init(&reader, msg)) {
+        grpc_slice slice;
+        while(grpc_byte_buffer_reader_next(&reader, &slice)) {
+            pos += stream.feed(buf + pos, GRPC_SLICE_START_PTR(slice), GRPC_SLICE_LENGTH(slice));
+            grpc_slice_unref(slice);
+        }
+        grpc_byte_buffer_reader_destroy(&reader);
+    }
+    pos += stream.flush(buf + pos);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(buf, pos, apr_bucket_free, bb->bucket_alloc));
+}
+
+void append_frame_base64(apr_bucket_brigade* bb, uint8_t flags, const void* data, size_t len) {
+    uint8_t hdr[5];
+    make_header(hdr, flags, len);
+
+    auto size = base64_encode_stream::max_encoded_size(sizeof(hdr) + len);
+    auto buf = static_cast<char*>(apr_bucket_alloc(size, bb->bucket_alloc));
+    base64_encode_stream stream;
+    auto pos = stream.feed(buf, hdr, sizeof(hdr));
+    pos += stream.feed(buf + pos, data, len);
+    pos += stream.flush(buf + pos);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(buf, pos, apr_bucket_free, bb->bucket_alloc));
+}
@@ -0,0 +1,83 @@
+#include <grpc_engine.h>
+#include <grpc/grpc.h>
+#include <grpc/support/log.h>
+#include <grpc/support/time.h>
+#include <algorithm>
+#include <chrono>
+
+void grpc_engine::mailbox::push(uintptr_t tag, bool success) {
+    // Notify under the lock, the owner may destroy the mailbox as soon as it saw the last event
+    std::unique_lock<std::mutex> lck(m_mtx);
+    m_events.push_back({tag, success});
+    m_cv.notify_one();
+}
+
+void* grpc_engine::mailbox::tag(uintptr_t tag) noexcept {
+    for(size_t i = 0; i < m_num_slots; i++) {
+        if(m_slots[i].tag == tag) return &m_slots[i];
+    }
+    if(m_num_slots == max_tags) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Too many distinct tags on engine call");
+        return nullptr;
+    }
+    auto& s = m_slots[m_num_slots++];
+    s.box = this;
+    s.tag = tag;
+    return &s;
+}
+
+grpc_event grpc_engine::mailbox::next(const gpr_timespec& deadline) {
+    grpc_event res = {};
+    std::unique_lock<std::mutex> lck(m_mtx);
+    if(gpr_time_cmp(deadline, gpr_inf_future(deadline.clock_type)) == 0) {
+        m_cv.wait(lck, [this](){ return !m_events.empty(); });
+    } else {
+        auto remaining = gpr_time_sub(gpr_convert_clock_type(deadline, GPR_CLOCK_MONOTONIC), gpr_now(GPR_CLOCK_MONOTONIC));
+        auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max<int64_t>(gpr_time_to_millis(remaining), 0));
+        if(!m_cv.wait_until(lck, until, [this](){ return !m_events.empty(); })) {
+            res.type = GRPC_QUEUE_TIMEOUT;
+            return res;
+        }
+    }
+    auto e = m_events.front();
+    m_events.pop_front();
+    res.type = GRPC_OP_COMPLETE;
+    res.success = e.success ? 1 : 0;
+    res.tag = reinterpret_cast<void*>(e.tag);
+    return res;
+}
+
+grpc_engine::~grpc_engine() {
+    stop();
+}
+
+void grpc_engine::start(size_t num_threads) {
+    if(m_cq || num_threads == 0) return;
+    m_cq = grpc_completion_queue_create_for_next(nullptr);
+    if(!m_cq) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to create engine cq");
+        return;
+    }
+    for(size_t i = 0; i < num_threads; i++)
+        m_threads.emplace_back([this](){ thread_main(); });
+}
+
+void grpc_engine::stop() {
+    if(!m_cq) return;
+    // Threads exit once the queue is shut down and drained
+    grpc_completion_queue_shutdown(m_cq);
+    for(auto& t : m_threads) t.join();
+    m_threads.clear();
+    grpc_completion_queue_destroy(m_cq);
+    m_cq = nullptr;
+}
+
+void grpc_engine::thread_main() {
+    while(true) {
+        auto e = grpc_completion_queue_next(m_cq, gpr_inf_future(GPR_CLOCK_REALTIME), nullptr);
+        if(e.type == GRPC_QUEUE_SHUTDOWN) break;
+        if(e.type != GRPC_OP_COMPLETE || !e.tag) continue;
+        auto s = static_cast<mailbox::slot*>(e.tag);
+        s->box->push(s->tag, e.success != 0);
+    }
+}
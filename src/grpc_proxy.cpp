@@ -1,76 +1,155 @@
 #include <grpc_proxy.h>
+#include <channel_registry.h>
 #include <grpc/grpc.h>
+#include <grpc/compression.h>
 #include <grpc/support/log.h>
 #include <grpc/support/alloc.h>
-#include <grpc/byte_buffer_reader.h>
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <vector>
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
 
+// Monotonic, so wall clock changes neither extend nor cut calls short
 static gpr_timespec get_deadline(uint64_t timeout) {
-    if(timeout == 0) return gpr_inf_future(GPR_CLOCK_REALTIME);
-    auto now = gpr_now(GPR_CLOCK_REALTIME);
-    auto off = gpr_time_from_millis(timeout, GPR_CLOCK_REALTIME);
+    if(timeout == 0) return gpr_inf_future(GPR_CLOCK_MONOTONIC);
+    auto now = gpr_now(GPR_CLOCK_MONOTONIC);
+    auto off = gpr_time_from_millis(timeout, GPR_TIMESPAN);
     return gpr_time_add(now, off);
 }
 
-static std::mutex g_channel_cache_mtx;
-static std::unordered_map<std::string, std::shared_ptr<grpc_channel>> g_channel_cache;
+/**
+ * How long to wait for the completion of a call with deadline. grpc itself fails the call
+ * with DEADLINE_EXCEEDED, this only guards against the event never showing up.
+ */
+static gpr_timespec get_wait_deadline(const gpr_timespec& deadline) {
+    return gpr_time_add(deadline, gpr_time_from_millis(1000, GPR_TIMESPAN));
+}
 
-std::shared_ptr<grpc_channel> get_working_channel(const std::string& host) {
-    std::unique_lock<std::mutex> lck(g_channel_cache_mtx);
-    auto it = g_channel_cache.find(host);
-    if(it != g_channel_cache.end()) {
-        auto state = grpc_channel_check_connectivity_state(it->second.get(), true);
-        if(state != GRPC_CHANNEL_SHUTDOWN && state != GRPC_CHANNEL_TRANSIENT_FAILURE) return it->second;
-        g_channel_cache.erase(it);
-    }
-    grpc_channel_args args;
-    args.num_args = 0;
-    std::shared_ptr<grpc_channel> channel(grpc_insecure_channel_create(host.c_str(), &args, NULL),
-                                            [](grpc_channel* ch){ if(ch) grpc_channel_destroy(ch); });
-    if(channel.get() != nullptr) g_channel_cache.insert({host, channel});
-    return channel;
+static channel_registry g_channels;
+static grpc_engine g_engine;
+
+channel_registry::lease get_working_channel(const std::string& host, size_t pool_size, bool* cached = nullptr, const channel_args* args = nullptr) {
+    return g_channels.get(host, pool_size, cached, args);
+}
+
+static std::atomic<bool> g_grpc_running{false};
+static std::atomic<uint64_t> g_cq_cache_hits{0};
+static std::atomic<uint64_t> g_cq_cache_misses{0};
+
+static void destroy_cq(grpc_completion_queue* cq) {
+    grpc_completion_queue_shutdown(cq);
+    while(grpc_completion_queue_next(cq, gpr_inf_future(GPR_CLOCK_REALTIME), nullptr).type != GRPC_QUEUE_SHUTDOWN);
+    grpc_completion_queue_destroy(cq);
 }
 
+/**
+ * Drained completion queues kept for reuse by the next call on the same thread.
+ * Queues are only returned once every batch started on them has completed.
+ */
+struct cq_cache {
+    static constexpr size_t max_size = 4;
+    std::vector<grpc_completion_queue*> queues;
+
+    grpc_completion_queue* acquire() {
+        if(!queues.empty()) {
+            auto cq = queues.back();
+            queues.pop_back();
+            g_cq_cache_hits++;
+            return cq;
+        }
+        g_cq_cache_misses++;
+        grpc_completion_queue_attributes att;
+        att.version = GRPC_CQ_CURRENT_VERSION;
+        att.cq_completion_type = GRPC_CQ_NEXT;
+        att.cq_polling_type = GRPC_CQ_DEFAULT_POLLING;
+        auto factory = grpc_completion_queue_factory_lookup(&att);
+        if(!factory) {
+            gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to get cq factory");
+            return nullptr;
+        }
+        return grpc_completion_queue_create(factory, &att, NULL);
+    }
+
+    void release(grpc_completion_queue* cq) {
+        if(queues.size() < max_size && g_grpc_running) queues.push_back(cq);
+        else destroy_cq(cq);
+    }
+
+    void clear() {
+        for(auto cq : queues) destroy_cq(cq);
+        queues.clear();
+    }
+
+    ~cq_cache() {
+        // Threads outliving grpc_shutdown leak their queues instead of touching a dead library
+        if(g_grpc_running) clear();
+    }
+};
+static thread_local cq_cache t_cq_cache;
+
 grpc_proxy::grpc_proxy()
-    : m_channel(nullptr), m_cq(nullptr), m_call(nullptr), m_call_timeout(0)
+    : m_cq(nullptr), m_channel(), m_call(nullptr), m_call_timeout(0), m_deadline(gpr_inf_future(GPR_CLOCK_MONOTONIC)), m_channels_per_backend(1)
 {}
 
 grpc_proxy::~grpc_proxy() {
+    bool reusable = true;
+    if(m_hedge && m_pending_ops != 0) cancel_attempts();
+    if((m_call || m_hedge) && m_pending_ops != 0) {
+        // A batch did not complete (timeout or failure), cancel the call and drain its events
+        if(m_call) grpc_call_cancel(m_call, nullptr);
+        auto deadline = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_millis(1000, GPR_TIMESPAN));
+        while(m_pending_ops != 0) {
+            auto e = wait_event(deadline);
+            if(e.type != GRPC_OP_COMPLETE) break;
+            m_pending_ops--;
+        }
+        reusable = m_pending_ops == 0;
+    }
     if(m_call) grpc_call_unref(m_call);
-    if(m_cq) grpc_completion_queue_destroy(m_cq);
+    // grpc might still write into the stream buffers or deliver to the mailbox if a batch never completed
+    if(!reusable) {
+        m_stream.release();
+        m_hedge.release();
+        m_mailbox.release();
+    }
+    m_stream.reset();
+    m_hedge.reset();
+    if(m_mailbox) m_mailbox.reset();
+    else if(m_cq) {
+        if(reusable) t_cq_cache.release(m_cq);
+        else destroy_cq(m_cq);
+    }
     m_channel.reset();
 }
 
 bool grpc_proxy::start(const char* host, const char* method)
 {
-    m_channel = get_working_channel(host);
+    // The client went away before the call even started
+    if(m_cancelled) return false;
+    m_channel = get_working_channel(host, m_channels_per_backend, &m_channel_cached, m_channel_args);
     if(!m_channel) {
         gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to create channel");
         return false;
     }
 
-    // Create cq
-    grpc_completion_queue_attributes att;
-    att.version = GRPC_CQ_CURRENT_VERSION;
-    att.cq_completion_type = GRPC_CQ_NEXT;
-    att.cq_polling_type = GRPC_CQ_DEFAULT_POLLING;
-    auto factory = grpc_completion_queue_factory_lookup(&att);
-    if(!factory) {
-        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to get cq factory");
-        return false;
+    if(g_engine.running()) {
+        m_mailbox.reset(new grpc_engine::mailbox());
+        m_cq = g_engine.cq();
+    } else {
+        m_cq = t_cq_cache.acquire();
     }
-    m_cq = grpc_completion_queue_create(factory, &att, NULL);
     if(!m_cq) {
         gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to create cq");
         return false;
     }
 
+    m_deadline = get_deadline(m_call_timeout);
     auto host_slice = grpc_slice_from_copied_string(host);
     auto method_slice = grpc_slice_from_copied_string(method);
-    m_call = grpc_channel_create_call(m_channel.get(), NULL, 0, m_cq, method_slice, &host_slice, get_deadline(m_call_timeout), NULL);
+    m_call = grpc_channel_create_call(m_channel.get(), NULL, 0, m_cq, method_slice, &host_slice, m_deadline, NULL);
     grpc_slice_unref(host_slice);
     grpc_slice_unref(method_slice);
     if(!m_call) {
@@ -78,127 +157,673 @@ bool grpc_proxy::start(const char* host, const char* method)
         return false;
     }
 
+    m_load.begin(host);
+    m_host = host;
+    m_method = method;
     return true;
 }
 
-static auto queue_pluck(grpc_completion_queue* cq, void* tag, gpr_timespec deadline, void *reserved) {
-    auto res = grpc_completion_queue_next(cq, deadline, reserved);
-    while(res.type == GRPC_OP_COMPLETE && res.success) {
-        if(res.tag == tag) break;
-        res = grpc_completion_queue_next(cq, deadline, reserved);
+void* grpc_proxy::batch_tag(uintptr_t tag) {
+    return m_mailbox ? m_mailbox->tag(tag) : reinterpret_cast<void*>(tag);
+}
+
+grpc_event grpc_proxy::wait_event(const gpr_timespec& deadline) {
+    auto start = std::chrono::steady_clock::now();
+    grpc_event e;
+    while(true) {
+        // Wake up in between to see if the client is still there
+        auto until = deadline;
+        bool check = false;
+        if(m_abort_check && !m_cancelled) {
+            auto next_check = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_millis(abort_check_interval_ms, GPR_TIMESPAN));
+            if(gpr_time_cmp(next_check, gpr_convert_clock_type(deadline, GPR_CLOCK_MONOTONIC)) < 0) {
+                until = next_check;
+                check = true;
+            }
+        }
+        e = m_mailbox ? m_mailbox->next(until) : grpc_completion_queue_next(m_cq, until, nullptr);
+        if(e.type != GRPC_QUEUE_TIMEOUT || !check) break;
+        if(m_abort_check()) cancel();
     }
-    return res;
+    m_wait_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    return e;
+}
+
+void grpc_proxy::cancel() noexcept {
+    if(m_cancelled) return;
+    m_cancelled = true;
+    if(m_call) grpc_call_cancel(m_call, nullptr);
+    if(m_hedge) cancel_attempts();
 }
 
-grpc_event grpc_proxy::run_ops(grpc_call* call, grpc_completion_queue* cq, grpc_op* ops, int mops) {
-    if(grpc_call_start_batch(call, ops, mops, (void*)0xdeadbeef, NULL) != GRPC_CALL_OK) {
+grpc_event grpc_proxy::run_ops(grpc_call* call, grpc_op* ops, int mops) {
+    const auto tag = reinterpret_cast<void*>(0xdeadbeef);
+    auto batch = batch_tag(0xdeadbeef);
+    if(!batch || grpc_call_start_batch(call, ops, mops, batch, NULL) != GRPC_CALL_OK) {
         gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to start call op");
         grpc_event e = {};
         e.success = false;
         return e;
     }
-    auto e = queue_pluck(cq, (void*)0xdeadbeef, get_deadline(m_call_timeout), nullptr);
+    m_pending_ops++;
+    auto deadline = get_wait_deadline(m_deadline);
+    auto e = wait_event(deadline);
+    // Skip completions of other batches whatever their result, returning early would leave this one running on the callers ops
+    while(e.type == GRPC_OP_COMPLETE && e.tag != tag) {
+        m_pending_ops--;
+        e = wait_event(deadline);
+    }
+    if(e.type == GRPC_OP_COMPLETE) m_pending_ops--;
     if(e.type != GRPC_OP_COMPLETE) {
         gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to pluck call op");
+        // The ops point into the callers stack, grpc has to be done with them before we return
+        grpc_call_cancel(call, nullptr);
+        auto drain = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_millis(1000, GPR_TIMESPAN));
+        for(auto d = wait_event(drain); d.type == GRPC_OP_COMPLETE; d = wait_event(drain)) {
+            m_pending_ops--;
+            if(d.tag == tag) break;
+        }
     }
     return e;
 }
 
-static void parse_metadata(grpc_metadata_array& array, std::unordered_multimap<std::string, std::string>& out) {
+/**
+ * Keys seen on most calls. Received keys matching one of these reference the static string
+ * instead of being copied, so only the value is allocated.
+ */
+static const grpc_slice* common_keys(size_t& count) {
+    static const grpc_slice keys[] = {
+        grpc_slice_from_static_string("grpc-status"),
+        grpc_slice_from_static_string("grpc-message"),
+        grpc_slice_from_static_string("content-type"),
+        grpc_slice_from_static_string("grpc-encoding"),
+        grpc_slice_from_static_string("grpc-accept-encoding"),
+        grpc_slice_from_static_string("grpc-status-details-bin"),
+    };
+    count = sizeof(keys) / sizeof(keys[0]);
+    return keys;
+}
+
+static void parse_metadata(grpc_metadata_array& array, header_list& out) {
+    size_t nkeys;
+    auto keys = common_keys(nkeys);
     for(size_t i=0; i<array.count; i++) {
         auto e = &array.metadata[i];
-        std::string key(
-            reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(e->key)),
-            GRPC_SLICE_LENGTH(e->key));
-        std::string value(
-            reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(e->value)),
-            GRPC_SLICE_LENGTH(e->value));
-        out.emplace(std::move(key), std::move(value));
+        auto value = reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(e->value));
+        auto value_len = GRPC_SLICE_LENGTH(e->value);
+        auto key = std::find_if(keys, keys + nkeys, [e](const grpc_slice& k) { return grpc_slice_eq(k, e->key); });
+        if(key != keys + nkeys) {
+            auto copy = static_cast<char*>(out.allocate(value_len + 1));
+            memcpy(copy, value, value_len);
+            copy[value_len] = '\0';
+            out.add_ref(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(*key)), GRPC_SLICE_LENGTH(*key), copy, value_len);
+        } else {
+            out.add_copy(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(e->key)), GRPC_SLICE_LENGTH(e->key), value, value_len);
+        }
     }
 }
 
-bool grpc_proxy::send_initial_metadata(const std::unordered_multimap<std::string, std::string>& headers) {
-    std::vector<grpc_metadata> meta;
+static void build_metadata(const header_list& headers, std::vector<grpc_metadata>& meta) {
+    meta.reserve(headers.size());
     for(auto& e : headers) {
         // grpc set headers are ignored
-        if(e.first == "te") continue;
-        if(e.first == "content-type") continue;
-        if(e.first == "user-agent") continue;
-        if(e.first == "grpc-accept-encoding") continue;
-        if(e.first == "grpc-encoding") continue;
-        if(e.first == "accept-encoding") continue;
-        if(e.first == "content-length") continue;
-        if(e.first == "connection") continue;
+        if(is_reserved_header(e.key, e.key_len)) continue;
         grpc_metadata m = {};
-        m.key = grpc_slice_from_static_string(e.first.c_str());
-        m.value = grpc_slice_from_static_string(e.second.c_str());
+        m.key = grpc_slice_from_static_buffer(e.key, e.key_len);
+        m.value = grpc_slice_from_static_buffer(e.value, e.value_len);
         m.flags = 0;
         meta.push_back(m);
     }
-    grpc_op op = {};
-    op.op = GRPC_OP_SEND_INITIAL_METADATA;
-    op.data.send_initial_metadata.count = meta.size();
-    op.data.send_initial_metadata.metadata = meta.data();
-    auto e = run_ops(m_call, m_cq, &op, 1);
+}
+
+static void free_metadata(std::vector<grpc_metadata>& meta) {
     for(auto& e : meta) {
         grpc_slice_unref(e.key);
         grpc_slice_unref(e.value);
     }
-    return e.success;
+    meta.clear();
 }
 
-bool grpc_proxy::send_request(const void* data, size_t len) {
+static void parse_status(grpc_proxy::status& s, grpc_status_code code, const char* str, grpc_slice status_details, grpc_metadata_array& array) {
+    s.status = static_cast<int>(code);
+    if(str) {
+        s.error = std::string(str);
+        gpr_free(const_cast<char*>(str));
+    }
+    if(!GRPC_SLICE_IS_EMPTY(status_details)) {
+        s.details.clear();
+        s.details.append(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(status_details)), GRPC_SLICE_LENGTH(status_details));
+    }
+    grpc_slice_unref(status_details);
+    parse_metadata(array, s.metadata);
+}
+
+bool grpc_proxy::unary_call(const header_list& headers, const void* data, size_t len,
+                            header_list& headers_out,
+                            message_callback cb, status& s) {
+    auto slice = grpc_slice_from_static_buffer(data, len);
+    auto request = grpc_raw_byte_buffer_create(&slice, 1);
+    grpc_slice_unref(slice);
+    auto res = unary_call(headers, request, headers_out, std::move(cb), s);
+    grpc_byte_buffer_destroy(request);
+    return res;
+}
+
+bool grpc_proxy::unary_call(const header_list& headers, grpc_byte_buffer* request,
+                            header_list& headers_out,
+                            message_callback cb, status& s) {
+    std::vector<grpc_metadata> meta;
+    build_metadata(headers, meta);
+
+    grpc_metadata_array initial_md = {};
+    grpc_metadata_array_init(&initial_md);
+    grpc_metadata_array trailing_md = {};
+    grpc_metadata_array_init(&trailing_md);
+    grpc_byte_buffer* response = nullptr;
+    const char* str = nullptr;
+    grpc_status_code code = {};
+    grpc_slice status_details = {};
+
+    grpc_op ops[6] = {};
+    ops[0].op = GRPC_OP_SEND_INITIAL_METADATA;
+    ops[0].data.send_initial_metadata.count = meta.size();
+    ops[0].data.send_initial_metadata.metadata = meta.data();
+    ops[1].op = GRPC_OP_SEND_MESSAGE;
+    ops[1].data.send_message.send_message = request;
+    ops[2].op = GRPC_OP_SEND_CLOSE_FROM_CLIENT;
+    ops[3].op = GRPC_OP_RECV_INITIAL_METADATA;
+    ops[3].data.recv_initial_metadata.recv_initial_metadata = &initial_md;
+    ops[4].op = GRPC_OP_RECV_MESSAGE;
+    ops[4].data.recv_message.recv_message = &response;
+    ops[5].op = GRPC_OP_RECV_STATUS_ON_CLIENT;
+    ops[5].data.recv_status_on_client.trailing_metadata = &trailing_md;
+    ops[5].data.recv_status_on_client.status = &code;
+    ops[5].data.recv_status_on_client.error_string = &str;
+    ops[5].data.recv_status_on_client.status_details = &status_details;
+    auto e = run_ops(m_call, ops, 6);
+    if(e.type == GRPC_OP_COMPLETE && e.success) m_load.responded();
+
+    free_metadata(meta);
+    parse_metadata(initial_md, headers_out);
+    grpc_metadata_array_destroy(&initial_md);
+    if(response) {
+        if(cb) cb(response);
+        grpc_byte_buffer_destroy(response);
+    }
+    parse_status(s, code, str, status_details, trailing_md);
+    grpc_metadata_array_destroy(&trailing_md);
+    return e.success && e.type == GRPC_OP_COMPLETE;
+}
+
+/** ========= Hedged and retried unary calls ========== **/
+
+enum attempt_tag : uintptr_t {
+    // Attempt i completes with tag_attempt + i, far away from the stream tags
+    tag_attempt = 0x100
+};
+
+// Delay before the retry following the n-th failed attempt, jittered so failed calls do not come back in lockstep
+static uint64_t retry_backoff_ms(const grpc_proxy::retry_policy& policy, size_t failures) {
+    thread_local std::minstd_rand rng{std::random_device{}()};
+    auto backoff = std::min(policy.backoff_ms << std::min<size_t>(failures - 1, 16), policy.max_backoff_ms);
+    return backoff / 2 + rng() % (backoff / 2 + 1);
+}
+
+struct grpc_proxy::attempt {
+    // Empty for the first attempt, which runs on the call (and channel) of start()
+    channel_registry::lease channel;
+    grpc_call* call = nullptr;
+    backend_load::tracker load;
+    grpc_op ops[6] = {};
+    grpc_metadata_array initial_md = {};
+    grpc_metadata_array trailing_md = {};
+    grpc_byte_buffer* response = nullptr;
+    const char* error = nullptr;
+    grpc_status_code code = GRPC_STATUS_UNKNOWN;
+    grpc_slice details = grpc_empty_slice();
+    bool pending = false;
+    bool success = false;
+
+    attempt() {
+        grpc_metadata_array_init(&initial_md);
+        grpc_metadata_array_init(&trailing_md);
+    }
+    ~attempt() {
+        grpc_metadata_array_destroy(&initial_md);
+        grpc_metadata_array_destroy(&trailing_md);
+        if(response) grpc_byte_buffer_destroy(response);
+        if(error) gpr_free(const_cast<char*>(error));
+        grpc_slice_unref(details);
+        if(call) grpc_call_unref(call);
+    }
+    // UNAVAILABLE means the request did not reach the application, so it is safe to send again
+    bool failed() const noexcept { return !success || code == GRPC_STATUS_UNAVAILABLE; }
+};
+
+struct grpc_proxy::hedge_state {
+    std::vector<grpc_metadata> meta;
+    std::vector<std::unique_ptr<attempt>> attempts;
+    size_t running = 0;
+
+    ~hedge_state() {
+        free_metadata(meta);
+    }
+};
+
+void grpc_proxy::cancel_attempts() noexcept {
+    for(auto& a : m_hedge->attempts) {
+        if(a->pending) grpc_call_cancel(a->call, nullptr);
+    }
+}
+
+bool grpc_proxy::start_attempt(attempt& a, grpc_byte_buffer* request, uintptr_t tag) {
+    auto& meta = m_hedge->meta;
+    a.ops[0].op = GRPC_OP_SEND_INITIAL_METADATA;
+    a.ops[0].data.send_initial_metadata.count = meta.size();
+    a.ops[0].data.send_initial_metadata.metadata = meta.data();
+    a.ops[1].op = GRPC_OP_SEND_MESSAGE;
+    a.ops[1].data.send_message.send_message = request;
+    a.ops[2].op = GRPC_OP_SEND_CLOSE_FROM_CLIENT;
+    a.ops[3].op = GRPC_OP_RECV_INITIAL_METADATA;
+    a.ops[3].data.recv_initial_metadata.recv_initial_metadata = &a.initial_md;
+    a.ops[4].op = GRPC_OP_RECV_MESSAGE;
+    a.ops[4].data.recv_message.recv_message = &a.response;
+    a.ops[5].op = GRPC_OP_RECV_STATUS_ON_CLIENT;
+    a.ops[5].data.recv_status_on_client.trailing_metadata = &a.trailing_md;
+    a.ops[5].data.recv_status_on_client.status = &a.code;
+    a.ops[5].data.recv_status_on_client.error_string = &a.error;
+    a.ops[5].data.recv_status_on_client.status_details = &a.details;
+    auto batch = batch_tag(tag);
+    if(!batch || grpc_call_start_batch(a.call, a.ops, 6, batch, NULL) != GRPC_CALL_OK) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to start call op");
+        return false;
+    }
+    a.pending = true;
+    m_hedge->running++;
+    m_pending_ops++;
+    return true;
+}
+
+bool grpc_proxy::unary_call(const header_list& headers, grpc_byte_buffer* request,
+                            header_list& headers_out,
+                            message_callback cb, status& s, const retry_policy& policy) {
+    if(policy.max_attempts <= 1 || m_hedge) return unary_call(headers, request, headers_out, std::move(cb), s);
+    m_hedge.reset(new hedge_state());
+    auto& h = *m_hedge;
+    build_metadata(headers, h.meta);
+    auto budget = backend_load::lookup(m_host.c_str());
+
+    // The first attempt takes over the call of start()
+    h.attempts.emplace_back(new attempt());
+    h.attempts[0]->call = m_call;
+    m_call = nullptr;
+    if(!start_attempt(*h.attempts[0], request, tag_attempt)) return false;
+
+    // Further attempts pick the least busy channel of a pool of at least two, so they do not queue behind the first one
+    auto start_next = [&]() {
+        if(m_cancelled || h.attempts.size() >= policy.max_attempts || !backend_load::retry_allowed(budget, policy.budget_tokens)) return false;
+        std::unique_ptr<attempt> a(new attempt());
+        a->channel = get_working_channel(m_host, std::max<size_t>(m_channels_per_backend, 2), nullptr, m_channel_args);
+        if(!a->channel) return false;
+        auto host_slice = grpc_slice_from_copied_string(m_host.c_str());
+        auto method_slice = grpc_slice_from_copied_string(m_method.c_str());
+        a->call = grpc_channel_create_call(a->channel.get(), NULL, 0, m_cq, method_slice, &host_slice, m_deadline, NULL);
+        grpc_slice_unref(host_slice);
+        grpc_slice_unref(method_slice);
+        if(!a->call) return false;
+        a->load.begin(m_host.c_str());
+        h.attempts.push_back(std::move(a));
+        return start_attempt(*h.attempts.back(), request, tag_attempt + h.attempts.size() - 1);
+    };
+
+    const auto deadline = get_wait_deadline(m_deadline);
+    auto hedge_at = gpr_inf_future(GPR_CLOCK_MONOTONIC);
+    if(policy.hedge_delay_ms != 0)
+        hedge_at = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_millis(policy.hedge_delay_ms, GPR_TIMESPAN));
+    attempt* result = nullptr;
+    size_t failures = 0;
+    // hedge_at is also armed for the retry of a failed attempt, which may be due with nothing running
+    while(h.running != 0 || gpr_time_cmp(hedge_at, deadline) < 0) {
+        auto e = wait_event(gpr_time_cmp(hedge_at, deadline) < 0 ? hedge_at : deadline);
+        if(e.type == GRPC_QUEUE_TIMEOUT) {
+            auto now = gpr_now(GPR_CLOCK_MONOTONIC);
+            if(gpr_time_cmp(now, hedge_at) >= 0) {
+                // Nobody answered in time or the backoff is over, try (another) channel
+                if(start_next() && policy.hedge_delay_ms != 0)
+                    hedge_at = gpr_time_add(now, gpr_time_from_millis(policy.hedge_delay_ms, GPR_TIMESPAN));
+                else hedge_at = gpr_inf_future(GPR_CLOCK_MONOTONIC);
+                continue;
+            }
+            // The wait may end slightly early
+            if(gpr_time_cmp(now, deadline) < 0) continue;
+        }
+        if(e.type != GRPC_OP_COMPLETE) {
+            gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to pluck call op");
+            break;
+        }
+        auto idx = reinterpret_cast<uintptr_t>(e.tag) - tag_attempt;
+        if(idx >= h.attempts.size() || !h.attempts[idx]->pending) continue;
+        auto& a = *h.attempts[idx];
+        a.pending = false;
+        a.success = e.success;
+        h.running--;
+        m_pending_ops--;
+        backend_load::record_attempt(budget, a.failed(), policy.budget_tokens, policy.budget_ratio);
+        if(!a.failed()) {
+            if(idx == 0) m_load.responded();
+            else a.load.responded();
+            result = &a;
+            break;
+        }
+        // Failed attempts are reported if nothing better comes along
+        if(!result || !result->success) result = &a;
+        // Retry after a backoff rather than right away, unless a hedge is due earlier
+        if(h.attempts.size() < policy.max_attempts) {
+            auto retry_at = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC),
+                                         gpr_time_from_millis(retry_backoff_ms(policy, ++failures), GPR_TIMESPAN));
+            if(gpr_time_cmp(retry_at, hedge_at) < 0) hedge_at = retry_at;
+        }
+    }
+
+    // Cancel the losers and wait until grpc is done with their buffers
+    if(h.running != 0) {
+        cancel_attempts();
+        auto drain = gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_millis(1000, GPR_TIMESPAN));
+        while(h.running != 0) {
+            auto e = wait_event(drain);
+            if(e.type != GRPC_OP_COMPLETE) break;
+            auto idx = reinterpret_cast<uintptr_t>(e.tag) - tag_attempt;
+            if(idx >= h.attempts.size() || !h.attempts[idx]->pending) continue;
+            h.attempts[idx]->pending = false;
+            h.running--;
+            m_pending_ops--;
+        }
+    }
+    if(!result) return false;
+
+    parse_metadata(result->initial_md, headers_out);
+    if(result->response) {
+        if(cb) cb(result->response);
+        grpc_byte_buffer_destroy(result->response);
+        result->response = nullptr;
+    }
+    parse_status(s, result->code, result->error, result->details, result->trailing_md);
+    result->error = nullptr;
+    result->details = grpc_empty_slice();
+    return result->success;
+}
+
+/** ========= Streaming ========== **/
+
+enum stream_tag : uintptr_t {
+    tag_metadata = 1,
+    tag_read,
+    tag_write,
+    tag_close,
+    tag_status
+};
+
+// Every distinct tag of a call takes a mailbox slot: the stream tags, the one of run_ops and one per attempt
+static_assert(tag_status + 1 + grpc_proxy::retry_policy::attempts_limit <= grpc_engine::mailbox::max_tags,
+              "Engine mailbox has fewer slots than tags a call may use");
+
+struct grpc_proxy::stream_state {
+    header_list* headers_out = nullptr;
+    message_callback cb;
+    std::vector<grpc_metadata> meta;
+    grpc_metadata_array initial_md = {};
+    grpc_metadata_array trailing_md = {};
+    grpc_byte_buffer* read_buffer = nullptr;
+    grpc_byte_buffer* write_buffer = nullptr;
+    const char* error = nullptr;
+    grpc_status_code code = GRPC_STATUS_UNKNOWN;
+    grpc_slice details = grpc_empty_slice();
+
+    bool metadata_pending = false;
+    bool read_pending = false;
+    bool write_pending = false;
+    bool close_pending = false;
+    bool status_pending = false;
+    bool closed = false;
+    bool write_failed = false;
+
+    stream_state() {
+        grpc_metadata_array_init(&initial_md);
+        grpc_metadata_array_init(&trailing_md);
+    }
+    ~stream_state() {
+        free_metadata(meta);
+        grpc_metadata_array_destroy(&initial_md);
+        grpc_metadata_array_destroy(&trailing_md);
+        if(read_buffer) grpc_byte_buffer_destroy(read_buffer);
+        if(write_buffer) grpc_byte_buffer_destroy(write_buffer);
+        if(error) gpr_free(const_cast<char*>(error));
+        grpc_slice_unref(details);
+    }
+    bool busy() const noexcept {
+        return metadata_pending || read_pending || write_pending || close_pending || status_pending;
+    }
+};
+
+bool grpc_proxy::start_batch(grpc_op* ops, size_t nops, uintptr_t tag) {
+    auto batch = batch_tag(tag);
+    if(!batch || grpc_call_start_batch(m_call, ops, nops, batch, NULL) != GRPC_CALL_OK) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Failed to start call op");
+        return false;
+    }
+    m_pending_ops++;
+    return true;
+}
+
+bool grpc_proxy::start_read() {
+    grpc_op op = {};
+    op.op = GRPC_OP_RECV_MESSAGE;
+    op.data.recv_message.recv_message = &m_stream->read_buffer;
+    m_stream->read_pending = start_batch(&op, 1, tag_read);
+    return m_stream->read_pending;
+}
+
+bool grpc_proxy::start_stream(const header_list& headers,
+                              header_list& headers_out, message_callback cb) {
+    m_stream.reset(new stream_state());
+    m_stream->headers_out = &headers_out;
+    m_stream->cb = std::move(cb);
+    build_metadata(headers, m_stream->meta);
+
+    grpc_op ops[2] = {};
+    ops[0].op = GRPC_OP_SEND_INITIAL_METADATA;
+    ops[0].data.send_initial_metadata.count = m_stream->meta.size();
+    ops[0].data.send_initial_metadata.metadata = m_stream->meta.data();
+    ops[1].op = GRPC_OP_RECV_INITIAL_METADATA;
+    ops[1].data.recv_initial_metadata.recv_initial_metadata = &m_stream->initial_md;
+    m_stream->metadata_pending = start_batch(ops, 2, tag_metadata);
+    if(!m_stream->metadata_pending) return false;
+
+    grpc_op op = {};
+    op.op = GRPC_OP_RECV_STATUS_ON_CLIENT;
+    op.data.recv_status_on_client.trailing_metadata = &m_stream->trailing_md;
+    op.data.recv_status_on_client.status = &m_stream->code;
+    op.data.recv_status_on_client.error_string = &m_stream->error;
+    op.data.recv_status_on_client.status_details = &m_stream->details;
+    m_stream->status_pending = start_batch(&op, 1, tag_status);
+    return m_stream->status_pending;
+}
+
+grpc_proxy::event_result grpc_proxy::next_event(bool block) {
+    // Bounded like the unary calls, wait_event checks for the client in between
+    auto deadline = block ? get_wait_deadline(m_deadline) : gpr_time_0(GPR_CLOCK_MONOTONIC);
+    auto e = wait_event(deadline);
+    if(e.type == GRPC_QUEUE_TIMEOUT && !block) return event_result::timeout;
+    if(e.type != GRPC_OP_COMPLETE) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, e.type == GRPC_QUEUE_TIMEOUT ? "Timed out waiting for call op" : "Failed to wait for call op");
+        return event_result::failed;
+    }
+    m_pending_ops--;
+    auto& st = *m_stream;
+    switch(reinterpret_cast<uintptr_t>(e.tag)) {
+    case tag_metadata:
+        st.metadata_pending = false;
+        free_metadata(st.meta);
+        parse_metadata(st.initial_md, *st.headers_out);
+        // Messages are only read after the metadata, so headers_out is complete before the first callback
+        if(e.success) {
+            m_load.responded();
+            start_read();
+        }
+        break;
+    case tag_read: {
+        st.read_pending = false;
+        auto msg = st.read_buffer;
+        st.read_buffer = nullptr;
+        if(!e.success || !msg) break;
+        // Rearm before forwarding so the next message is received while the client is written to
+        start_read();
+        if(st.cb) st.cb(msg);
+        grpc_byte_buffer_destroy(msg);
+        break;
+    }
+    case tag_write:
+        st.write_pending = false;
+        grpc_byte_buffer_destroy(st.write_buffer);
+        st.write_buffer = nullptr;
+        if(!e.success) st.write_failed = true;
+        break;
+    case tag_close:
+        st.close_pending = false;
+        break;
+    case tag_status:
+        st.status_pending = false;
+        break;
+    default:
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Unexpected tag on stream cq");
+        return event_result::failed;
+    }
+    return event_result::handled;
+}
+
+bool grpc_proxy::write(grpc_byte_buffer* msg) {
+    auto& st = *m_stream;
+    while(st.write_pending) {
+        if(next_event(true) != event_result::handled) break;
+    }
+    if(st.write_pending || st.write_failed || st.closed || !st.status_pending) {
+        grpc_byte_buffer_destroy(msg);
+        return false;
+    }
     grpc_op op = {};
     op.op = GRPC_OP_SEND_MESSAGE;
+    op.data.send_message.send_message = msg;
+    st.write_buffer = msg;
+    st.write_pending = start_batch(&op, 1, tag_write);
+    if(!st.write_pending) {
+        grpc_byte_buffer_destroy(msg);
+        st.write_buffer = nullptr;
+    }
+    return st.write_pending;
+}
+
+bool grpc_proxy::writes_done() {
+    auto& st = *m_stream;
+    if(st.closed) return true;
+    st.closed = true;
+    grpc_op op = {};
+    op.op = GRPC_OP_SEND_CLOSE_FROM_CLIENT;
+    st.close_pending = start_batch(&op, 1, tag_close);
+    return st.close_pending;
+}
+
+bool grpc_proxy::poll() {
+    while(m_stream->busy()) {
+        auto res = next_event(false);
+        if(res == event_result::failed) return false;
+        if(res == event_result::timeout) break;
+    }
+    return true;
+}
+
+bool grpc_proxy::finish(status& s) {
+    auto& st = *m_stream;
+    writes_done();
+    bool ok = true;
+    while(st.busy()) {
+        if(next_event(true) != event_result::handled) {
+            ok = false;
+            break;
+        }
+    }
+    if(st.status_pending) return false;
+    s.status = static_cast<int>(st.code);
+    if(st.error) {
+        s.error = std::string(st.error);
+        gpr_free(const_cast<char*>(st.error));
+        st.error = nullptr;
+    }
+    if(!GRPC_SLICE_IS_EMPTY(st.details)) {
+        s.details.assign(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(st.details)), GRPC_SLICE_LENGTH(st.details));
+    }
+    parse_metadata(st.trailing_md, s.metadata);
+    return ok;
+}
+
+bool grpc_proxy::send_initial_metadata(const header_list& headers) {
+    std::vector<grpc_metadata> meta;
+    build_metadata(headers, meta);
+    grpc_op op = {};
+    op.op = GRPC_OP_SEND_INITIAL_METADATA;
+    op.data.send_initial_metadata.count = meta.size();
+    op.data.send_initial_metadata.metadata = meta.data();
+    auto e = run_ops(m_call, &op, 1);
+    free_metadata(meta);
+    return e.success;
+}
+
+bool grpc_proxy::send_request(const void* data, size_t len) {
     auto slice = grpc_slice_from_static_buffer(data, len);
-    op.data.send_message.send_message = grpc_raw_byte_buffer_create(&slice, 1);
+    auto request = grpc_raw_byte_buffer_create(&slice, 1);
     grpc_slice_unref(slice);
-    auto e = run_ops(m_call, m_cq, &op, 1);
-    grpc_byte_buffer_destroy(op.data.send_message.send_message);
+    auto res = send_request(request);
+    grpc_byte_buffer_destroy(request);
+    return res;
+}
+
+bool grpc_proxy::send_request(grpc_byte_buffer* request) {
+    grpc_op op = {};
+    op.op = GRPC_OP_SEND_MESSAGE;
+    op.data.send_message.send_message = request;
+    auto e = run_ops(m_call, &op, 1);
     return e.success && e.type == GRPC_OP_COMPLETE;
 }
 
 bool grpc_proxy::send_client_close() {
     grpc_op op = {};
     op.op = GRPC_OP_SEND_CLOSE_FROM_CLIENT;
-    auto e = run_ops(m_call, m_cq, &op, 1);
+    auto e = run_ops(m_call, &op, 1);
     return e.success && e.type == GRPC_OP_COMPLETE;
 }
 
-bool grpc_proxy::receive_initial_metadata(std::unordered_multimap<std::string, std::string>& headers) {
+bool grpc_proxy::receive_initial_metadata(header_list& headers) {
     grpc_metadata_array array = {};
     grpc_metadata_array_init(&array);
     grpc_op op = {};
     op.op = GRPC_OP_RECV_INITIAL_METADATA;
     op.data.recv_initial_metadata.recv_initial_metadata = &array;
-    auto e = run_ops(m_call, m_cq, &op, 1);
+    auto e = run_ops(m_call, &op, 1);
     parse_metadata(array, headers);
     grpc_metadata_array_destroy(&array);
     return e.success && e.type == GRPC_OP_COMPLETE;
 }
 
-bool grpc_proxy::receive_message(std::function<void(const void* data, size_t len)> cb) {
+bool grpc_proxy::receive_message(message_callback cb) {
     grpc_byte_buffer* payload = {};
     grpc_op op = {};
     op.op = GRPC_OP_RECV_MESSAGE;
     op.data.recv_message.recv_message = &payload;
-    auto e = run_ops(m_call, m_cq, &op, 1);
+    auto e = run_ops(m_call, &op, 1);
     if(e.type != GRPC_OP_COMPLETE || !payload) return false;
 
-    std::vector<uint8_t> data;
-    grpc_byte_buffer_reader reader;
-    grpc_byte_buffer_reader_init(&reader, payload);
-    grpc_slice slice;
-    while (grpc_byte_buffer_reader_next(&reader, &slice)) {
-        auto s = data.size();
-        data.resize(s + GRPC_SLICE_LENGTH(slice));
-        memcpy(&data[s], GRPC_SLICE_START_PTR(slice), GRPC_SLICE_LENGTH(slice));
-        grpc_slice_unref(slice);
-    }
-    grpc_byte_buffer_reader_destroy(&reader);
+    if(cb) cb(payload);
     grpc_byte_buffer_destroy(payload);
     payload = nullptr;
-    if(cb) cb(data.data(), data.size());
 
     return e.success;
 }
@@ -215,36 +840,43 @@ bool grpc_proxy::receive_status(grpc_proxy::status& s) {
     op.data.recv_status_on_client.status = &code;
     op.data.recv_status_on_client.error_string = &str;
     op.data.recv_status_on_client.status_details = &status_details;
-    auto e = run_ops(m_call, m_cq, &op, 1);
-    s.status = static_cast<int>(code);
-    if(str) {
-        s.error = std::string(str);
-        gpr_free(const_cast<char*>(str));
-    }
-    if(!GRPC_SLICE_IS_EMPTY(status_details)) {
-        s.details.clear();
-        s.details.append(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(status_details)), GRPC_SLICE_LENGTH(status_details));
-    }
-    grpc_slice_unref(status_details);
-    parse_metadata(array, s.metadata);
+    auto e = run_ops(m_call, &op, 1);
+    parse_status(s, code, str, status_details, array);
     grpc_metadata_array_destroy(&array);
     return e.success  && e.type == GRPC_OP_COMPLETE;
 }
 
-void grpc_proxy::process_init() noexcept {
+void grpc_proxy::process_init(size_t engine_threads, message_encoding backend_compression) noexcept {
     gpr_set_log_verbosity(GPR_LOG_SEVERITY_DEBUG);
 	grpc_tracer_set_enabled("api", true);
     grpc_init();
+    g_grpc_running = true;
+    switch(backend_compression) {
+    case message_encoding::gzip: g_channels.set_compression(GRPC_COMPRESS_GZIP); break;
+    case message_encoding::deflate: g_channels.set_compression(GRPC_COMPRESS_DEFLATE); break;
+    default: g_channels.set_compression(GRPC_COMPRESS_NONE); break;
+    }
+    g_channels.start();
+    g_engine.start(engine_threads);
 }
 
 void grpc_proxy::process_deinit() noexcept {
-    std::unique_lock<std::mutex> lck(g_channel_cache_mtx);
-    g_channel_cache.clear();
-    lck.unlock();
+    g_channels.stop();
+    g_channels.clear();
+    g_engine.stop();
+    t_cq_cache.clear();
+    auto stats = get_cq_cache_stats();
+    gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_INFO, "cq cache: %llu hits, %llu misses",
+        static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses));
+    g_grpc_running = false;
     grpc_shutdown();
 }
 
 bool grpc_proxy::is_backend_alive(const std::string& host) noexcept {
-    auto ch = get_working_channel(host);
-    return ch != nullptr;
+    auto ch = get_working_channel(host, 1);
+    return static_cast<bool>(ch);
+}
+
+grpc_proxy::cq_cache_stats grpc_proxy::get_cq_cache_stats() noexcept {
+    return { g_cq_cache_hits.load(), g_cq_cache_misses.load() };
 }
\ No newline at end of file
@@ -0,0 +1,207 @@
+#include <grpc_web.h>
+#include <base64.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <strings.h>
+
+void byte_buffer_deleter::operator()(grpc_byte_buffer* buf) const noexcept {
+    if(buf) grpc_byte_buffer_destroy(buf);
+}
+
+grpc_web_frame_reader::grpc_web_frame_reader(size_t max_message_size) noexcept
+    : m_max_message_size(max_message_size), m_slice(grpc_empty_slice())
+{}
+
+grpc_web_frame_reader::~grpc_web_frame_reader() {
+    grpc_slice_unref(m_slice);
+}
+
+bool grpc_web_frame_reader::feed(const void* pdata, size_t len, const callback& cb) {
+    if(m_failed) return false;
+    auto data = static_cast<const uint8_t*>(pdata);
+    while(len > 0) {
+        if(m_header_len < sizeof(m_header)) {
+            auto n = std::min(sizeof(m_header) - m_header_len, len);
+            memcpy(&m_header[m_header_len], data, n);
+            m_header_len += n;
+            data += n;
+            len -= n;
+            if(m_header_len < sizeof(m_header)) break;
+            m_message_len = (static_cast<size_t>(m_header[1]) << 24) | (static_cast<size_t>(m_header[2]) << 16)
+                            | (static_cast<size_t>(m_header[3]) << 8) | static_cast<size_t>(m_header[4]);
+            // Reject before allocating anything
+            if(m_message_len > m_max_message_size) {
+                m_failed = true;
+                m_too_large = true;
+                return false;
+            }
+            m_slice = grpc_slice_malloc(m_message_len);
+            m_offset = 0;
+        } else {
+            auto n = std::min(m_message_len - m_offset, len);
+            memcpy(GRPC_SLICE_START_PTR(m_slice) + m_offset, data, n);
+            m_offset += n;
+            data += n;
+            len -= n;
+        }
+        if(m_header_len == sizeof(m_header) && m_offset == m_message_len) {
+            byte_buffer_ptr msg(grpc_raw_byte_buffer_create(&m_slice, 1));
+            grpc_slice_unref(m_slice);
+            m_slice = grpc_empty_slice();
+            m_header_len = 0;
+            if(!cb(m_header[0], std::move(msg))) {
+                m_failed = true;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool parse_grpc_web_content_type(const char* value, size_t len, grpc_web_content_type& out) noexcept {
+    static constexpr char prefix[] = "application/grpc";
+    static constexpr size_t prefix_len = sizeof(prefix) - 1;
+    // Strip parameters and surrounding whitespace
+    auto end = static_cast<const char*>(memchr(value, ';', len));
+    if(end) len = end - value;
+    while(len > 0 && isspace(static_cast<unsigned char>(*value))) { value++; len--; }
+    while(len > 0 && isspace(static_cast<unsigned char>(value[len - 1]))) len--;
+
+    if(len < prefix_len || strncasecmp(value, prefix, prefix_len) != 0) return false;
+    value += prefix_len;
+    len -= prefix_len;
+
+    grpc_web_content_type res;
+    res.format = grpc_web_format::native;
+    if(len >= 4 && strncasecmp(value, "-web", 4) == 0) {
+        res.format = grpc_web_format::binary;
+        value += 4;
+        len -= 4;
+        if(len >= 5 && strncasecmp(value, "-text", 5) == 0) {
+            res.format = grpc_web_format::text;
+            value += 5;
+            len -= 5;
+        }
+    }
+    if(len == 6 && strncasecmp(value, "+proto", 6) == 0) {
+        res.proto = true;
+    } else if(len != 0) return false;
+    out = res;
+    return true;
+}
+
+bool parse_grpc_web_accept(const char* value, grpc_web_content_type& out) noexcept {
+    while(*value != '\0') {
+        auto end = strchr(value, ',');
+        auto len = end ? static_cast<size_t>(end - value) : strlen(value);
+        grpc_web_content_type type;
+        // A grpc-web client can not read real trailers
+        if(parse_grpc_web_content_type(value, len, type) && type.format != grpc_web_format::native) {
+            out = type;
+            return true;
+        }
+        if(!end) break;
+        value = end + 1;
+    }
+    return false;
+}
+
+bool parse_grpc_timeout(const char* value, size_t len, uint64_t& ms) noexcept {
+    if(len < 2 || len > 9) return false;
+    uint64_t v = 0;
+    for(size_t i = 0; i < len - 1; i++) {
+        if(value[i] < '0' || value[i] > '9') return false;
+        v = v * 10 + (value[i] - '0');
+    }
+    switch(value[len - 1]) {
+    case 'H': ms = v * 3600000; break;
+    case 'M': ms = v * 60000; break;
+    case 'S': ms = v * 1000; break;
+    case 'm': ms = v; break;
+    case 'u': ms = (v + 999) / 1000; break;
+    case 'n': ms = (v + 999999) / 1000000; break;
+    default: return false;
+    }
+    // An explicit 0 is already expired, which a 1 ms deadline is as good as
+    if(ms == 0) ms = 1;
+    return true;
+}
+
+const char* grpc_web_content_type_name(const grpc_web_content_type& ct) noexcept {
+    if(ct.format == grpc_web_format::native)
+        return ct.proto ? "application/grpc+proto" : "application/grpc";
+    if(ct.format == grpc_web_format::text)
+        return ct.proto ? "application/grpc-web-text+proto" : "application/grpc-web-text";
+    return ct.proto ? "application/grpc-web+proto" : "application/grpc-web";
+}
+
+namespace {
+    constexpr char key_status[] = "grpc-status:";
+    constexpr char key_message[] = "\r\ngrpc-message:";
+    constexpr char key_error[] = "\r\ngrpc-error:";
+
+    char* put(char* out, const char* data, size_t len) noexcept {
+        memcpy(out, data, len);
+        return out + len;
+    }
+}
+
+std::string grpc_web_trailer(int status, const std::string& details, const std::string& error, const header_list& metadata) {
+    char code[16];
+    auto code_len = static_cast<size_t>(snprintf(code, sizeof(code), "%d", status));
+
+    size_t size = sizeof(key_status) - 1 + code_len + sizeof(key_message) - 1 + details.size() + 2;
+    if(!error.empty()) size += sizeof(key_error) - 1 + error.size();
+    for(auto& e : metadata) {
+        size += e.key_len + 3;
+        size += is_binary_header(e.key, e.key_len) ? base64_encode_stream::max_encoded_size(e.value_len) : e.value_len;
+    }
+
+    std::string res;
+    res.resize(size);
+    auto out = &res[0];
+    out = put(out, key_status, sizeof(key_status) - 1);
+    out = put(out, code, code_len);
+    out = put(out, key_message, sizeof(key_message) - 1);
+    out = put(out, details.data(), details.size());
+    if(!error.empty()) {
+        out = put(out, key_error, sizeof(key_error) - 1);
+        out = put(out, error.data(), error.size());
+    }
+    out = put(out, "\r\n", 2);
+    for(auto& e : metadata) {
+        out = put(out, e.key, e.key_len);
+        *out++ = ':';
+        if(is_binary_header(e.key, e.key_len)) {
+            base64_encode_stream enc;
+            out += enc.feed(out, e.value, e.value_len);
+            out += enc.flush(out);
+        } else {
+            out = put(out, e.value, e.value_len);
+        }
+        out = put(out, "\r\n", 2);
+    }
+    // Only base64 output may come out shorter than reserved
+    res.resize(out - res.data());
+    return res;
+}
+
+std::string grpc_percent_encode(const std::string& message) {
+    static constexpr char hex[] = "0123456789ABCDEF";
+    std::string res;
+    res.reserve(message.size());
+    for(unsigned char c : message) {
+        if(c >= 0x20 && c <= 0x7e && c != '%') {
+            res += static_cast<char>(c);
+        } else {
+            res += '%';
+            res += hex[c >> 4];
+            res += hex[c & 0x0f];
+        }
+    }
+    return res;
+}
@@ -0,0 +1,323 @@
+#include <grpc_web_call.h>
+#include <base64.h>
+#include <response_cache.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <algorithm>
+#include <cstring>
+
+uint32_t grpc_web_call::retry_tokens = 10;
+double grpc_web_call::retry_ratio = 0.1;
+
+// The grpcCacheMethod, grpcIdempotentMethod or grpcUnaryMethod entry matching method, nullptr if it is not listed
+template<typename T>
+static const T* find_method(const T* list, const char* method) noexcept {
+    for(; list; list = list->next) {
+        auto len = strlen(list->method);
+        // A trailing * matches every method of a service
+        if(len && list->method[len - 1] == '*') {
+            if(strncmp(list->method, method, len - 1) == 0) return list;
+        } else if(strcmp(list->method, method) == 0) return list;
+    }
+    return nullptr;
+}
+
+/**
+ * Attempts allowed for a unary call of method. A percentile hedging delay is looked up in the
+ * backend wait times of the metrics, the call is only retried until enough samples were seen.
+ */
+static grpc_proxy::retry_policy make_retry_policy(const proxy_grpc_retry_method_t* method, const char* backend, const char* url) noexcept {
+    grpc_proxy::retry_policy policy;
+    if(!method) return policy;
+    policy.max_attempts = method->max_attempts;
+    policy.budget_tokens = grpc_web_call::retry_tokens;
+    policy.budget_ratio = grpc_web_call::retry_ratio;
+    policy.hedge_delay_ms = method->hedge_delay_ms;
+    if(method->hedge_percentile > 0) {
+        auto endpoint = proxy_metrics::find(backend, url);
+        auto us = endpoint ? endpoint->backend_wait.percentile_us(method->hedge_percentile, 100) : 0;
+        policy.hedge_delay_ms = us == 0 ? 0 : std::max<uint64_t>(us / 1000, 1);
+    }
+    return policy;
+}
+
+grpc_web_call::grpc_web_call(const proxy_grpc_config_t& cfg, grpc_web_sink& sink, const char* backend, const char* method,
+                             header_list::alloc_func alloc, void* alloc_ctx)
+    : m_cfg(cfg), m_sink(sink), m_backend(backend), m_method(method), m_alloc(alloc), m_alloc_ctx(alloc_ctx),
+      m_metrics(backend, method), m_headers_out(alloc, alloc_ctx),
+      m_max_size(cfg.max_message_size < 0 ? 4*1024*1024 : cfg.max_message_size), m_reader(m_max_size)
+{
+    m_status.metadata = header_list(alloc, alloc_ctx);
+}
+
+int grpc_web_call::begin(const header_list& headers, bool http2) {
+    m_headers_in = &headers;
+    auto content_type = headers.find("content-type");
+    auto accept = headers.find("accept");
+    if(!content_type || !parse_grpc_web_content_type(content_type->value, content_type->value_len, m_request_type))
+        return 415;
+    // Plain grpc passes the frames through as is, but needs real trailers for the status
+    const bool native = m_request_type.format == grpc_web_format::native;
+    if(native && !http2) return 505;
+    // Respond in the request encoding unless the client explicitly asks for another one
+    m_response_type = m_request_type;
+    if(accept && !native) parse_grpc_web_accept(accept->value, m_response_type);
+    m_text_response = m_response_type.format == grpc_web_format::text;
+
+    // Compressed request frames are inflated here, grpc compresses towards the backend as configured
+    if(auto e = headers.find("grpc-encoding"))
+        m_request_encoding_known = parse_message_encoding(e->value, e->value_len, m_request_encoding);
+    // Responses are only compressed if enabled and the client lists the algorithm
+    if(m_cfg.response_compression > 1) {
+        auto enc = static_cast<message_encoding>(m_cfg.response_compression - 1);
+        auto accepted = headers.find("grpc-accept-encoding");
+        if(accepted && accepts_message_encoding(accepted->value, accepted->value_len, enc)) m_response_encoding = enc;
+    }
+    m_compress_min_size = m_cfg.response_compression_min_size < 0 ? 1024 : m_cfg.response_compression_min_size;
+
+    // The client deadline applies if it is shorter than the configured one
+    uint64_t call_timeout = std::max<int64_t>(m_cfg.call_timeout_ms, 0);
+    uint64_t client_timeout;
+    if(auto t = headers.find("grpc-timeout")) {
+        if(parse_grpc_timeout(t->value, t->value_len, client_timeout) && (call_timeout == 0 || client_timeout < call_timeout))
+            call_timeout = client_timeout;
+    }
+    m_proxy.set_call_timeout(call_timeout);
+    // Nobody reads the answer once the client is gone, stop the backend from working on it
+    m_proxy.set_abort_check([this]() { return m_sink.aborted() || m_sink.disconnected(); });
+    m_proxy.set_channels_per_backend(std::max<int64_t>(m_cfg.channels_per_backend, 1));
+    m_proxy.set_channel_args(m_cfg.backend_args);
+
+    // Cacheable calls only touch a channel once the request missed the cache
+    m_cache_method = response_cache::enabled() ? find_method(m_cfg.cache_methods, m_method) : nullptr;
+    m_retry_method = find_method(m_cfg.retry_methods, m_method);
+    // Anything not known to be unary may stream its response
+    m_unary = find_method(m_cfg.unary_methods, m_method) || find_method(m_cfg.cache_methods, m_method) || m_retry_method;
+    if(!m_cache_method && !start_call()) return 503;
+    return 0;
+}
+
+bool grpc_web_call::start_call() {
+    auto begin = call_timing::now();
+    m_started = m_proxy.start(m_backend, m_method);
+    proxy_metrics::record_channel_lookup(m_proxy.channel_cached());
+    m_timing.mark_lookup(begin);
+    return m_started;
+}
+
+void grpc_web_call::start_response() {
+    // Headers go out with the first flush, Server-Timing can only cover what happened up to then
+    if(m_response_started) return;
+    m_response_started = true;
+    m_sink.start_response(m_headers_out, m_response_encoding, m_timing);
+}
+
+void grpc_web_call::count_out(size_t len) {
+    m_metrics.bytes_out += len;
+    m_metrics.bytes_out_wire += m_text_response ? base64_encode_stream::max_encoded_size(len + 5) : len + 5;
+}
+
+void grpc_web_call::forward(grpc_byte_buffer* msg) {
+    m_timing.mark(call_timing::first_response);
+    start_response();
+    auto len = grpc_byte_buffer_length(msg);
+    if(m_response_encoding != message_encoding::identity && len >= m_compress_min_size
+        && compress_message(m_response_encoding, msg, m_compressed) && m_compressed.size() < len) {
+        count_out(m_compressed.size());
+        m_sink.append_frame(grpc_web_frame_reader::flag_compressed, m_compressed.data(), m_compressed.size(), m_text_response);
+    } else {
+        count_out(len);
+        m_sink.append_frame(0, msg, m_text_response);
+    }
+    if(!m_sink.flush() || m_sink.aborted()) m_proxy.cancel();
+}
+
+bool grpc_web_call::on_data(const char* data, size_t len) {
+    auto res = m_reader.feed(data, len, [this](uint8_t flags, byte_buffer_ptr msg) {
+        if(flags & grpc_web_frame_reader::flag_trailer) return true;
+        if(flags & grpc_web_frame_reader::flag_compressed) {
+            if(!m_request_encoding_known || m_request_encoding == message_encoding::identity) {
+                m_bad_message = true;
+                return false;
+            }
+            msg = decompress_message(m_request_encoding, msg.get(), m_max_size);
+            if(!msg) {
+                m_bad_message = true;
+                return false;
+            }
+        }
+        m_metrics.bytes_in += grpc_byte_buffer_length(msg.get());
+        if(!m_streaming && !m_first) {
+            m_first = std::move(msg);
+            return true;
+        }
+        if(!m_streaming) start_streaming();
+        // Stop reading once the call is over
+        m_stream_ok = m_stream_ok && m_proxy.write(msg.release());
+        return m_stream_ok;
+    });
+    // Forward responses that arrived while waiting for the client
+    if(m_streaming && m_stream_ok) m_proxy.poll();
+    return res;
+}
+
+// Send the held back first message as the start of a streaming call
+bool grpc_web_call::start_streaming() {
+    m_streaming = true;
+    m_timing.mark(call_timing::call_start);
+    m_stream_ok = (m_started || start_call())
+        && m_proxy.start_stream(*m_headers_in, m_headers_out, [this](grpc_byte_buffer* msg) { forward(msg); })
+        && m_proxy.write(m_first.release());
+    return m_stream_ok;
+}
+
+bool grpc_web_call::feed(const char* data, size_t len) {
+    if(!m_body_ok) return false;
+    m_body_size += len;
+    if(m_request_type.format != grpc_web_format::text) {
+        m_body_ok = on_data(data, len);
+        return m_body_ok;
+    }
+    m_decoded.clear();
+    auto begin = call_timing::now();
+    // The decoder validates the input in the same pass
+    m_decoder.feed(m_decoded, data, len);
+    m_timing.add_decode(begin);
+    m_body_ok = !m_decoder.failed() && (m_decoded.empty() || on_data(m_decoded.data(), m_decoded.size()));
+    return m_body_ok;
+}
+
+/**
+ * Serve a unary call from the response cache, or run it and store an OK response.
+ * The call is only started on a miss, so hits never touch a channel.
+ */
+bool grpc_web_call::cached_unary_call(grpc_byte_buffer* request, const grpc_proxy::retry_policy& policy) {
+    auto& method = *m_cache_method;
+    auto key = response_cache::make_key(m_backend, m_method, *m_headers_in, method.metadata_keys, method.num_keys, request);
+    header_list hit_headers(m_alloc, m_alloc_ctx);
+    header_list hit_trailers(m_alloc, m_alloc_ctx);
+    response_cache::entry hit(hit_headers, hit_trailers);
+    if(response_cache::lookup(key, hit)) {
+        proxy_metrics::record_cache_lookup(true);
+        m_timing.mark(call_timing::call_start);
+        m_headers_out = std::move(hit_headers);
+        m_status.status = 0;
+        m_status.metadata = std::move(hit_trailers);
+        if(hit.has_message) {
+            auto slice = grpc_slice_from_copied_buffer(hit.message.data(), hit.message.size());
+            byte_buffer_ptr msg(grpc_raw_byte_buffer_create(&slice, 1));
+            grpc_slice_unref(slice);
+            forward(msg.get());
+        }
+        return true;
+    }
+    proxy_metrics::record_cache_lookup(false);
+    if(!start_call()) return false;
+
+    m_timing.mark(call_timing::call_start);
+    std::string response;
+    bool has_response = false;
+    auto ok = m_proxy.unary_call(*m_headers_in, request, m_headers_out, [&](grpc_byte_buffer* msg) {
+        grpc_byte_buffer_reader reader;
+        if(grpc_byte_buffer_reader_init(&reader, msg)) {
+            auto all = grpc_byte_buffer_reader_readall(&reader);
+            response.assign(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(all)), GRPC_SLICE_LENGTH(all));
+            has_response = true;
+            grpc_slice_unref(all);
+            grpc_byte_buffer_reader_destroy(&reader);
+        }
+        forward(msg);
+    }, m_status, policy);
+    if(ok && m_status.status == 0) {
+        auto ttl = response_cache::allowed_ttl(m_headers_out, m_status.metadata, method.ttl_ms);
+        response_cache::store(key, ttl, m_headers_out, m_status.metadata, response.data(), response.size(), has_response);
+    }
+    return ok;
+}
+
+int grpc_web_call::finish() {
+    if(m_request_type.format == grpc_web_format::text && m_body_ok) {
+        m_decoded.clear();
+        m_decoder.flush(m_decoded);
+        m_body_ok = !m_decoder.failed() && (m_decoded.empty() || on_data(m_decoded.data(), m_decoded.size()));
+    }
+    m_metrics.bytes_in_wire = m_body_size;
+    m_timing.mark(call_timing::body_read);
+    if(m_sink.aborted()) m_proxy.cancel();
+    // Reading stopped at the header of the oversized frame, the backend must not see a shortened stream as complete
+    if(m_streaming && m_reader.too_large()) m_proxy.cancel();
+
+    if(!m_streaming) {
+        if(m_bad_message) return 400;
+        if(m_reader.too_large()) return 413;
+        if(!m_body_ok || m_reader.has_partial_frame()) return 400;
+        if(!m_first) m_first.reset(grpc_raw_byte_buffer_create(nullptr, 0));
+        // A single batch only receives one response message, server streaming methods need the streaming call
+        if(!m_unary) start_streaming();
+    }
+
+    bool ok;
+    if(m_streaming) {
+        // The body was already partially forwarded, a broken tail still ends the call normally
+        ok = m_started && m_proxy.finish(m_status);
+        if(ok && m_reader.too_large()) {
+            m_status.status = GRPC_STATUS_RESOURCE_EXHAUSTED;
+            m_status.details = "Request message larger than max (" + std::to_string(m_max_size) + " bytes)";
+            m_status.error.clear();
+        }
+    } else {
+        auto retry_policy = make_retry_policy(m_retry_method, m_backend, m_method);
+        if(m_cache_method) {
+            ok = cached_unary_call(m_first.get(), retry_policy);
+            if(!m_started && !ok) return 503;
+        } else {
+            m_timing.mark(call_timing::call_start);
+            ok = m_proxy.unary_call(*m_headers_in, m_first.get(), m_headers_out,
+                                    [this](grpc_byte_buffer* msg) { forward(msg); }, m_status, retry_policy);
+        }
+    }
+    m_timing.mark(call_timing::last_message);
+    m_metrics.backend_wait_us = m_proxy.wait_time_us();
+    if(!ok) {
+        if(!m_response_started) return 503;
+        // Messages were forwarded already, the client still needs a status to tell the stream from a complete one
+        m_status.status = m_proxy.cancelled() ? GRPC_STATUS_CANCELLED : GRPC_STATUS_UNAVAILABLE;
+        m_status.details = m_proxy.cancelled() ? "Call cancelled" : "Backend call failed";
+        m_status.error.clear();
+        write_status();
+        return 0;
+    }
+    write_status();
+    return 0;
+}
+
+int grpc_web_call::abort_body(int http_status) {
+    m_metrics.bytes_in_wire = m_body_size;
+    m_timing.mark(call_timing::body_read);
+    // Cancelled instead of half-closed, the backend must not see the truncated stream as complete
+    m_proxy.cancel();
+    if(!m_response_started) return http_status;
+    // Part of the response is out already, it can only be ended with a status
+    m_status.status = GRPC_STATUS_CANCELLED;
+    m_status.details = "Request body incomplete";
+    m_status.error.clear();
+    write_status();
+    return 0;
+}
+
+void grpc_web_call::write_status() {
+    m_metrics.status = m_status.status;
+    if(m_request_type.format == grpc_web_format::native) {
+        start_response();
+        m_sink.set_trailers(m_status);
+    } else {
+        auto trailer = grpc_web_trailer(m_status.status, m_status.details, m_status.error, m_status.metadata);
+        count_out(trailer.size());
+        start_response();
+        m_sink.append_frame(grpc_web_frame_reader::flag_trailer, trailer.data(), trailer.size(), m_text_response);
+        m_sink.flush();
+    }
+    m_timing.mark(call_timing::trailer_write);
+    m_completed = true;
+}
@@ -0,0 +1,143 @@
+#include <header_list.h>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+struct header_list::block {
+    block* next;
+    size_t size;
+    size_t used;
+};
+
+static constexpr size_t block_size = 4096;
+static constexpr size_t alignment = alignof(std::max_align_t);
+
+static size_t align_up(size_t v) noexcept {
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+header_list::header_list() noexcept
+    : m_alloc(nullptr), m_ctx(nullptr)
+{}
+
+header_list::header_list(alloc_func alloc, void* ctx, size_t capacity)
+    : m_alloc(alloc), m_ctx(ctx)
+{
+    if(capacity != 0) {
+        m_entries = static_cast<header_entry*>(allocate(capacity * sizeof(header_entry)));
+        m_capacity = capacity;
+    }
+}
+
+header_list::~header_list() {
+    release();
+}
+
+header_list::header_list(header_list&& other) noexcept
+    : m_alloc(other.m_alloc), m_ctx(other.m_ctx), m_entries(other.m_entries),
+      m_size(other.m_size), m_capacity(other.m_capacity), m_blocks(other.m_blocks)
+{
+    other.m_entries = nullptr;
+    other.m_size = other.m_capacity = 0;
+    other.m_blocks = nullptr;
+}
+
+header_list& header_list::operator=(header_list&& other) noexcept {
+    if(this == &other) return *this;
+    release();
+    m_alloc = other.m_alloc;
+    m_ctx = other.m_ctx;
+    m_entries = other.m_entries;
+    m_size = other.m_size;
+    m_capacity = other.m_capacity;
+    m_blocks = other.m_blocks;
+    other.m_entries = nullptr;
+    other.m_size = other.m_capacity = 0;
+    other.m_blocks = nullptr;
+    return *this;
+}
+
+void header_list::release() noexcept {
+    while(m_blocks) {
+        auto next = m_blocks->next;
+        free(m_blocks);
+        m_blocks = next;
+    }
+    m_entries = nullptr;
+    m_size = m_capacity = 0;
+}
+
+void* header_list::allocate(size_t size) {
+    if(m_alloc) return m_alloc(m_ctx, size);
+    size = align_up(size);
+    auto header = align_up(sizeof(block));
+    if(!m_blocks || m_blocks->size - m_blocks->used < size) {
+        auto bsize = std::max(block_size, header + size);
+        auto b = static_cast<block*>(malloc(bsize));
+        if(!b) throw std::bad_alloc();
+        b->next = m_blocks;
+        b->size = bsize;
+        b->used = header;
+        m_blocks = b;
+    }
+    auto res = reinterpret_cast<char*>(m_blocks) + m_blocks->used;
+    m_blocks->used += size;
+    return res;
+}
+
+void header_list::grow() {
+    // The old array stays in the arena, growth is rare as the capacity is usually known upfront
+    auto cap = m_capacity ? m_capacity * 2 : 16;
+    auto entries = static_cast<header_entry*>(allocate(cap * sizeof(header_entry)));
+    if(m_size) memcpy(entries, m_entries, m_size * sizeof(header_entry));
+    m_entries = entries;
+    m_capacity = cap;
+}
+
+void header_list::add_ref(const char* key, size_t key_len, const char* value, size_t value_len) {
+    if(m_size == m_capacity) grow();
+    m_entries[m_size++] = { key, key_len, value, value_len };
+}
+
+void header_list::add_copy(const char* key, size_t key_len, const char* value, size_t value_len) {
+    auto buf = static_cast<char*>(allocate(key_len + value_len + 2));
+    for(size_t i = 0; i < key_len; i++) {
+        auto c = key[i];
+        buf[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    buf[key_len] = '\0';
+    memcpy(buf + key_len + 1, value, value_len);
+    buf[key_len + 1 + value_len] = '\0';
+    add_ref(buf, key_len, buf + key_len + 1, value_len);
+}
+
+const header_entry* header_list::find(const char* key, size_t key_len) const noexcept {
+    for(auto& e : *this) {
+        if(e.key_equals(key, key_len)) return &e;
+    }
+    return nullptr;
+}
+
+bool is_reserved_header(const char* key, size_t len) noexcept {
+#define MATCH(str) (memcmp(key, str, sizeof(str) - 1) == 0)
+    switch(len) {
+    case 2: return MATCH("te");
+    case 4: return MATCH("host");
+    case 7: return MATCH("upgrade");
+    case 10:
+        switch(key[0]) {
+        case 'u': return MATCH("user-agent");
+        case 'k': return MATCH("keep-alive");
+        default: return MATCH("connection");
+        }
+    case 12: return key[0] == 'c' ? MATCH("content-type") : MATCH("grpc-timeout");
+    case 13: return MATCH("grpc-encoding");
+    case 14: return MATCH("content-length");
+    case 15: return MATCH("accept-encoding");
+    case 16: return MATCH("proxy-connection");
+    case 17: return MATCH("transfer-encoding");
+    case 20: return MATCH("grpc-accept-encoding");
+    default: return false;
+    }
+#undef MATCH
+}
@@ -0,0 +1,199 @@
+#include <health_checker.h>
+#include <shm_table.h>
+#include <grpc_proxy.h>
+#include <header_list.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <grpc/support/log.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+static constexpr uint32_t table_magic = 0x67726831;
+static constexpr char health_method[] = "/grpc.health.v1.Health/Check";
+
+static health_checker::table* s_table = nullptr;
+// Used if no shared memory was attached
+static std::unique_ptr<health_checker::table> s_local_table;
+
+static uint64_t now_ms() noexcept {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void health_checker::attach(void* mem) noexcept {
+    s_table = static_cast<table*>(mem);
+    if(s_table && s_table->magic != table_magic) {
+        memset(static_cast<void*>(s_table), 0, sizeof(table));
+        s_table->magic = table_magic;
+    }
+}
+
+health_checker::backend* health_checker::lookup(const char* host) noexcept {
+    if(!s_table) {
+        if(!s_local_table) {
+            s_local_table.reset(new (std::nothrow) table());
+            if(!s_local_table) return nullptr;
+            memset(static_cast<void*>(s_local_table.get()), 0, sizeof(table));
+        }
+        s_table = s_local_table.get();
+    }
+    if(strlen(host) >= sizeof(backend::host)) return nullptr;
+    return shm_table::lookup(s_table->backends, max_backends, shm_table::hash(host),
+        [host](const backend& e) { return strcmp(e.host, host) == 0; },
+        [host](backend& e) { strcpy(e.host, host); });
+}
+
+health_checker::state health_checker::get(const char* host) noexcept {
+    if(!s_table) return state::unknown;
+    auto e = shm_table::find(s_table->backends, max_backends, shm_table::hash(host),
+        [host](const backend& e) { return strcmp(e.host, host) == 0; });
+    return e ? static_cast<state>(e->health.load(std::memory_order_relaxed)) : state::unknown;
+}
+
+health_checker::~health_checker() {
+    stop();
+}
+
+void health_checker::add(const std::string& host, callback cb) {
+    for(auto& t : m_targets) {
+        if(t.host == host) return;
+    }
+    auto entry = lookup(host.c_str());
+    if(!entry) {
+        gpr_log(__FILE__, __LINE__, GPR_LOG_SEVERITY_ERROR, "Health check table full, %s is not checked", host.c_str());
+        return;
+    }
+    m_targets.push_back(target{ host, entry, std::move(cb), state::unknown });
+}
+
+void health_checker::start(const settings& s) {
+    if(m_running || m_targets.empty() || s.interval_ms == 0) return;
+    m_settings = s;
+    m_running = true;
+    m_thread = std::thread([this]() { run(); });
+}
+
+void health_checker::stop() {
+    {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        if(!m_running) return;
+        m_running = false;
+    }
+    m_cv.notify_all();
+    if(m_thread.joinable()) m_thread.join();
+}
+
+void health_checker::run() {
+    auto request = encode_request(m_settings.service);
+    // Wake up often enough to pick up probes claimed (and finished) by other children
+    auto tick = std::chrono::milliseconds(std::min<uint64_t>(m_settings.interval_ms, 1000));
+    std::unique_lock<std::mutex> lck(m_mtx);
+    while(m_running) {
+        lck.unlock();
+        for(auto& t : m_targets) {
+            auto e = t.entry;
+            auto now = now_ms();
+            auto due = e->next_check.load(std::memory_order_relaxed);
+            // Moving the due time forward claims the probe for this interval
+            if(due <= now && e->next_check.compare_exchange_strong(due, now + m_settings.interval_ms, std::memory_order_relaxed)) {
+                auto res = probe(t.host, request);
+                if(res == state::serving) {
+                    e->consecutive_failures.store(0, std::memory_order_relaxed);
+                    e->health.store(static_cast<uint32_t>(state::serving), std::memory_order_relaxed);
+                } else if(e->consecutive_failures.fetch_add(1, std::memory_order_relaxed) + 1 >= m_settings.fails) {
+                    e->health.store(static_cast<uint32_t>(state::not_serving), std::memory_order_relaxed);
+                }
+            }
+            auto current = static_cast<state>(e->health.load(std::memory_order_relaxed));
+            if(current != t.applied) {
+                t.applied = current;
+                if(t.cb) t.cb(t.host, current);
+            }
+        }
+        lck.lock();
+        if(!m_running) break;
+        m_cv.wait_for(lck, tick);
+    }
+}
+
+health_checker::state health_checker::probe(const std::string& host, const std::string& request) {
+    grpc_proxy proxy;
+    proxy.set_call_timeout(m_settings.timeout_ms);
+    proxy.set_channels_per_backend(1);
+    if(!proxy.start(host.c_str(), health_method)) return state::not_serving;
+    header_list headers, headers_out;
+    grpc_proxy::status status;
+    auto res = state::not_serving;
+    auto ok = proxy.unary_call(headers, request.data(), request.size(), headers_out, [&res](grpc_byte_buffer* msg) {
+        grpc_byte_buffer_reader reader;
+        if(!grpc_byte_buffer_reader_init(&reader, msg)) return;
+        auto all = grpc_byte_buffer_reader_readall(&reader);
+        res = decode_response(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(all)), GRPC_SLICE_LENGTH(all));
+        grpc_slice_unref(all);
+        grpc_byte_buffer_reader_destroy(&reader);
+    }, status);
+    if(!ok) return state::not_serving;
+    // A server without the health service still answers, which is as good as we can check
+    if(status.status == GRPC_STATUS_UNIMPLEMENTED) return state::serving;
+    if(status.status != GRPC_STATUS_OK) return state::not_serving;
+    return res;
+}
+
+std::string health_checker::encode_request(const std::string& service) {
+    std::string res;
+    if(service.empty()) return res;
+    // field 1 (service), length delimited
+    res += '\x0a';
+    auto len = service.size();
+    while(len >= 0x80) {
+        res += static_cast<char>((len & 0x7f) | 0x80);
+        len >>= 7;
+    }
+    res += static_cast<char>(len);
+    res += service;
+    return res;
+}
+
+health_checker::state health_checker::decode_response(const char* data, size_t len) noexcept {
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    auto end = p + len;
+    auto varint = [&](uint64_t& out) {
+        out = 0;
+        for(int shift = 0; p < end && shift < 64; shift += 7) {
+            auto b = *p++;
+            out |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if(!(b & 0x80)) return true;
+        }
+        return false;
+    };
+    // A missing status field is the default value UNKNOWN
+    uint64_t status = 0;
+    while(p < end) {
+        uint64_t tag, value;
+        if(!varint(tag)) return state::not_serving;
+        switch(tag & 7) {
+        case 0:
+            if(!varint(value)) return state::not_serving;
+            if(tag >> 3 == 1) status = value;
+            break;
+        case 1:
+            if(end - p < 8) return state::not_serving;
+            p += 8;
+            break;
+        case 2:
+            if(!varint(value) || static_cast<uint64_t>(end - p) < value) return state::not_serving;
+            p += value;
+            break;
+        case 5:
+            if(end - p < 4) return state::not_serving;
+            p += 4;
+            break;
+        default:
+            return state::not_serving;
+        }
+    }
+    // HealthCheckResponse.ServingStatus: 1 = SERVING
+    return status == 1 ? state::serving : state::not_serving;
+}
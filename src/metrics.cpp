@@ -0,0 +1,349 @@
+#include <metrics.h>
+#include <shm_table.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+static constexpr uint32_t table_magic = 0x67726d31;
+
+const uint64_t proxy_metrics::latency_bounds[num_latency_buckets - 1] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+proxy_metrics::table* proxy_metrics::s_table = nullptr;
+
+static const char* status_names[proxy_metrics::num_status] = {
+    "OK", "CANCELLED", "UNKNOWN", "INVALID_ARGUMENT", "DEADLINE_EXCEEDED", "NOT_FOUND", "ALREADY_EXISTS",
+    "PERMISSION_DENIED", "RESOURCE_EXHAUSTED", "FAILED_PRECONDITION", "ABORTED", "OUT_OF_RANGE",
+    "UNIMPLEMENTED", "INTERNAL", "UNAVAILABLE", "DATA_LOSS", "UNAUTHENTICATED", "NONE"
+};
+// What a backend answers for a method it does not know
+static constexpr int status_unimplemented = 12;
+
+static uint64_t now_us() noexcept {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t hash_name(const char* backend, const char* method) noexcept {
+    // Both names, separated by a byte that can not be part of either
+    return shm_table::hash(method, (shm_table::hash(backend) ^ 0xff) * 16777619u);
+}
+
+static void copy_name(char* dst, size_t size, const char* src) noexcept {
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+static bool name_matches(const proxy_metrics::endpoint& e, const char* backend, const char* method) noexcept {
+    return strncmp(e.backend, backend, sizeof(e.backend) - 1) == 0 && strncmp(e.method, method, sizeof(e.method) - 1) == 0;
+}
+
+void proxy_metrics::histogram::observe(uint64_t us) noexcept {
+    size_t i = 0;
+    while(i < num_latency_buckets - 1 && us > latency_bounds[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t proxy_metrics::histogram::percentile_us(double p, uint64_t min_samples) const noexcept {
+    uint64_t counts[num_latency_buckets];
+    uint64_t total = 0;
+    for(size_t i = 0; i < num_latency_buckets; i++) {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if(total == 0 || total < min_samples) return 0;
+    auto rank = total * std::min(std::max(p, 0.0), 100.0) / 100;
+    uint64_t seen = 0;
+    // The unbounded last bucket has no upper end to interpolate towards, report its lower bound
+    for(size_t i = 0; i < num_latency_buckets - 1; i++) {
+        if(counts[i] != 0 && seen + counts[i] >= rank) {
+            auto lower = i == 0 ? 0 : latency_bounds[i - 1];
+            return lower + static_cast<uint64_t>((latency_bounds[i] - lower) * ((rank - seen) / counts[i]));
+        }
+        seen += counts[i];
+    }
+    return latency_bounds[num_latency_buckets - 2];
+}
+
+void proxy_metrics::attach(void* mem) noexcept {
+    s_table = static_cast<table*>(mem);
+    if(s_table && s_table->magic != table_magic) {
+        memset(static_cast<void*>(s_table), 0, sizeof(table));
+        s_table->magic = table_magic;
+        copy_name(s_table->overflow.backend, sizeof(s_table->overflow.backend), "(other)");
+        copy_name(s_table->overflow.method, sizeof(s_table->overflow.method), "(other)");
+        s_table->overflow.state = shm_table::slot_ready;
+    }
+}
+
+proxy_metrics::endpoint* proxy_metrics::lookup(const char* backend, const char* method) noexcept {
+    if(!s_table) return nullptr;
+    if(!backend) backend = "";
+    if(!method) method = "";
+    auto e = shm_table::lookup(s_table->endpoints, max_endpoints, hash_name(backend, method),
+        [&](const endpoint& e) { return name_matches(e, backend, method); },
+        [&](endpoint& e) {
+            copy_name(e.backend, sizeof(e.backend), backend);
+            copy_name(e.method, sizeof(e.method), method);
+        });
+    return e ? e : &s_table->overflow;
+}
+
+proxy_metrics::endpoint* proxy_metrics::find(const char* backend, const char* method) noexcept {
+    if(!s_table) return nullptr;
+    if(!backend) backend = "";
+    if(!method) method = "";
+    return shm_table::find(s_table->endpoints, max_endpoints, hash_name(backend, method),
+        [&](const endpoint& e) { return name_matches(e, backend, method); });
+}
+
+void proxy_metrics::record_channel_lookup(bool cached) noexcept {
+    if(!s_table) return;
+    if(cached) s_table->channel_hits.fetch_add(1, std::memory_order_relaxed);
+    else s_table->channel_misses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void proxy_metrics::record_cache_lookup(bool hit) noexcept {
+    if(!s_table) return;
+    if(hit) s_table->cache_hits.fetch_add(1, std::memory_order_relaxed);
+    else s_table->cache_misses.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<typename Func>
+static void for_each_endpoint(proxy_metrics::table* t, Func func) {
+    for(auto& e : t->endpoints) {
+        if(e.state.load(std::memory_order_acquire) == shm_table::slot_ready) func(e);
+    }
+    if(t->overflow.calls.load(std::memory_order_relaxed) != 0) func(t->overflow);
+}
+
+static void append_escaped(std::string& out, const char* str) {
+    for(; *str; str++) {
+        switch(*str) {
+        case '\\': out += "\\\\"; break;
+        case '"': out += "\\\""; break;
+        case '\n': out += "\\n"; break;
+        default: out += *str;
+        }
+    }
+}
+
+static void append_labels(std::string& out, const proxy_metrics::endpoint& e) {
+    out += "backend=\"";
+    append_escaped(out, e.backend);
+    out += "\",method=\"";
+    append_escaped(out, e.method);
+    out += "\"";
+}
+
+static void append_value(std::string& out, uint64_t v) {
+    out += std::to_string(v);
+    out += "\n";
+}
+
+static void append_histogram(std::string& out, const char* name, const proxy_metrics::endpoint& e, const proxy_metrics::histogram& h) {
+    uint64_t total = 0;
+    char bound[32];
+    for(size_t i = 0; i < proxy_metrics::num_latency_buckets; i++) {
+        total += h.buckets[i].load(std::memory_order_relaxed);
+        if(i < proxy_metrics::num_latency_buckets - 1) snprintf(bound, sizeof(bound), "%g", proxy_metrics::latency_bounds[i] / 1e6);
+        else snprintf(bound, sizeof(bound), "+Inf");
+        out += name;
+        out += "_bucket{";
+        append_labels(out, e);
+        out += ",le=\"";
+        out += bound;
+        out += "\"} ";
+        append_value(out, total);
+    }
+    out += name;
+    out += "_sum{";
+    append_labels(out, e);
+    out += "} ";
+    snprintf(bound, sizeof(bound), "%.6f\n", h.sum_us.load(std::memory_order_relaxed) / 1e6);
+    out += bound;
+    out += name;
+    out += "_count{";
+    append_labels(out, e);
+    out += "} ";
+    append_value(out, total);
+}
+
+void proxy_metrics::write_prometheus(std::string& out) {
+    if(!s_table) return;
+    auto t = s_table;
+
+    out += "# HELP grpc_proxy_channel_lookups_total Channel registry lookups by result.\n";
+    out += "# TYPE grpc_proxy_channel_lookups_total counter\n";
+    out += "grpc_proxy_channel_lookups_total{result=\"hit\"} ";
+    append_value(out, t->channel_hits.load(std::memory_order_relaxed));
+    out += "grpc_proxy_channel_lookups_total{result=\"miss\"} ";
+    append_value(out, t->channel_misses.load(std::memory_order_relaxed));
+
+    out += "# HELP grpc_proxy_cache_lookups_total Response cache lookups by result.\n";
+    out += "# TYPE grpc_proxy_cache_lookups_total counter\n";
+    out += "grpc_proxy_cache_lookups_total{result=\"hit\"} ";
+    append_value(out, t->cache_hits.load(std::memory_order_relaxed));
+    out += "grpc_proxy_cache_lookups_total{result=\"miss\"} ";
+    append_value(out, t->cache_misses.load(std::memory_order_relaxed));
+
+    out += "# HELP grpc_proxy_calls_total Proxied calls.\n";
+    out += "# TYPE grpc_proxy_calls_total counter\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        out += "grpc_proxy_calls_total{";
+        append_labels(out, e);
+        out += "} ";
+        append_value(out, e.calls.load(std::memory_order_relaxed));
+    });
+
+    out += "# HELP grpc_proxy_calls_in_flight Calls currently in progress.\n";
+    out += "# TYPE grpc_proxy_calls_in_flight gauge\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        out += "grpc_proxy_calls_in_flight{";
+        append_labels(out, e);
+        out += "} ";
+        out += std::to_string(e.in_flight.load(std::memory_order_relaxed));
+        out += "\n";
+    });
+
+    out += "# HELP grpc_proxy_status_total Completed calls by grpc status code.\n";
+    out += "# TYPE grpc_proxy_status_total counter\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        for(size_t i = 0; i < num_status; i++) {
+            auto v = e.status[i].load(std::memory_order_relaxed);
+            if(v == 0) continue;
+            out += "grpc_proxy_status_total{";
+            append_labels(out, e);
+            out += ",code=\"";
+            out += status_names[i];
+            out += "\"} ";
+            append_value(out, v);
+        }
+    });
+
+    out += "# HELP grpc_proxy_bytes_total Message bytes by direction, wire is the http body, grpc the backend messages.\n";
+    out += "# TYPE grpc_proxy_bytes_total counter\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        const std::pair<const char*, const std::atomic<uint64_t>*> values[] = {
+            { "direction=\"in\",layer=\"wire\"", &e.bytes_in_wire },
+            { "direction=\"in\",layer=\"grpc\"", &e.bytes_in },
+            { "direction=\"out\",layer=\"grpc\"", &e.bytes_out },
+            { "direction=\"out\",layer=\"wire\"", &e.bytes_out_wire },
+        };
+        for(auto& v : values) {
+            out += "grpc_proxy_bytes_total{";
+            append_labels(out, e);
+            out += ",";
+            out += v.first;
+            out += "} ";
+            append_value(out, v.second->load(std::memory_order_relaxed));
+        }
+    });
+
+    out += "# HELP grpc_proxy_call_duration_seconds Time from receiving the request to sending the trailer.\n";
+    out += "# TYPE grpc_proxy_call_duration_seconds histogram\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        append_histogram(out, "grpc_proxy_call_duration_seconds", e, e.latency);
+    });
+
+    out += "# HELP grpc_proxy_backend_wait_seconds Time spent blocked on the completion queue.\n";
+    out += "# TYPE grpc_proxy_backend_wait_seconds histogram\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        append_histogram(out, "grpc_proxy_backend_wait_seconds", e, e.backend_wait);
+    });
+}
+
+static void append_html_escaped(std::string& out, const char* str) {
+    for(; *str; str++) {
+        switch(*str) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        default: out += *str;
+        }
+    }
+}
+
+void proxy_metrics::write_status(std::string& out, bool short_format) {
+    if(!s_table) return;
+    auto t = s_table;
+    char buf[256];
+    if(short_format) {
+        snprintf(buf, sizeof(buf), "GrpcChannelHits: %llu\nGrpcChannelMisses: %llu\nGrpcCacheHits: %llu\nGrpcCacheMisses: %llu\n",
+            static_cast<unsigned long long>(t->channel_hits.load()), static_cast<unsigned long long>(t->channel_misses.load()),
+            static_cast<unsigned long long>(t->cache_hits.load()), static_cast<unsigned long long>(t->cache_misses.load()));
+        out += buf;
+        uint64_t calls = 0, non_ok = 0;
+        int64_t in_flight = 0;
+        for_each_endpoint(t, [&](const endpoint& e) {
+            // calls is incremented before status, reading status first keeps the difference non negative
+            auto ok = e.status[0].load(std::memory_order_relaxed);
+            auto n = e.calls.load(std::memory_order_relaxed);
+            calls += n;
+            non_ok += n - ok;
+            in_flight += e.in_flight.load(std::memory_order_relaxed);
+        });
+        snprintf(buf, sizeof(buf), "GrpcCalls: %llu\nGrpcNonOkCalls: %llu\nGrpcInFlight: %lld\n",
+            static_cast<unsigned long long>(calls), static_cast<unsigned long long>(non_ok), static_cast<long long>(in_flight));
+        out += buf;
+        return;
+    }
+
+    out += "<hr />\n<h2>gRPC proxy</h2>\n";
+    snprintf(buf, sizeof(buf), "<p>Channel lookups: %llu cached, %llu created<br />Response cache: %llu hits, %llu misses</p>\n",
+        static_cast<unsigned long long>(t->channel_hits.load()), static_cast<unsigned long long>(t->channel_misses.load()),
+        static_cast<unsigned long long>(t->cache_hits.load()), static_cast<unsigned long long>(t->cache_misses.load()));
+    out += buf;
+    out += "<table border=\"0\"><tr><th>Backend</th><th>Method</th><th>Calls</th><th>In flight</th><th>Non OK</th>"
+           "<th>Bytes in (wire/grpc)</th><th>Bytes out (grpc/wire)</th><th>Avg latency</th><th>Avg backend wait</th></tr>\n";
+    for_each_endpoint(t, [&](const endpoint& e) {
+        auto ok = e.status[0].load(std::memory_order_relaxed);
+        auto calls = e.calls.load(std::memory_order_relaxed);
+        auto non_ok = calls - ok;
+        out += "<tr><td>";
+        append_html_escaped(out, e.backend);
+        out += "</td><td>";
+        append_html_escaped(out, e.method);
+        snprintf(buf, sizeof(buf), "</td><td>%llu</td><td>%lld</td><td>%llu</td><td>%llu/%llu</td><td>%llu/%llu</td><td>%.3f ms</td><td>%.3f ms</td></tr>\n",
+            static_cast<unsigned long long>(calls),
+            static_cast<long long>(e.in_flight.load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(non_ok),
+            static_cast<unsigned long long>(e.bytes_in_wire.load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(e.bytes_in.load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(e.bytes_out.load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(e.bytes_out_wire.load(std::memory_order_relaxed)),
+            calls ? e.latency.sum_us.load(std::memory_order_relaxed) / 1e3 / calls : 0.0,
+            calls ? e.backend_wait.sum_us.load(std::memory_order_relaxed) / 1e3 / calls : 0.0);
+        out += buf;
+    });
+    out += "</table>\n";
+}
+
+call_metrics::call_metrics(const char* backend, const char* method) noexcept
+    : m_backend(backend), m_method(method), m_endpoint(nullptr), m_start_us(now_us())
+{
+    if(!proxy_metrics::enabled()) return;
+    m_endpoint = proxy_metrics::find(backend, method);
+    if(!m_endpoint) m_endpoint = proxy_metrics::overflow();
+    m_endpoint->in_flight.fetch_add(1, std::memory_order_relaxed);
+}
+
+call_metrics::~call_metrics() {
+    if(!m_endpoint) return;
+    m_endpoint->in_flight.fetch_sub(1, std::memory_order_relaxed);
+    if(m_endpoint == proxy_metrics::overflow() && status >= 0 && status != status_unimplemented)
+        m_endpoint = proxy_metrics::lookup(m_backend, m_method);
+    auto& e = *m_endpoint;
+    e.calls.fetch_add(1, std::memory_order_relaxed);
+    auto idx = (status >= 0 && static_cast<size_t>(status) < proxy_metrics::num_status - 1) ? status : proxy_metrics::num_status - 1;
+    e.status[idx].fetch_add(1, std::memory_order_relaxed);
+    e.bytes_in_wire.fetch_add(bytes_in_wire, std::memory_order_relaxed);
+    e.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+    e.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+    e.bytes_out_wire.fetch_add(bytes_out_wire, std::memory_order_relaxed);
+    e.latency.observe(now_us() - m_start_us);
+    e.backend_wait.observe(backend_wait_us);
+}
@@ -2,28 +2,88 @@ extern "C" {
 #include <httpd.h>
 #include <http_config.h>
 #include <http_request.h>
+#include <util_filter.h>
+#include <http_protocol.h>
+#include <mod_status.h>
+#include <apr_shm.h>
 #include <ap_config.h>
 #include <mod_proxy.h>
+#include <ap_provider.h>
 #include <apr_base64.h>
 }
 #include <utils.h>
 #include <config.h>
 #include <grpc_proxy.h>
+#include <grpc_web.h>
+#include <grpc_web_call.h>
+#include <grpc_buckets.h>
+#include <metrics.h>
+#include <compression.h>
+#include <channel_args.h>
+#include <response_cache.h>
+#include <health_checker.h>
+#include <backend_load.h>
 #include <base64.h>
+#include <grpc/grpc.h>
 #include <grpc/support/log.h>
+#include <climits>
+#include <memory>
+#include <new>
 
 static grpc_completion_queue* create_cq() noexcept;
+// Process wide, applied when the child starts
+static size_t g_engine_threads = 0;
+static message_encoding g_backend_compression = message_encoding::identity;
+// Response cache size, the shared memory is only created if a grpcCacheMethod is configured
+static size_t g_cache_slots = 1024;
+static size_t g_cache_slot_size = 8192;
+static bool g_cache_used = false;
+static health_checker::settings g_health_settings;
+// Probes the balancer members of this child, see proxy_grpc_child_init
+static health_checker* g_health_checker = nullptr;
 static void proxy_grpc_register_hooks(apr_pool_t *p) noexcept;
 
 /** ========= Config support ========== **/
 static const char* proxy_grpc_set_max_message_size(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
 static const char* proxy_grpc_set_calltimeout(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
+static const char* proxy_grpc_set_channels_per_backend(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
+static const char* proxy_grpc_set_engine_threads(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
+static const char* proxy_grpc_set_server_timing(cmd_parms* cmd, void* cfg, int flag) noexcept;
+static const char* proxy_grpc_set_response_compression(cmd_parms* cmd, void* cfg, const char* arg, const char* min_size) noexcept;
+static const char* proxy_grpc_set_backend_compression(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
+static const char* proxy_grpc_set_channel_arg(cmd_parms* cmd, void* cfg, const char* key, const char* value) noexcept;
+static const char* proxy_grpc_set_keepalive(cmd_parms* cmd, void* cfg, const char* time, const char* timeout) noexcept;
+static const char* proxy_grpc_set_initial_window_size(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
+static const char* proxy_grpc_set_bdp_probe(cmd_parms* cmd, void* cfg, int flag) noexcept;
+static const char* proxy_grpc_set_cache_method(cmd_parms* cmd, void* cfg, int argc, char* const argv[]) noexcept;
+static const char* proxy_grpc_set_cache_size(cmd_parms* cmd, void* cfg, const char* slots, const char* slot_size) noexcept;
+static const char* proxy_grpc_set_health_check(cmd_parms* cmd, void* cfg, const char* interval, const char* timeout, const char* service) noexcept;
+static const char* proxy_grpc_set_idempotent_method(cmd_parms* cmd, void* cfg, const char* method, const char* attempts, const char* hedge_delay) noexcept;
+static const char* proxy_grpc_set_retry_budget(cmd_parms* cmd, void* cfg, const char* tokens, const char* ratio) noexcept;
+static const char* proxy_grpc_set_health_check_fails(cmd_parms* cmd, void* cfg, const char* arg) noexcept;
+static const char* proxy_grpc_set_unary_method(cmd_parms* cmd, void* cfg, const char* method) noexcept;
 static void* proxy_grpc_create_dir_conf(apr_pool_t* pool, char* context) noexcept;
 static void* proxy_grpc_merge_dir_conf(apr_pool_t* pool, void* BASE, void* ADD) noexcept;
 
 const command_rec proxy_grpc_directives[] = {
     AP_INIT_TAKE1("grpcMaxMessageSize", (cmd_func)proxy_grpc_set_max_message_size, NULL, ACCESS_CONF | RSRC_CONF, "Set GRPC Service host (and port)"),
-    AP_INIT_TAKE1("grpcCallTimeout", (cmd_func)proxy_grpc_set_calltimeout, NULL, ACCESS_CONF | RSRC_CONF, "Set call timeout"),
+    AP_INIT_TAKE1("grpcCallTimeout", (cmd_func)proxy_grpc_set_calltimeout, NULL, ACCESS_CONF | RSRC_CONF, "Set call timeout in ms, 0 leaves calls unbounded unless the client sends a grpc-timeout"),
+    AP_INIT_TAKE1("grpcChannelsPerBackend", (cmd_func)proxy_grpc_set_channels_per_backend, NULL, ACCESS_CONF | RSRC_CONF, "Set number of channels (connections) per backend"),
+    AP_INIT_FLAG("grpcServerTiming", (cmd_func)proxy_grpc_set_server_timing, NULL, ACCESS_CONF | RSRC_CONF, "Send proxy phase timings as Server-Timing header"),
+    AP_INIT_TAKE12("grpcResponseCompression", (cmd_func)proxy_grpc_set_response_compression, NULL, ACCESS_CONF | RSRC_CONF, "Compress response messages to clients accepting it (gzip, deflate or off) and the minimum message size to compress"),
+    AP_INIT_TAKE1("grpcBackendCompression", (cmd_func)proxy_grpc_set_backend_compression, NULL, RSRC_CONF, "Compress messages sent to the backends (gzip, deflate or identity)"),
+    AP_INIT_TAKE2("grpcChannelArg", (cmd_func)proxy_grpc_set_channel_arg, NULL, ACCESS_CONF | RSRC_CONF, "Set a grpc channel argument for the backend channels (key and integer or string value)"),
+    AP_INIT_TAKE12("grpcKeepAlive", (cmd_func)proxy_grpc_set_keepalive, NULL, ACCESS_CONF | RSRC_CONF, "Send keepalive pings to the backend every n ms, optionally followed by the ping timeout in ms"),
+    AP_INIT_TAKE1("grpcInitialWindowSize", (cmd_func)proxy_grpc_set_initial_window_size, NULL, ACCESS_CONF | RSRC_CONF, "Set the initial HTTP/2 stream window (lookahead) in bytes for backend channels"),
+    AP_INIT_FLAG("grpcBdpProbe", (cmd_func)proxy_grpc_set_bdp_probe, NULL, ACCESS_CONF | RSRC_CONF, "Enable or disable BDP probing to grow the HTTP/2 windows on backend channels"),
+    AP_INIT_TAKE_ARGV("grpcCacheMethod", (cmd_func)proxy_grpc_set_cache_method, NULL, ACCESS_CONF | RSRC_CONF, "Cache OK responses of a unary method: method path, ttl in seconds and request metadata keys that are part of the cache key"),
+    AP_INIT_TAKE12("grpcCacheSize", (cmd_func)proxy_grpc_set_cache_size, NULL, RSRC_CONF, "Number of response cache entries shared by all children and the maximum size of an entry in bytes"),
+    AP_INIT_TAKE23("grpcIdempotentMethod", (cmd_func)proxy_grpc_set_idempotent_method, NULL, ACCESS_CONF | RSRC_CONF, "Allow retrying a method on UNAVAILABLE: method path, attempts in total and optionally a delay in ms (or pNN for the observed percentile) after which another attempt is started in parallel"),
+    AP_INIT_TAKE12("grpcRetryBudget", (cmd_func)proxy_grpc_set_retry_budget, NULL, RSRC_CONF, "Retry tokens per backend and the tokens a successful call returns, retries and hedges stop while less than half are left"),
+    AP_INIT_TAKE123("grpcHealthCheck", (cmd_func)proxy_grpc_set_health_check, NULL, RSRC_CONF, "Probe grpc balancer members with grpc.health.v1 every n ms, optionally followed by the probe timeout in ms and the service name"),
+    AP_INIT_TAKE1("grpcHealthCheckFails", (cmd_func)proxy_grpc_set_health_check_fails, NULL, RSRC_CONF, "Number of failed health probes in a row before a backend is taken out of rotation"),
+    AP_INIT_TAKE1("grpcEngineThreads", (cmd_func)proxy_grpc_set_engine_threads, NULL, RSRC_CONF, "Set number of threads driving a shared completion queue per child (0 = queue per call)"),
+    AP_INIT_ITERATE("grpcUnaryMethod", (cmd_func)proxy_grpc_set_unary_method, NULL, ACCESS_CONF | RSRC_CONF, "Methods known to be unary (method paths), calls to them run as one batch"),
     { NULL }
 };
 
@@ -41,92 +101,124 @@ extern "C" {
 }
 
 static int proxy_grpc_handler_options(request_rec *r, proxy_worker *worker, proxy_server_conf *conf, char *url, const char *proxyname, apr_port_t proxyport) {
-    if(!grpc_proxy::is_backend_alive(proxyname)) return HTTP_SERVICE_UNAVAILABLE;
+    // Prefer the result of the background probe, only a channel is checked without one
+    auto health = health_checker::get(proxyname);
+    if(health == health_checker::state::not_serving) return HTTP_SERVICE_UNAVAILABLE;
+    if(health == health_checker::state::unknown && !grpc_proxy::is_backend_alive(proxyname)) return HTTP_SERVICE_UNAVAILABLE;
     r->status = 200;
     r->status_line = apr_pstrdup(r->pool, "OK");
     return DONE;
 }
 
-static int proxy_grpc_handler_post(request_rec *r, proxy_worker *worker, proxy_server_conf *conf, char *url, const char *proxyname, apr_port_t proxyport) {
-    const auto cfg = static_cast<const proxy_grpc_config_t*>(ap_get_module_config(r->per_dir_config, &proxy_grpc_module));
-    const auto headers_in = convert_table(r->headers_in, true);
-    
-    auto content_type = headers_in.find("content-type");
-    auto accept = headers_in.find("accept");
-    if(content_type == headers_in.end()) return DECLINED;
-    // We only support base64 encoded protobuf messages atm
-    if(strcasecmp(content_type->second.c_str(), "application/grpc-web-text") != 0) return HTTP_BAD_REQUEST;
-    // We only support base64 encoded protobuf messages atm
-    if(accept != headers_in.end() && strcasecmp(accept->second.c_str(), "application/grpc-web-text") != 0) return HTTP_BAD_REQUEST;
-
-    r->content_type = apr_pstrdup(r->pool, accept->second.c_str());
-
-    auto content_length = detect_content_length(r);
-    if(content_length < 0) return HTTP_LENGTH_REQUIRED;
-    auto max_size = cfg->max_message_size < 0 ? 4*1024*1024 : cfg->max_message_size;
-    if((content_length*3)/4 > max_size) return HTTP_REQUEST_ENTITY_TOO_LARGE;
-
-    auto str = read_body_base64(r);
-    if(str.size() >= 5) str = str.substr(5);
-    else str.clear();
-
-    grpc_proxy proxy;
-    proxy.set_call_timeout(std::max<int64_t>(cfg->call_timeout_ms, 0));
-    if(!proxy.start(proxyname, url)) return HTTP_SERVICE_UNAVAILABLE;
-    if(!proxy.send_initial_metadata(headers_in)) return HTTP_SERVICE_UNAVAILABLE;
-    if(!proxy.send_request(str.data(), str.size())) return HTTP_SERVICE_UNAVAILABLE;
-    if(!proxy.send_client_close()) return HTTP_SERVICE_UNAVAILABLE;
-    std::unordered_multimap<std::string, std::string> headers_out;
-    if(!proxy.receive_initial_metadata(headers_out)) return HTTP_SERVICE_UNAVAILABLE;
-    base64_encode_stream stream;
-    while(proxy.receive_message([&stream, r](const void* data, size_t len){
-        uint8_t hdr[5] = {};
-        hdr[1] = (len >> 24) & 0xff;
-        hdr[2] = (len >> 16) & 0xff;
-        hdr[3] = (len >> 8) & 0xff;
-        hdr[4] = (len >> 0) & 0xff;
-        std::string buf;
-        buf.reserve(base64_encode_stream::guess_encoded_size(sizeof(hdr) + len));
-        stream.feed(buf, hdr, sizeof(hdr));
-        stream.feed(buf, data, len);
-        stream.flush(buf);
-        ap_rwrite(buf.data(), buf.size(), r);
-        ap_rflush(r);
-    }));
-    grpc_proxy::status status;
-    if(!proxy.receive_status(status)) return HTTP_SERVICE_UNAVAILABLE;
-    // Write trailer
-    {
-        std::string trailer;
-        trailer += "grpc-status:";
-        trailer += std::to_string(status.status);
-        trailer += "\r\ngrpc-message:";
-        trailer += status.details;
-        if(!status.error.empty()) {
-            trailer += "\r\ngrpc-error:";
-            trailer += status.error;
-        }
-        trailer += "\r\n";
-        for(auto& e : status.metadata) {
-            trailer += e.first + ":" + e.second + "\r\n";
+static apr_status_t pass_brigade(request_rec* r, apr_bucket_brigade* bb) {
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(bb->bucket_alloc));
+    auto rv = ap_pass_brigade(r->output_filters, bb);
+    apr_brigade_cleanup(bb);
+    return rv;
+}
+
+static void set_timing_note(request_rec* r, const call_timing& timing) {
+    char buf[256];
+    auto len = timing.format_note(buf, sizeof(buf));
+    apr_table_setn(r->notes, "grpc-timing", apr_pstrndup(r->pool, buf, len));
+}
+
+/**
+ * Add backend metadata to table (the response headers or trailers). Entries of headers are allocated
+ * from r->pool and zero terminated, so they are added without copying. -bin values are base64 encoded.
+ */
+static void copy_metadata(request_rec* r, apr_table_t* table, const header_list& headers) {
+    for(auto& e : headers) {
+        if(is_reserved_header(e.key, e.key_len)) continue;
+        if(is_binary_header(e.key, e.key_len)) {
+            auto buf = static_cast<char*>(apr_palloc(r->pool, base64_encode_stream::max_encoded_size(e.value_len) + 1));
+            base64_encode_stream enc;
+            auto len = enc.feed(buf, e.value, e.value_len);
+            len += enc.flush(buf + len);
+            buf[len] = '\0';
+            apr_table_addn(table, e.key, buf);
+        } else {
+            apr_table_addn(table, e.key, e.value);
         }
+    }
+}
 
-        auto len = trailer.size();
-        uint8_t hdr[5] = {};
-        hdr[0] = 0x80;
-        hdr[1] = (len >> 24) & 0xff;
-        hdr[2] = (len >> 16) & 0xff;
-        hdr[3] = (len >> 8) & 0xff;
-        hdr[4] = (len >> 0) & 0xff;
-        std::string buf;
-        buf.reserve(base64_encode_stream::guess_encoded_size(sizeof(hdr) + len));
-        stream.feed(buf, hdr, sizeof(hdr));
-        stream.feed(buf, trailer.data(), trailer.size());
-        stream.flush(buf);
-        ap_rwrite(buf.data(), buf.size(), r);
-        ap_rflush(r);
+// Map the backend initial metadata onto the response headers
+static void copy_response_headers(request_rec* r, const header_list& headers) {
+    copy_metadata(r, r->headers_out, headers);
+}
+
+/**
+ * Status and trailing metadata of a plain grpc call as HTTP/2 trailers, mod_http2 sends r->trailers_out
+ * after the last data frame.
+ */
+static void set_response_trailers(request_rec* r, const grpc_proxy::status& status) {
+    apr_table_setn(r->trailers_out, "grpc-status", apr_itoa(r->pool, status.status));
+    if(!status.details.empty())
+        apr_table_setn(r->trailers_out, "grpc-message", apr_pstrdup(r->pool, grpc_percent_encode(status.details).c_str()));
+    copy_metadata(r, r->trailers_out, status.metadata);
+}
+
+/**
+ * Writes the response of a grpc_web_call to the output filters of r.
+ */
+class request_sink : public grpc_web_sink {
+    request_rec* m_r;
+    const proxy_grpc_config_t* m_cfg;
+    apr_bucket_brigade* m_bb;
+    apr_socket_t* m_socket;
+public:
+    request_sink(request_rec* r, const proxy_grpc_config_t* cfg)
+        : m_r(r), m_cfg(cfg), m_bb(apr_brigade_create(r->pool, r->connection->bucket_alloc)),
+          m_socket(ap_get_conn_socket(r->connection))
+    {}
+
+    void start_response(const header_list& metadata, message_encoding encoding, const call_timing& timing) override {
+        copy_response_headers(m_r, metadata);
+        if(encoding != message_encoding::identity)
+            apr_table_setn(m_r->headers_out, "grpc-encoding", message_encoding_name(encoding));
+        if(!m_cfg->server_timing) return;
+        char buf[256];
+        auto len = timing.format_server_timing(buf, sizeof(buf), false);
+        apr_table_setn(m_r->headers_out, "Server-Timing", apr_pstrndup(m_r->pool, buf, len));
+    }
+    void append_frame(uint8_t flags, grpc_byte_buffer* msg, bool text) override {
+        if(text) append_frame_base64(m_bb, flags, msg);
+        else ::append_frame(m_bb, flags, msg);
     }
+    void append_frame(uint8_t flags, const void* data, size_t len, bool text) override {
+        if(text) append_frame_base64(m_bb, flags, data, len);
+        else ::append_frame(m_bb, flags, data, len);
+    }
+    bool flush() override { return pass_brigade(m_r, m_bb) == APR_SUCCESS; }
+    void set_trailers(const grpc_proxy::status& status) override { set_response_trailers(m_r, status); }
+    bool aborted() override { return m_r->connection->aborted; }
+    bool disconnected() override { return m_socket && !ap_proxy_is_socket_connected(m_socket); }
+};
 
+static int proxy_grpc_handler_post(request_rec *r, proxy_worker *worker, proxy_server_conf *conf, char *url, const char *proxyname, apr_port_t proxyport) {
+    const auto cfg = static_cast<const proxy_grpc_config_t*>(ap_get_module_config(r->per_dir_config, &proxy_grpc_module));
+    const auto headers_in = convert_table(r->headers_in, r->pool);
+    if(!headers_in.find("content-type")) return DECLINED;
+
+    request_sink sink(r, cfg);
+    grpc_web_call call(*cfg, sink, proxyname, url, pool_alloc, r->pool);
+    auto res = call.begin(headers_in, r->proto_num >= HTTP_VERSION(2, 0));
+    if(res != 0) return res;
+    r->content_type = grpc_web_content_type_name(call.response_type());
+
+    // Bodies of unknown length (chunked or h2) are fine, the frame reader enforces the size limit per message
+    auto rv = read_body([&call](const char* data, size_t len) { return call.feed(data, len); }, r);
+    // A body cut short by the client or the input filters maps to 400, a read timeout to 408
+    res = rv == APR_SUCCESS ? call.finish() : call.abort_body(ap_map_http_request_error(rv, HTTP_BAD_REQUEST));
+    set_timing_note(r, call.timing());
+    if(res != 0) return res;
+    if(call.completed() && cfg->server_timing) {
+        // Complete timing, only reaches clients on protocols with http trailers (h2)
+        char buf[256];
+        auto len = call.timing().format_server_timing(buf, sizeof(buf), true);
+        apr_table_setn(r->trailers_out, "Server-Timing", apr_pstrndup(r->pool, buf, len));
+    }
     return DONE;
 }
 
@@ -147,6 +239,132 @@ static int proxy_grpc_handler(request_rec *r, proxy_worker *worker, proxy_server
     } else return DECLINED;
 }
 
+/** ========= Load balancing ========== **/
+
+/**
+ * Score of a balancer member, lower is better: the calls the backend would have in flight with this one
+ * scaled by its average latency and divided by its lbfactor. Backends without a latency sample yet
+ * count with default_latency.
+ */
+static double grpc_leastcalls_score(proxy_worker* worker, double default_latency) noexcept {
+    char host[128];
+    snprintf(host, sizeof(host), "%s:%u", worker->s->hostname, static_cast<unsigned>(worker->s->port));
+    auto load = backend_load::find(host);
+    double calls = 1;
+    double latency = default_latency;
+    if(load) {
+        calls += std::max<int64_t>(load->in_flight.load(std::memory_order_relaxed), 0);
+        auto avg = load->latency_us.load(std::memory_order_relaxed);
+        if(avg != 0) latency = avg;
+    }
+    return calls * latency / std::max(worker->s->lbfactor, 1);
+}
+
+static proxy_worker* proxy_grpc_find_least_calls(proxy_balancer* balancer, request_rec* r) noexcept {
+    auto workers = reinterpret_cast<proxy_worker**>(balancer->workers->elts);
+    auto nworkers = balancer->workers->nelts;
+
+    // Unknown backends are assumed to be as fast as the average of the known ones
+    double latency_sum = 0;
+    int latency_count = 0;
+    for(int i = 0; i < nworkers; i++) {
+        char host[128];
+        snprintf(host, sizeof(host), "%s:%u", workers[i]->s->hostname, static_cast<unsigned>(workers[i]->s->port));
+        auto load = backend_load::find(host);
+        auto avg = load ? load->latency_us.load(std::memory_order_relaxed) : 0;
+        if(avg == 0) continue;
+        latency_sum += avg;
+        latency_count++;
+    }
+    auto default_latency = latency_count ? latency_sum / latency_count : 1.0;
+
+    // Same as the builtin methods: the lowest lbset with a usable member wins, standby members only if there is no other
+    proxy_worker* best = nullptr;
+    double best_score = 0;
+    for(int standby = 0; standby < 2 && !best; standby++) {
+        int best_lbset = INT_MAX;
+        for(int i = 0; i < nworkers; i++) {
+            auto worker = workers[i];
+            if(!PROXY_WORKER_IS_USABLE(worker)) ap_proxy_retry_worker("BALANCER", worker, r->server);
+            if(!PROXY_WORKER_IS_USABLE(worker)) continue;
+            if((PROXY_WORKER_IS_STANDBY(worker) ? 1 : 0) != standby) continue;
+            if(worker->s->lbset > best_lbset) continue;
+            auto score = grpc_leastcalls_score(worker, default_latency);
+            // Ties go to the member elected least often, which spreads the load while nothing is known yet
+            if(!best || worker->s->lbset < best_lbset || score < best_score
+                || (score == best_score && worker->s->elected < best->s->elected)) {
+                best = worker;
+                best_score = score;
+                best_lbset = worker->s->lbset;
+            }
+        }
+    }
+    if(best) best->s->elected++;
+    return best;
+}
+
+static apr_status_t proxy_grpc_lb_reset(proxy_balancer* balancer, server_rec* s) noexcept {
+    return APR_SUCCESS;
+}
+
+static apr_status_t proxy_grpc_lb_age(proxy_balancer* balancer, server_rec* s) noexcept {
+    return APR_SUCCESS;
+}
+
+static const proxy_balancer_method proxy_grpc_leastcalls = {
+    "grpc_leastcalls",
+    proxy_grpc_find_least_calls,
+    NULL,
+    proxy_grpc_lb_reset,
+    proxy_grpc_lb_age
+};
+
+#ifdef PROXY_WORKER_HC_FAIL
+// Only cleared by a health check, unlike the error state mod_proxy retries on its own
+#define GRPC_WORKER_HEALTH_FAIL PROXY_WORKER_HC_FAIL
+#else
+#define GRPC_WORKER_HEALTH_FAIL PROXY_WORKER_IN_ERROR
+#endif
+
+/**
+ * Probe every grpc:// balancer member and mirror the result in the (shared) worker status,
+ * so mod_proxy_balancer skips failed backends.
+ */
+static void start_health_checker(server_rec* s) noexcept {
+    std::unique_ptr<health_checker> checker(new (std::nothrow) health_checker());
+    if(!checker) return;
+    try {
+        for(auto sp = s; sp; sp = sp->next) {
+            auto conf = static_cast<proxy_server_conf*>(ap_get_module_config(sp->module_config, &proxy_module));
+            if(!conf || !conf->balancers) continue;
+            auto balancers = reinterpret_cast<proxy_balancer*>(conf->balancers->elts);
+            for(int i = 0; i < conf->balancers->nelts; i++) {
+                auto workers = reinterpret_cast<proxy_worker**>(balancers[i].workers->elts);
+                for(int x = 0; x < balancers[i].workers->nelts; x++) {
+                    auto worker = workers[x];
+                    if(strcasecmp(worker->s->scheme, "grpc") != 0) continue;
+                    auto host = std::string(worker->s->hostname) + ":" + std::to_string(worker->s->port);
+                    checker->add(host, [worker, sp](const std::string& host, health_checker::state state) {
+                        if(state == health_checker::state::not_serving) {
+                            if(!(worker->s->status & GRPC_WORKER_HEALTH_FAIL))
+                                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, sp, "grpc backend %s failed its health check", host.c_str());
+                            worker->s->status |= GRPC_WORKER_HEALTH_FAIL;
+                            worker->s->error_time = apr_time_now();
+                        } else if(state == health_checker::state::serving) {
+                            worker->s->status &= ~GRPC_WORKER_HEALTH_FAIL;
+                        }
+                    });
+                }
+            }
+        }
+        checker->start(g_health_settings);
+    } catch(const std::exception& e) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Failed to start grpc health checks: %s", e.what());
+        return;
+    }
+    g_health_checker = checker.release();
+}
+
 static void proxy_grpc_child_init(apr_pool_t *pchild, server_rec *s) noexcept {
     static server_rec* server = s;
     gpr_set_log_function([](gpr_log_func_args *args) {
@@ -161,25 +379,135 @@ static void proxy_grpc_child_init(apr_pool_t *pchild, server_rec *s) noexcept {
         }
         ap_log_error(fname, args->line, APLOG_MODULE_INDEX, level, 0, server, "%s", args->message);
     });
-    grpc_proxy::process_init();
+    grpc_proxy::process_init(g_engine_threads, g_backend_compression);
+    if(g_health_settings.interval_ms != 0) start_health_checker(s);
     apr_pool_cleanup_register(pchild, nullptr, [](void*)->apr_status_t{
+        if(g_health_checker) {
+            g_health_checker->stop();
+            delete g_health_checker;
+            g_health_checker = nullptr;
+        }
         grpc_proxy::process_deinit();
+        return APR_SUCCESS;
     }, apr_pool_cleanup_null);
 }
 
+static int proxy_grpc_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) noexcept {
+    // Created before the children fork so all of them share the same table
+    apr_shm_t* shm = nullptr;
+    auto rv = apr_shm_create(&shm, proxy_metrics::shm_size(), nullptr, pconf);
+    if(rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to create shared memory for metrics, metrics are disabled");
+        proxy_metrics::attach(nullptr);
+    } else {
+        proxy_metrics::attach(apr_shm_baseaddr_get(shm));
+    }
+
+    response_cache::attach(nullptr, 0, 0);
+    if(g_cache_used) {
+        apr_shm_t* cache_shm = nullptr;
+        rv = apr_shm_create(&cache_shm, response_cache::shm_size(g_cache_slots, g_cache_slot_size), nullptr, pconf);
+        if(rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to create shared memory for the response cache, caching is disabled");
+        } else {
+            response_cache::attach(apr_shm_baseaddr_get(cache_shm), g_cache_slots, g_cache_slot_size);
+        }
+    }
+
+    backend_load::attach(nullptr);
+    apr_shm_t* load_shm = nullptr;
+    rv = apr_shm_create(&load_shm, backend_load::shm_size(), nullptr, pconf);
+    if(rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to create shared memory for backend load, grpc_leastcalls balances by elections only");
+    } else {
+        backend_load::attach(apr_shm_baseaddr_get(load_shm));
+    }
+
+    health_checker::attach(nullptr);
+    if(g_health_settings.interval_ms != 0) {
+        apr_shm_t* health_shm = nullptr;
+        rv = apr_shm_create(&health_shm, health_checker::shm_size(), nullptr, pconf);
+        if(rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to create shared memory for health checks, every child probes on its own");
+        } else {
+            health_checker::attach(apr_shm_baseaddr_get(health_shm));
+        }
+    }
+    return OK;
+}
+
+static int proxy_grpc_status_hook(request_rec *r, int flags) noexcept {
+    if(!proxy_metrics::enabled()) return OK;
+    std::string out;
+    proxy_metrics::write_status(out, (flags & AP_STATUS_SHORT) != 0);
+    ap_rputs(out.c_str(), r);
+    return OK;
+}
+
+static int proxy_grpc_metrics_handler(request_rec *r) noexcept {
+    if(!r->handler || strcmp(r->handler, "grpc-metrics") != 0) return DECLINED;
+    if(r->method_number != M_GET) return HTTP_METHOD_NOT_ALLOWED;
+    if(!proxy_metrics::enabled()) return HTTP_NOT_FOUND;
+    ap_set_content_type(r, "text/plain; version=0.0.4");
+    if(r->header_only) return OK;
+    std::string out;
+    proxy_metrics::write_prometheus(out);
+    ap_rwrite(out.data(), out.size(), r);
+    return OK;
+}
+
 static void proxy_grpc_register_hooks(apr_pool_t *p) noexcept {
     proxy_hook_scheme_handler(proxy_grpc_handler, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_post_config(proxy_grpc_post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(proxy_grpc_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(proxy_grpc_metrics_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, proxy_grpc_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_register_provider(p, PROXY_LBMETHOD, "grpc_leastcalls", "0", &proxy_grpc_leastcalls);
 }
 
 /** ========= Config support ========== **/
 
+static apr_status_t destroy_channel_args(void* args) noexcept {
+    delete static_cast<channel_args*>(args);
+    return APR_SUCCESS;
+}
+
+static channel_args* create_channel_args(apr_pool_t* pool) noexcept {
+    auto args = new (std::nothrow) channel_args();
+    if(args) apr_pool_cleanup_register(pool, args, destroy_channel_args, apr_pool_cleanup_null);
+    return args;
+}
+
+// Channel arguments of config, created on first use
+static channel_args* get_channel_args(apr_pool_t* pool, proxy_grpc_config_t* config) noexcept {
+    if(!config->backend_args) config->backend_args = create_channel_args(pool);
+    return config->backend_args;
+}
+
+/**
+ * Arguments of both, add overriding base per key. Per-dir configs are merged on every request, the result
+ * is only built once per pair and kept by add (along with its id and hash for the channel registry).
+ */
+static channel_args* merge_channel_args(channel_args* add, channel_args* base) noexcept {
+    if(!add) return base;
+    if(!base) return add;
+    auto res = add->merged_over(*base);
+    return res ? res : add;
+}
+
 static const char* proxy_grpc_set_max_message_size(cmd_parms* cmd, void* cfg, const char* arg) noexcept {
     auto* config = static_cast<proxy_grpc_config_t*>(cfg);
     if(config) {
         config->max_message_size = strtol(arg, nullptr, 10);
         if(config->max_message_size < 1024)
             config->max_message_size = 1024;
+        if(config->max_message_size > INT_MAX)
+            config->max_message_size = INT_MAX;
+        // Responses from the backend are bound by the same limit
+        auto args = get_channel_args(cmd->pool, config);
+        if(!args) return "Out of memory";
+        args->set(GRPC_ARG_MAX_RECEIVE_MESSAGE_LENGTH, static_cast<int>(config->max_message_size));
+        args->set(GRPC_ARG_MAX_SEND_MESSAGE_LENGTH, static_cast<int>(config->max_message_size));
     }
     return nullptr;
 }
@@ -194,12 +522,222 @@ static const char* proxy_grpc_set_calltimeout(cmd_parms* cmd, void* cfg, const c
     return nullptr;
 }
 
+static const char* proxy_grpc_set_channels_per_backend(cmd_parms* cmd, void* cfg, const char* arg) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(config) {
+        config->channels_per_backend = strtol(arg, nullptr, 10);
+        if(config->channels_per_backend < 1)
+            config->channels_per_backend = 1;
+        if(config->channels_per_backend > 64)
+            config->channels_per_backend = 64;
+    }
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_engine_threads(cmd_parms* cmd, void* cfg, const char* arg) noexcept {
+    auto err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if(err) return err;
+    auto n = strtol(arg, nullptr, 10);
+    if(n < 0) n = 0;
+    if(n > 64) n = 64;
+    g_engine_threads = n;
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_server_timing(cmd_parms* cmd, void* cfg, int flag) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(config) config->server_timing = flag != 0;
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_response_compression(cmd_parms* cmd, void* cfg, const char* arg, const char* min_size) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    message_encoding enc = message_encoding::identity;
+    if(strcasecmp(arg, "off") != 0 && !parse_message_encoding(arg, strlen(arg), enc))
+        return "grpcResponseCompression must be one of gzip, deflate or off";
+    config->response_compression = static_cast<int64_t>(enc) + 1;
+    if(min_size) {
+        config->response_compression_min_size = strtol(min_size, nullptr, 10);
+        if(config->response_compression_min_size < 1)
+            config->response_compression_min_size = 1;
+    }
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_backend_compression(cmd_parms* cmd, void* cfg, const char* arg) noexcept {
+    auto err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if(err) return err;
+    if(!parse_message_encoding(arg, strlen(arg), g_backend_compression))
+        return "grpcBackendCompression must be one of gzip, deflate or identity";
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_channel_arg(cmd_parms* cmd, void* cfg, const char* key, const char* value) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    auto args = get_channel_args(cmd->pool, config);
+    if(!args) return "Out of memory";
+    args->set(key, value);
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_keepalive(cmd_parms* cmd, void* cfg, const char* time, const char* timeout) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    auto time_ms = strtol(time, nullptr, 10);
+    if(time_ms < 1000 || time_ms > INT_MAX) return "grpcKeepAlive interval needs to be between 1000 and 2147483647 ms";
+    auto timeout_ms = timeout ? strtol(timeout, nullptr, 10) : 20000;
+    if(timeout_ms < 1 || timeout_ms > INT_MAX) return "grpcKeepAlive timeout needs to be between 1 and 2147483647 ms";
+    auto args = get_channel_args(cmd->pool, config);
+    if(!args) return "Out of memory";
+    args->set(GRPC_ARG_KEEPALIVE_TIME_MS, static_cast<int>(time_ms));
+    args->set(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, static_cast<int>(timeout_ms));
+    // Keep idle connections alive as well, that is what avoids the reconnect on the next call
+    args->set(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    args->set(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_initial_window_size(cmd_parms* cmd, void* cfg, const char* arg) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    auto size = strtol(arg, nullptr, 10);
+    if(size < 65535 || size > INT_MAX) return "grpcInitialWindowSize needs to be between 65535 and 2147483647";
+    auto args = get_channel_args(cmd->pool, config);
+    if(!args) return "Out of memory";
+    args->set(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, static_cast<int>(size));
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_bdp_probe(cmd_parms* cmd, void* cfg, int flag) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    auto args = get_channel_args(cmd->pool, config);
+    if(!args) return "Out of memory";
+    args->set(GRPC_ARG_HTTP2_BDP_PROBE, flag ? 1 : 0);
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_cache_method(cmd_parms* cmd, void* cfg, int argc, char* const argv[]) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    if(argc < 2) return "grpcCacheMethod needs a method path and a ttl in seconds";
+    if(argv[0][0] != '/') return "grpcCacheMethod method needs to be a path like /package.Service/Method";
+    auto ttl = strtol(argv[1], nullptr, 10);
+    if(ttl < 1) return "grpcCacheMethod ttl needs to be at least one second";
+    auto method = pool_calloc<proxy_grpc_cache_method_t>(cmd->pool);
+    method->method = argv[0];
+    method->ttl_ms = static_cast<int64_t>(ttl) * 1000;
+    method->num_keys = argc - 2;
+    method->metadata_keys = static_cast<const char**>(apr_pcalloc(cmd->pool, sizeof(const char*) * (method->num_keys + 1)));
+    for(size_t i = 0; i < method->num_keys; i++) {
+        auto key = apr_pstrdup(cmd->pool, argv[i + 2]);
+        ap_str_tolower(key);
+        method->metadata_keys[i] = key;
+    }
+    method->next = config->cache_methods;
+    config->cache_methods = method;
+    g_cache_used = true;
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_cache_size(cmd_parms* cmd, void* cfg, const char* slots, const char* slot_size) noexcept {
+    auto err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if(err) return err;
+    auto n = strtol(slots, nullptr, 10);
+    if(n < static_cast<long>(response_cache::ways)) return "grpcCacheSize needs at least 4 entries";
+    g_cache_slots = n;
+    if(slot_size) {
+        auto size = strtol(slot_size, nullptr, 10);
+        if(size < 512 || size > 16 * 1024 * 1024) return "grpcCacheSize entry size needs to be between 512 bytes and 16 MiB";
+        g_cache_slot_size = size;
+    }
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_idempotent_method(cmd_parms* cmd, void* cfg, const char* method, const char* attempts, const char* hedge_delay) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    if(method[0] != '/') return "grpcIdempotentMethod method needs to be a path like /package.Service/Method";
+    auto n = strtol(attempts, nullptr, 10);
+    if(n < 1 || n > static_cast<long>(grpc_proxy::retry_policy::attempts_limit)) return "grpcIdempotentMethod attempts need to be between 1 and 5";
+    auto entry = pool_calloc<proxy_grpc_retry_method_t>(cmd->pool);
+    entry->method = method;
+    entry->max_attempts = n;
+    if(hedge_delay) {
+        char* end = nullptr;
+        if(hedge_delay[0] == 'p' || hedge_delay[0] == 'P') {
+            entry->hedge_percentile = strtod(hedge_delay + 1, &end);
+            if(*end != '\0' || entry->hedge_percentile <= 0 || entry->hedge_percentile >= 100)
+                return "grpcIdempotentMethod hedge percentile needs to be like p95";
+        } else {
+            entry->hedge_delay_ms = strtol(hedge_delay, &end, 10);
+            if(*end != '\0' || entry->hedge_delay_ms < 1) return "grpcIdempotentMethod hedge delay needs to be at least 1 ms";
+        }
+    }
+    entry->next = config->retry_methods;
+    config->retry_methods = entry;
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_retry_budget(cmd_parms* cmd, void* cfg, const char* tokens, const char* ratio) noexcept {
+    auto err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if(err) return err;
+    auto n = strtol(tokens, nullptr, 10);
+    if(n < 1 || n > 1000) return "grpcRetryBudget tokens need to be between 1 and 1000";
+    grpc_web_call::retry_tokens = n;
+    if(ratio) {
+        auto r = strtod(ratio, nullptr);
+        if(r <= 0 || r > 1) return "grpcRetryBudget token ratio needs to be above 0 and at most 1";
+        grpc_web_call::retry_ratio = r;
+    }
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_health_check(cmd_parms* cmd, void* cfg, const char* interval, const char* timeout, const char* service) noexcept {
+    auto err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if(err) return err;
+    auto interval_ms = strtol(interval, nullptr, 10);
+    if(interval_ms < 0) return "grpcHealthCheck interval can not be negative";
+    g_health_settings.interval_ms = interval_ms;
+    if(timeout) {
+        auto timeout_ms = strtol(timeout, nullptr, 10);
+        if(timeout_ms < 1) return "grpcHealthCheck timeout needs to be at least 1 ms";
+        g_health_settings.timeout_ms = timeout_ms;
+    }
+    g_health_settings.service = service ? service : "";
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_health_check_fails(cmd_parms* cmd, void* cfg, const char* arg) noexcept {
+    auto err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if(err) return err;
+    auto n = strtol(arg, nullptr, 10);
+    if(n < 1) return "grpcHealthCheckFails needs to be at least 1";
+    g_health_settings.fails = n;
+    return nullptr;
+}
+
+static const char* proxy_grpc_set_unary_method(cmd_parms* cmd, void* cfg, const char* method) noexcept {
+    auto* config = static_cast<proxy_grpc_config_t*>(cfg);
+    if(!config) return nullptr;
+    if(method[0] != '/') return "grpcUnaryMethod method needs to be a path like /package.Service/Method";
+    auto entry = pool_calloc<proxy_grpc_unary_method_t>(cmd->pool);
+    entry->method = method;
+    entry->next = config->unary_methods;
+    config->unary_methods = entry;
+    return nullptr;
+}
+
 static void* proxy_grpc_create_dir_conf(apr_pool_t* pool, char* context) noexcept {
     auto config = pool_calloc<proxy_grpc_config_t>(pool);
 
     if(config) {
         config->call_timeout_ms = -1;
         config->max_message_size = -1;
+        config->channels_per_backend = -1;
+        config->response_compression_min_size = -1;
     }
 
     return config;
@@ -212,6 +750,14 @@ static void* proxy_grpc_merge_dir_conf(apr_pool_t* pool, void* BASE, void* ADD)
 
     conf->call_timeout_ms = config_merge(add->call_timeout_ms, base->call_timeout_ms);
     conf->max_message_size = config_merge(add->max_message_size, base->max_message_size);
+    conf->channels_per_backend = config_merge(add->channels_per_backend, base->channels_per_backend);
+    conf->server_timing = config_merge(add->server_timing, base->server_timing);
+    conf->response_compression = config_merge(add->response_compression, base->response_compression);
+    conf->response_compression_min_size = config_merge(add->response_compression_min_size, base->response_compression_min_size);
+    conf->backend_args = merge_channel_args(add->backend_args, base->backend_args);
+    conf->cache_methods = add->cache_methods ? add->cache_methods : base->cache_methods;
+    conf->retry_methods = add->retry_methods ? add->retry_methods : base->retry_methods;
+    conf->unary_methods = add->unary_methods ? add->unary_methods : base->unary_methods;
 
     return conf;
 }
@@ -0,0 +1,231 @@
+#include <response_cache.h>
+#include <grpc/grpc.h>
+#include <grpc/byte_buffer.h>
+#include <grpc/byte_buffer_reader.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+unsigned char* response_cache::s_base = nullptr;
+size_t response_cache::s_slots = 0;
+size_t response_cache::s_slot_size = 0;
+
+namespace {
+    constexpr uint64_t fnv_offset = 0xcbf29ce484222325ull;
+    constexpr uint64_t fnv_prime = 0x100000001b3ull;
+
+    uint64_t fnv1a(uint64_t h, const void* data, size_t len) noexcept {
+        auto p = static_cast<const unsigned char*>(data);
+        for(size_t i = 0; i < len; i++) {
+            h ^= p[i];
+            h *= fnv_prime;
+        }
+        return h;
+    }
+
+    uint64_t now_ms() noexcept {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void put_u32(std::string& out, uint32_t v) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    bool get_u32(const char*& p, const char* end, uint32_t& v) noexcept {
+        if(static_cast<size_t>(end - p) < sizeof(v)) return false;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return true;
+    }
+
+    void put_headers(std::string& out, const header_list& headers) {
+        put_u32(out, static_cast<uint32_t>(headers.size()));
+        for(auto& e : headers) {
+            put_u32(out, static_cast<uint32_t>(e.key_len));
+            put_u32(out, static_cast<uint32_t>(e.value_len));
+            out.append(e.key, e.key_len);
+            out.append(e.value, e.value_len);
+        }
+    }
+
+    bool get_headers(const char*& p, const char* end, header_list& out) {
+        uint32_t count;
+        if(!get_u32(p, end, count)) return false;
+        for(uint32_t i = 0; i < count; i++) {
+            uint32_t key_len, value_len;
+            if(!get_u32(p, end, key_len) || !get_u32(p, end, value_len)) return false;
+            if(static_cast<size_t>(end - p) < static_cast<size_t>(key_len) + value_len) return false;
+            out.add_copy(p, key_len, p + key_len, value_len);
+            p += key_len + value_len;
+        }
+        return true;
+    }
+
+    // The directive value of name in a grpc-cache-control style list, nullptr if not present
+    const char* find_directive(const char* value, size_t len, const char* name, size_t name_len, size_t& arg_len) noexcept {
+        auto end = value + len;
+        while(value < end) {
+            while(value < end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+            auto token_end = value;
+            while(token_end < end && *token_end != ',') token_end++;
+            auto eq = static_cast<const char*>(memchr(value, '=', token_end - value));
+            auto name_end = eq ? eq : token_end;
+            while(name_end > value && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+            if(static_cast<size_t>(name_end - value) == name_len && strncasecmp(value, name, name_len) == 0) {
+                auto arg = eq ? eq + 1 : token_end;
+                arg_len = token_end - arg;
+                return arg;
+            }
+            value = token_end;
+        }
+        return nullptr;
+    }
+}
+
+size_t response_cache::shm_size(size_t slots, size_t slot_size) noexcept {
+    return (slots - slots % ways) * slot_size;
+}
+
+void response_cache::attach(void* mem, size_t slots, size_t slot_size) noexcept {
+    slots -= slots % ways;
+    if(!mem || slots == 0 || slot_size <= sizeof(slot)) {
+        s_base = nullptr;
+        s_slots = 0;
+        return;
+    }
+    s_base = static_cast<unsigned char*>(mem);
+    s_slots = slots;
+    s_slot_size = slot_size;
+    memset(s_base, 0, shm_size(slots, slot_size));
+}
+
+response_cache::slot* response_cache::get_slot(size_t idx) noexcept {
+    return reinterpret_cast<slot*>(s_base + idx * s_slot_size);
+}
+
+std::string response_cache::make_key(const char* backend, const char* method, const header_list& headers,
+                                     const char* const* metadata_keys, size_t num_keys, grpc_byte_buffer* request) {
+    std::string key;
+    key.append(backend ? backend : "");
+    key += '\0';
+    key.append(method ? method : "");
+    key += '\0';
+    for(size_t i = 0; i < num_keys; i++) {
+        // Absent and empty metadata must not share a key
+        auto e = headers.find(metadata_keys[i]);
+        if(e) {
+            key += '=';
+            key.append(e->value, e->value_len);
+        }
+        key += '\0';
+    }
+
+    // The whole message rather than a digest of it, lookup compares keys byte for byte. It comes last, so
+    // the metadata terminators already delimit it
+    if(request) {
+        key.reserve(key.size() + grpc_byte_buffer_length(request));
+        grpc_byte_buffer_reader reader;
+        if(grpc_byte_buffer_reader_init(&reader, request)) {
+            grpc_slice s;
+            while(grpc_byte_buffer_reader_next(&reader, &s)) {
+                key.append(reinterpret_cast<const char*>(GRPC_SLICE_START_PTR(s)), GRPC_SLICE_LENGTH(s));
+                grpc_slice_unref(s);
+            }
+            grpc_byte_buffer_reader_destroy(&reader);
+        }
+    }
+    return key;
+}
+
+uint64_t response_cache::allowed_ttl(const header_list& headers, const header_list& trailers, uint64_t ttl_ms) noexcept {
+    for(auto list : { &headers, &trailers }) {
+        for(auto& e : *list) {
+            if(!e.key_equals("grpc-cache-control", 18)) continue;
+            size_t arg_len;
+            if(find_directive(e.value, e.value_len, "no-store", 8, arg_len)
+                || find_directive(e.value, e.value_len, "no-cache", 8, arg_len)
+                || find_directive(e.value, e.value_len, "private", 7, arg_len))
+                return 0;
+            auto arg = find_directive(e.value, e.value_len, "max-age", 7, arg_len);
+            if(arg) {
+                uint64_t max_age = 0;
+                for(size_t i = 0; i < arg_len && arg[i] >= '0' && arg[i] <= '9'; i++) max_age = max_age * 10 + (arg[i] - '0');
+                if(max_age * 1000 < ttl_ms) ttl_ms = max_age * 1000;
+            }
+        }
+    }
+    return ttl_ms;
+}
+
+bool response_cache::lookup(const std::string& key, entry& out) {
+    if(!s_base) return false;
+    auto hash = fnv1a(fnv_offset, key.data(), key.size());
+    auto set = (hash % (s_slots / ways)) * ways;
+    auto now = now_ms();
+    const auto max_payload = s_slot_size - sizeof(slot);
+    std::string copy;
+    for(size_t i = 0; i < ways; i++) {
+        auto s = get_slot(set + i);
+        auto seq = s->seq.load(std::memory_order_acquire);
+        if(seq & 1) continue;
+        if(s->hash != hash || s->expires <= now || s->key_len != key.size()) continue;
+        size_t data_len = s->data_len;
+        if(key.size() + data_len > max_payload) continue;
+        auto payload = reinterpret_cast<const char*>(s + 1);
+        copy.assign(payload, key.size() + data_len);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // The slot was rewritten while copying
+        if(s->seq.load(std::memory_order_relaxed) != seq) continue;
+        if(copy.compare(0, key.size(), key) != 0) continue;
+
+        const char* p = copy.data() + key.size();
+        const char* end = copy.data() + copy.size();
+        uint32_t has_message, message_len;
+        if(!get_headers(p, end, out.headers) || !get_headers(p, end, out.trailers)) return false;
+        if(!get_u32(p, end, has_message) || !get_u32(p, end, message_len)) return false;
+        if(static_cast<size_t>(end - p) != message_len) return false;
+        out.has_message = has_message != 0;
+        out.message.assign(p, message_len);
+        return true;
+    }
+    return false;
+}
+
+void response_cache::store(const std::string& key, uint64_t ttl_ms, const header_list& headers, const header_list& trailers,
+                           const void* message, size_t message_len, bool has_message) {
+    if(!s_base || ttl_ms == 0) return;
+    std::string data;
+    put_headers(data, headers);
+    put_headers(data, trailers);
+    put_u32(data, has_message ? 1 : 0);
+    put_u32(data, static_cast<uint32_t>(message_len));
+    data.append(static_cast<const char*>(message), message_len);
+    if(key.size() + data.size() > s_slot_size - sizeof(slot)) return;
+
+    auto hash = fnv1a(fnv_offset, key.data(), key.size());
+    auto set = (hash % (s_slots / ways)) * ways;
+    auto now = now_ms();
+    // Prefer the slot already holding the key, then an empty or expired one, then the one expiring first
+    slot* victim = nullptr;
+    for(size_t i = 0; i < ways; i++) {
+        auto s = get_slot(set + i);
+        if(s->hash == hash && s->key_len == key.size() && s->expires != 0) {
+            victim = s;
+            break;
+        }
+        if(!victim || s->expires < victim->expires) victim = s;
+    }
+
+    auto seq = victim->seq.load(std::memory_order_relaxed);
+    if((seq & 1) || !victim->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) return;
+    std::atomic_thread_fence(std::memory_order_release);
+    victim->hash = hash;
+    victim->key_len = static_cast<uint32_t>(key.size());
+    victim->data_len = static_cast<uint32_t>(data.size());
+    victim->expires = now + ttl_ms;
+    auto payload = reinterpret_cast<char*>(victim + 1);
+    memcpy(payload, key.data(), key.size());
+    memcpy(payload + key.size(), data.data(), data.size());
+    victim->seq.store(seq + 2, std::memory_order_release);
+}